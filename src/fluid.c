@@ -25,10 +25,28 @@ freely, subject to the following restrictions:
 #include <math.h>
 #include <stdio.h>
 #include <errno.h>
+#include <limits.h>
 
 #include "fluid.h"
 #include "log.h"
 #include "octtree.h"
+#include "fluid_fmm.h"
+#include "fluid_simd.h"
+#include "fluid_kernel.h"
+#include "fluid_moments.h"
+#include "thread_pool.h"
+#include "fluid_morton.h"
+#include "fluid_refit.h"
+#include "fluid_grid.h"
+#include "fluid_vic.h"
+#include "fluid_p3m.h"
+#include "fluid_diffuse.h"
+#include "fluid_stretch.h"
+#include "fluid_advect.h"
+#include "fluid_batch.h"
+
+// tracers handed to a worker at a time
+#define FLUID_TRACER_CHUNK 1024
 
 
 void fluid_log_vorton(char *name, struct vorton vorton)
@@ -43,6 +61,130 @@ void fluid_log_vorton(char *name, struct vorton vorton)
 
 
 
+// Free the arrays of a vorton_soa
+void vorton_soa_free(struct vorton_soa *soa)
+{
+	free(soa->block);
+	memset(soa, 0, sizeof(struct vorton_soa));
+}
+
+// Make room for count vortons, keeping the ones already there
+// returns 0 on success
+int vorton_soa_reserve(struct vorton_soa *soa, int count)
+{
+	// keep every array a whole number of the widest vector
+	int capacity = (count + FLUID_SOA_WIDTH - 1) & ~(FLUID_SOA_WIDTH - 1);
+	if(capacity == 0)
+		capacity = FLUID_SOA_WIDTH;
+	if(capacity <= soa->capacity)
+		return 0;
+
+	// 10 float arrays, 1 int array, and room to align the first one
+	size_t array_size = capacity * sizeof(float);
+	void *block = malloc(array_size * 11 + FLUID_SOA_WIDTH * sizeof(float));
+	if(block == NULL)
+	{
+		log_error("malloc(vorton_soa) %s", strerror(errno));
+		return 1;
+	}
+	memset(block, 0, array_size * 11 + FLUID_SOA_WIDTH * sizeof(float));
+
+	uintptr_t align = FLUID_SOA_WIDTH * sizeof(float);
+	char *base = (char*)(((uintptr_t)block + align - 1) & ~(align - 1));
+	float **arrays[10] = {
+		&soa->px, &soa->py, &soa->pz,
+		&soa->wx, &soa->wy, &soa->wz,
+		&soa->vx, &soa->vy, &soa->vz,
+		&soa->magnitude };
+	// copy everything, the nodes grow while they are being filled
+	for(int i=0; i<10; i++)
+	{
+		float *array = (float*)(base + array_size * i);
+		if(soa->capacity)
+			memcpy(array, *arrays[i], soa->capacity * sizeof(float));
+		*arrays[i] = array;
+	}
+	int32_t *counts = (int32_t*)(base + array_size * 10);
+	if(soa->capacity)
+		memcpy(counts, soa->counts, soa->capacity * sizeof(int32_t));
+	soa->counts = counts;
+
+	free(soa->block);
+	soa->block = block;
+	soa->capacity = capacity;
+	return 0;
+}
+
+// Reorder the vortons so entry i is the one that was at order[i], scratch
+// gives the room to do it and is swapped with soa
+// returns 0 on success
+int vorton_soa_permute(struct vorton_soa *soa, struct vorton_soa *scratch, const uint32_t *order)
+{
+	if(vorton_soa_reserve(scratch, soa->capacity))
+		return 1;
+
+	int count = soa->count;
+	int stale = scratch->count;
+	float *from[10] = {
+		soa->px, soa->py, soa->pz,
+		soa->wx, soa->wy, soa->wz,
+		soa->vx, soa->vy, soa->vz,
+		soa->magnitude };
+	float *to[10] = {
+		scratch->px, scratch->py, scratch->pz,
+		scratch->wx, scratch->wy, scratch->wz,
+		scratch->vx, scratch->vy, scratch->vz,
+		scratch->magnitude };
+	for(int a=0; a<10; a++)
+	{
+		for(int i=0; i<count; i++)
+			to[a][i] = from[a][order[i]];
+		// keep the padding zero, scratch may have held more vortons
+		if(stale > count)
+			memset(&to[a][count], 0, (stale - count) * sizeof(float));
+	}
+	for(int i=0; i<count; i++)
+		scratch->counts[i] = soa->counts[order[i]];
+	if(stale > count)
+		memset(&scratch->counts[count], 0, (stale - count) * sizeof(int32_t));
+	scratch->count = count;
+
+	struct vorton_soa swap = *soa;
+	*soa = *scratch;
+	*scratch = swap;
+	return 0;
+}
+
+// Zero the first count entries of every array
+void vorton_soa_zero(struct vorton_soa *soa, int count)
+{
+	size_t size = count * sizeof(float);
+	memset(soa->px, 0, size);
+	memset(soa->py, 0, size);
+	memset(soa->pz, 0, size);
+	memset(soa->wx, 0, size);
+	memset(soa->wy, 0, size);
+	memset(soa->wz, 0, size);
+	memset(soa->vx, 0, size);
+	memset(soa->vy, 0, size);
+	memset(soa->vz, 0, size);
+	memset(soa->magnitude, 0, size);
+	memset(soa->counts, 0, count * sizeof(int32_t));
+}
+
+// Gather one vorton out of a vorton_soa
+struct vorton vorton_soa_get(struct vorton_soa *soa, int i)
+{
+	struct vorton ret;
+	ret.p = (vec3){{soa->px[i], soa->py[i], soa->pz[i]}};
+	ret.w = (vec3){{soa->wx[i], soa->wy[i], soa->wz[i]}};
+	ret.v = (vec3){{soa->vx[i], soa->vy[i], soa->vz[i]}};
+	ret.weight = 0.0f;
+	ret.magnitude = soa->magnitude[i];
+	ret.count = soa->counts[i];
+	return ret;
+}
+
 // Initialise the Fluid Sim, allocating memory and all that.
 struct fluid_sim* fluid_init(float x, float y, float z, int max_depth)
 {
@@ -55,7 +197,7 @@ struct fluid_sim* fluid_init(float x, float y, float z, int max_depth)
 		return NULL;
 	}
 	memset(sim, 0, sizeof(struct fluid_sim));
-	sim->octtree = octtree_init(20);
+	sim->octtree = octtree_init(1);
 	if(sim->octtree == NULL)
 	{
 		log_fatal("octtree_init() failed");
@@ -63,15 +205,51 @@ struct fluid_sim* fluid_init(float x, float y, float z, int max_depth)
 		return NULL;
 	}
 	sim->max_depth = max_depth; // chosen by fair dice roll
-	sim->max_vortons = 20+10;	// why not
-	sim->vortons = malloc(sim->max_vortons * sizeof(struct vorton));
-	if(sim->vortons == NULL)
+	sim->theta = 0.5f;
+	sim->tree_build = FLUID_TREE_MORTON;
+	sim->refit_stale = 0.25f;
+	sim->aggregate = FLUID_AGGREGATE_QUADRUPOLE;
+	sim->grid_cells = 32;
+	sim->boundary = FLUID_BOUNDARY_OPEN;
+	sim->multigrid_cycles = 1;
+	sim->p3m_split = 1.5f;
+	sim->viscosity = 0.01f;
+	sim->integrator = FLUID_INTEGRATE_RK2;
+	sim->batch_mode = FLUID_BATCH_PACKET;
+	sim->local_order = 2;
+	sim->step = 1.0f / 60.0f;
+	sim->substeps = 4;
+	sim->cfl = 0.5f;
+	sim->step_min = 1.0f / 240.0f;
+	sim->step_max = 1.0f / 10.0f;
+	// the pools grow as vortons are added, see fluid_reserve()
+	if(fluid_reserve(sim, 1))
 	{
-		log_fatal("malloc(sim->vortons) %s", strerror(errno));
-		free(sim);
+		log_fatal("fluid_reserve() failed");
+		fluid_end(sim);
+		return NULL;
+	}
+	fluid_simd_init();
+	log_info("Fluid SIMD  : %s", fluid_simd_name());
+	if(fluid_kernel(sim, FLUID_KERNEL_CORE, FLUID_VORTON_RADIUS))
+	{
+		log_fatal("fluid_kernel() failed");
+		fluid_end(sim);
+		return NULL;
+	}
+	sim->pool = thread_pool_init(0);
+	if(sim->pool == NULL)
+	{
+		log_warning("thread_pool_init() failed, running single threaded");
+	}
+	sim->stats = calloc(thread_pool_size(sim->pool), sizeof(struct fluid_thread_stats));
+	if(sim->stats == NULL)
+	{
+		log_fatal("calloc(sim->stats) %s", strerror(errno));
+		fluid_end(sim);
 		return NULL;
 	}
-	memset(sim->vortons, 0, sim->max_vortons * sizeof(struct vorton));
+	log_info("Fluid Threads: %d", thread_pool_size(sim->pool));
 
 	// allocated all of our stuff
 	return sim;
@@ -80,19 +258,152 @@ struct fluid_sim* fluid_init(float x, float y, float z, int max_depth)
 // Free the memory allocated by the sim
 void fluid_end(struct fluid_sim *sim)
 {
+	thread_pool_free(sim->pool);
+	free(sim->stats);
+	fluid_morton_free(sim->morton);
+	fluid_refit_free(sim->refit);
+	fluid_moments_free(sim->moments);
+	fluid_fmm_free(sim->fmm);
+	fluid_grid_free(sim->grid);
+	fluid_vic_free(sim->vic);
+	fluid_p3m_free(sim->p3m);
+	fluid_diffuse_free(sim->diffuse);
+	fluid_stretch_free(sim->stretch);
+	fluid_advect_free(sim->advect);
+	free(sim->tracers_previous);
+	fluid_batch_free(sim->batch);
+	fluid_smoothing_free(sim->smoothing);
 	octtree_free(sim->octtree);
-	free(sim->vortons);
+	vorton_soa_free(&sim->vortons);
+	vorton_soa_free(&sim->nodes);
 	free(sim);
 }
 
+// Make room for size octtree nodes, and their aggregates
+// returns 0 on success
+int fluid_grow_nodes(struct fluid_sim *sim, uint32_t size)
+{
+	if(octtree_reserve(sim->octtree, size))
+		return 1;
+	// the aggregates are copied when they grow, so grow them geometrically
+	uint32_t pool_size = sim->octtree->node_pool_size;
+	if((uint32_t)sim->nodes.capacity >= pool_size)
+		return 0;
+	// they are counted in ints, rounded up to whole vectors
+	uint32_t most = INT_MAX - FLUID_SOA_WIDTH;
+	if(pool_size > most)
+	{
+		log_error("fluid_grow_nodes() %u nodes is more than %u", pool_size, most);
+		return 1;
+	}
+	uint32_t grown = (uint32_t)sim->nodes.capacity * 2;
+	if(grown < pool_size)
+		grown = pool_size;
+	if(grown > most)
+		grown = most;
+	return vorton_soa_reserve(&sim->nodes, (int)grown);
+}
+
+// Reserve room for an expected number of vortons, and the octtree nodes
+// they are likely to need. The pools still grow past this if they must.
+// returns 0 on success
+int fluid_reserve(struct fluid_sim *sim, int vortons)
+{
+	if(vorton_soa_reserve(&sim->vortons, vortons))
+		return 1;
+	sim->max_vortons = sim->vortons.capacity;
+
+	// a level holds at most one node per vorton, or one per cell
+	uint64_t nodes = 0;
+	for(int level=0; level<=sim->max_depth; level++)
+	{
+		uint64_t cells = (level < 21) ? (1ull << (3*level)) : UINT64_MAX;
+		nodes += cells < (uint64_t)vortons ? cells : (uint64_t)vortons;
+	}
+	if(nodes > OCTTREE_MAX_NODES)
+		nodes = OCTTREE_MAX_NODES;
+	return fluid_grow_nodes(sim, (uint32_t)nodes);
+}
+
+// Select how velocities are found, call after fluid_init()
+// returns 0 on success, or 1 if the mode could not be set up
+int fluid_velocity_mode(struct fluid_sim *sim, enum fluid_velocity_mode mode)
+{
+	if(mode == FLUID_VELOCITY_FMM && sim->fmm == NULL)
+	{
+		sim->fmm = fluid_fmm_init(sim->max_depth,
+			sim->octtree->node_pool_size, sim->max_vortons);
+		if(sim->fmm == NULL)
+		{
+			log_error("fluid_fmm_init() failed");
+			return 1;
+		}
+	}
+	// the far field is of points, so it has to start past the smoothing
+	if(mode == FLUID_VELOCITY_FMM
+	&& !fluid_fmm_level(sim->fmm, sim->octtree->volume, sim->smoothing->point2))
+	{
+		log_error("fluid_velocity_mode() the smoothing is too wide for the FMM's far field");
+		return 1;
+	}
+	if((mode == FLUID_VELOCITY_VIC || mode == FLUID_VELOCITY_P3M)
+	&& (sim->grid_cells < 2 || (sim->grid_cells & (sim->grid_cells - 1))))
+	{
+		log_error("fluid_velocity_mode() vortex-in-cell needs a power of two grid, not %d",
+			sim->grid_cells);
+		return 1;
+	}
+	if((mode == FLUID_VELOCITY_GRID || mode == FLUID_VELOCITY_VIC || mode == FLUID_VELOCITY_P3M)
+	&& sim->grid == NULL)
+	{
+		sim->grid = fluid_grid_init(sim->grid_cells);
+		if(sim->grid == NULL)
+		{
+			log_error("fluid_grid_init() failed");
+			return 1;
+		}
+	}
+	sim->velocity_mode = mode;
+	return 0;
+}
+
+// Add a vorton to the sim, it joins the octtree on the next update
+// returns the index of the vorton, or -1 if there is no room
+int fluid_add_vorton(struct fluid_sim *sim, vec3 position, vec3 vorticity)
+{
+	struct vorton_soa *vortons = &sim->vortons;
+	if(vortons->count >= vortons->capacity)
+	{
+		if(vorton_soa_reserve(vortons, vortons->capacity * 2))
+		{
+			log_warning("Attempted to add too many vortons");
+			return -1;
+		}
+		sim->max_vortons = vortons->capacity;
+	}
+	int i = vortons->count;
+	vortons->px[i] = position.x;
+	vortons->py[i] = position.y;
+	vortons->pz[i] = position.z;
+	vortons->wx[i] = vorticity.x;
+	vortons->wy[i] = vorticity.y;
+	vortons->wz[i] = vorticity.z;
+	vortons->vx[i] = vortons->vy[i] = vortons->vz[i] = 0.0f;
+	vortons->magnitude[i] = 0.0f;
+	vortons->counts[i] = 1;
+	vortons->count++;
+	return i;
+}
+
 // Used by fluid_sim_update()
 // Adds a vorton to the octtree, adding it's values to each node
 // in the octtree as it moves down
 void fluid_octtree_add_vorton(struct fluid_sim *sim, int j)
 {
 	struct octtree* octtree = sim->octtree;
-	struct vorton* vorton = &sim->vortons[j];
-	vec3 position = vorton->p;
+	struct vorton_soa *nodes = &sim->nodes;
+	vec3 position = (vec3){{sim->vortons.px[j], sim->vortons.py[j], sim->vortons.pz[j]}};
+	vec3 w = (vec3){{sim->vortons.wx[j], sim->vortons.wy[j], sim->vortons.wz[j]}};
 	vec3 rel_position = sub(position, octtree->origin);
 	if(vec3_lessthan_vec3(rel_position, (vec3){{0,0,0}}))
 	{
@@ -105,39 +416,28 @@ void fluid_octtree_add_vorton(struct fluid_sim *sim, int j)
 		return;
 	}
 
+	// find the magnitude of the vorton
+	float magnitude = (mag(w));//sqrt() may be optional
 	vec3 node_volume = octtree->volume;
-	int current_node_index = 0;
+	int n = 0;
 	// for each step down the octtree
 	for(int i=0; i<=sim->max_depth; i++)
 	{
-		struct vorton *current_node = &sim->vortons[current_node_index];
-
 		// add the current vorton to this node
-		if(current_node->count == 0)
+		// position is weighted proportionally to the magnitude of the vorton
+		nodes->px[n] += position.x * magnitude;
+		nodes->py[n] += position.y * magnitude;
+		nodes->pz[n] += position.z * magnitude;
+		nodes->wx[n] += w.x;
+		nodes->wy[n] += w.y;
+		nodes->wz[n] += w.z;
+		nodes->magnitude[n] += magnitude;
+		// add the index of the vorton to the leaf array, for diffusion later
+		if(nodes->counts[n] < 8)
 		{
-			*current_node = *vorton;
-			current_node->count = 1;
-			float magnitude = (mag(vorton->w));//sqrt() may be optional
-			current_node->p = mul(vorton->p, magnitude);
-			current_node->magnitude = magnitude;
-			sim->octtree->node_pool->leaf[0]=current_node_index;
-		}
-		else
-		{
-			// find the magnitude of the vorton
-			float magnitude = (mag(vorton->w));//sqrt() may be optional
-			// position is weighted proportionally to the magnitude of the vorton
-			current_node->p = add(mul(vorton->p, magnitude), current_node->p);
-			current_node->magnitude += magnitude;
-			current_node->w = add(current_node->w, vorton->w);
-			current_node->v = add(current_node->v, vorton->v);
-			// add the index of the vorton to the leaf array, for diffusion later
-			if(current_node->count<8)
-			{
-				sim->octtree->node_pool->leaf[current_node->count]=current_node_index;
-			}
-			current_node->count++;
+			octtree_node(octtree, n)->leaf[nodes->counts[n]] = j;
 		}
+		nodes->counts[n]++;
 
 		// if we've reached max_depth, we're finished
 		if(i >= sim->max_depth)
@@ -150,17 +450,16 @@ void fluid_octtree_add_vorton(struct fluid_sim *sim, int j)
 		int offset = octtree_child_position(rel_position, node_volume);
 		rel_position = octtree_child_relative(rel_position, node_volume);
 		// no node here, add one
-		if(octtree->node_pool[current_node_index].node[offset] == 0)
+		if(octtree_node(octtree, n)->node[offset] == 0)
 		{
-			if(octtree->node_count >= octtree->node_pool_size)
+			if(fluid_grow_nodes(sim, octtree->node_count + 1))
 			{
 				log_warning("Attempted to add too many nodes");
 				return;
 			}
-			octtree->node_pool[current_node_index].node[offset] = octtree->node_count;
-			octtree->node_count++;
+			octtree_node(octtree, n)->node[offset] = octtree_add_node(octtree);
 		}
-		current_node_index = octtree->node_pool[current_node_index].node[offset];
+		n = octtree_node(octtree, n)->node[offset];
 	}
 }
 
@@ -168,27 +467,85 @@ void fluid_octtree_add_vorton(struct fluid_sim *sim, int j)
 // Adds all of the Vortons to the Octtree, ready for processing a frame
 void fluid_tree_update(struct fluid_sim *sim)
 {
-	// delete the vorton list on each leaf node, and each vorton
-	octtree_empty(sim->octtree);
-	// reset the vortons that represent the octtree
-	memset(sim->vortons, 0, sizeof(struct vorton)*sim->octtree->node_pool_size);
+	struct vorton_soa *nodes = &sim->nodes;
+	// reset the vortons that represent the octtree, only the ones used
+	// last time need it, the rest are still zero
+	vorton_soa_zero(nodes, sim->octtree->node_count);
+	if(sim->moments)
+		sim->moments->valid = 0;
+	int built = 0;
+	if(sim->tree_build == FLUID_TREE_REFIT)
+	{
+		int rebuilds = sim->refit ? sim->refit->rebuilds : -1;
+		built = !fluid_refit_update(sim);
+		if(!built || sim->refit->rebuilds != rebuilds)
+			sim->tree_builds++;
+	}
+	else
+	{
+		sim->tree_builds++;
+		// the refit has to start again from its own build
+		if(sim->refit)
+			sim->refit->valid = 0;
+		// delete the vorton list on each leaf node, and each vorton
+		octtree_empty(sim->octtree);
+		if(sim->tree_build == FLUID_TREE_MORTON)
+			built = !fluid_morton_build(sim);
+	}
 
 	// walk all vortons, adding them to each octtree node in their chain
-	for(int i=sim->octtree->node_pool_size; i<sim->vorton_count+sim->octtree->node_pool_size; i++)
+	if(!built)
 	{
-		fluid_octtree_add_vorton(sim, i);
+		for(int i=0; i<sim->vortons.count; i++)
+		{
+			fluid_octtree_add_vorton(sim, i);
+		}
 	}
 
 	// average each branch of the oct-tree
-	for(int i=0; i<sim->octtree->node_count; i++)
+	nodes->count = sim->octtree->node_count;
+	for(int i=0; i<nodes->count; i++)
 	{
-		struct vorton* vorton = &sim->vortons[i];
 		// position is weighted average, based on magnitude of w
-		vorton->p = div(vorton->p, vorton->magnitude);
-//		vorton->w = div(vorton->w, vorton->count);
-//		vorton->v = div(vorton->v, vorton->count);
+		if(nodes->magnitude[i] > 0.0f)
+		{
+			float inverse = 1.0f / nodes->magnitude[i];
+			nodes->px[i] *= inverse;
+			nodes->py[i] *= inverse;
+			nodes->pz[i] *= inverse;
+		}
 	}
 
+	// before the moments, so the treecode it falls back on has them
+	if(sim->velocity_mode == FLUID_VELOCITY_FMM && fluid_fmm_update(sim))
+	{
+		log_error("fluid_fmm_update() failed, using the treecode");
+		sim->velocity_mode = FLUID_VELOCITY_TREE;
+	}
+
+	// only the treecode uses the moments
+	if(sim->aggregate != FLUID_AGGREGATE_MONOPOLE
+	&& (sim->velocity_mode == FLUID_VELOCITY_TREE || sim->velocity_mode == FLUID_VELOCITY_GRID)
+	&& fluid_moments_update(sim))
+	{
+		log_error("fluid_moments_update() failed, using monopoles");
+		sim->aggregate = FLUID_AGGREGATE_MONOPOLE;
+	}
+	if(sim->velocity_mode == FLUID_VELOCITY_GRID && fluid_grid_update(sim))
+	{
+		log_error("fluid_grid_update() failed, using the treecode");
+		sim->velocity_mode = FLUID_VELOCITY_TREE;
+	}
+	if(sim->velocity_mode == FLUID_VELOCITY_VIC && fluid_vic_update(sim, 0.0f))
+	{
+		log_error("fluid_vic_update() failed, using the treecode");
+		sim->velocity_mode = FLUID_VELOCITY_TREE;
+	}
+	if(sim->velocity_mode == FLUID_VELOCITY_P3M && fluid_p3m_update(sim))
+	{
+		log_error("fluid_p3m_update() failed, using the treecode");
+		sim->velocity_mode = FLUID_VELOCITY_TREE;
+	}
 }
 
 
@@ -203,312 +560,321 @@ int particle_inside_bound(vec3 particle, vec3 origin, vec3 volume)
 	return 1;
 }
 
-// determine the velocity imparted on a position by a single vorton
-vec3 fluid_accumulate_velocity(struct vorton vorton, vec3 position)
+// the largest dimension of a node at a given depth of the octtree
+static float fluid_node_size(struct fluid_sim *sim, int depth)
 {
-	float distmag;
-	float oneOverDist;
-	float distLaw;
-	float radius = 0.5f;
-	float rad2 = radius * radius;
-	vec3 distance = sub(position, vorton.p);
-
-	distmag = mag(distance) + 0.001f;
-	oneOverDist = finvsqrt(distmag);
-//	vect_smul(&dir, &dist, oneOverDist);
-	distLaw = (distmag < rad2)
-		? (oneOverDist / rad2) : (oneOverDist / distmag);
-
-	distance = mul(distance, distLaw);
-	vec3 w = mul(vorton.w,
-//		(1.0f / (4.0f * 3.1415926535f)) * (8.0f * rad2 * radius));
-		0.636619772367f * rad2 * radius);
-	return vec3_cross(w, distance);
+	vec3 volume = sim->octtree->volume;
+	float size = nmax(volume.x, nmax(volume.y, volume.z));
+	return ldexpf(size, -depth);
 }
 
-// determine the velocity imparted on a position by a single vorton, minus a child
-vec3 fluid_accumulate_part_velocity(struct fluid_sim *sim, int parent, int child, vec3 position)
+// Barnes-Hut traversal, a node that appears smaller than sim->theta from
+// the position is applied as a single vorton, otherwise its children are
+// visited. Nodes holding only a few vortons apply each of them directly.
+static vec3 fluid_tree_traverse(struct fluid_sim *sim, vec3 position, vec3 *gradient)
 {
-	// if there is no child, the parent is the only one that matters
-	if(child == 0)
-	{
-		return fluid_accumulate_velocity(sim->vortons[parent], position);
-	}
-
-	// if the parent has one child, we will take care of it next time around
-	if(sim->vortons[parent].count == 1)
+	struct octtree* octtree = sim->octtree;
+	vec3 result = (vec3){{0,0,0}};
+	float theta2 = sim->theta * sim->theta;
+	// each level pushes at most 8 children, and pops its parent
+	uint32_t stack[8*32+1];
+	int stack_depth[8*32+1];
+	int top = 0;
+	// the gather is summed by the vectorised kernel, or the plain C one
+	// when there is a gradient to find as well
+	struct fluid_gather gather;
+	fluid_gather_init(&gather, sim->smoothing, gradient);
+	// the moments add to the velocity, the gradient stays that of the
+	// monopoles, it only tilts and stretches vorticity
+	struct fluid_moment *moment = NULL;
+	if(sim->moments && sim->moments->valid)
+		moment = sim->moments->node;
+
+	if(sim->nodes.counts[0] == 0)
+		return result;
+
+	stack[top] = 0;
+	stack_depth[top] = 0;
+	top++;
+	while(top)
 	{
-		return (vec3){{0,0,0}};
-	}
+		top--;
+		uint32_t here = stack[top];
+		int depth = stack_depth[top];
+		int count = sim->nodes.counts[here];
 
-	// else subtract the childs contribution from the parent, and apply the parent
-	struct vorton difference;
-	struct vorton vorton;
-
-	vorton.w = sub(sim->vortons[parent].w, sim->vortons[child].w);
-	vorton.v = sub(sim->vortons[parent].v, sim->vortons[child].v);
+		// few enough vortons that we know all of them
+		if(count <= 8)
+		{
+			for(int i=0; i<count; i++)
+				fluid_gather_add(&gather, &sim->vortons,
+					octtree_node(octtree, here)->leaf[i], position, &result);
+			continue;
+		}
 
-	difference.p = mul(sim->vortons[parent].p, sim->vortons[parent].magnitude);
-	difference.p = sub(difference.p, mul(sim->vortons[child].p, sim->vortons[child].magnitude));
-	vorton.p = div(difference.p, sim->vortons[parent].magnitude-sim->vortons[child].magnitude);
+		vec3 centre = (vec3){{sim->nodes.px[here], sim->nodes.py[here], sim->nodes.pz[here]}};
+		vec3 distance = sub(position, centre);
+		float dist2 = distance.x*distance.x + distance.y*distance.y + distance.z*distance.z;
+		float size = fluid_node_size(sim, depth);
+		if(size*size < theta2 * dist2)
+		{
+			fluid_gather_add(&gather, &sim->nodes, here, position, &result);
+			if(moment && dist2 > sim->smoothing->point2)
+				result = add(result, fluid_moment_velocity(&moment[here], distance,
+					sim->aggregate, sim->smoothing->scale));
+			continue;
+		}
+		// a leaf too close for its moments to help
+		if(depth >= sim->max_depth)
+		{
+			fluid_gather_add(&gather, &sim->nodes, here, position, &result);
+			continue;
+		}
 
-	return fluid_accumulate_velocity(vorton, position);
+		// too close, open the node
+		for(int i=0; i<8; i++)
+		{
+			uint32_t child = octtree_node(octtree, here)->node[i];
+			if(child == 0)
+				continue;
+			if(top >= 8*32)
+			{
+				// deeper than we can track, use the aggregate
+				fluid_gather_add(&gather, &sim->nodes, child, position, &result);
+				continue;
+			}
+			stack[top] = child;
+			stack_depth[top] = depth + 1;
+			top++;
+		}
+	}
+	fluid_gather_flush(&gather, position, &result);
+	return result;
 }
 
-
 // find the velocity of the fluid at a given position
 vec3 fluid_tree_velocity(struct fluid_sim *sim, vec3 position)
 {
-	vec3 rel_position = sub(position, sim->octtree->origin);
-	vec3 half_volume = sim->octtree->volume;
-	vec3 result = (vec3){{0,0,0}};
-	struct octtree_node* nodes = sim->octtree->node_pool;
-	int here = 0;
-	for(int i=0; i<=sim->max_depth; i++)
-	{
-		int parent = here;
-		// find which child node to descend into
-		half_volume = mul(half_volume, 0.5);
-		int branch = octtree_child_position(rel_position, half_volume);
-		here = nodes[here].node[branch];
-		result = add(result, fluid_accumulate_part_velocity(sim, parent, here, rel_position));
+	return fluid_tree_traverse(sim, position, NULL);
+}
 
-		// does the child node exist?
-		if(here == 0)
-			break;
-	}
-	return result;
+// Find the velocity, and its gradient, in the same traversal.
+// gradient[a] is the gradient of velocity component a, the moments are in
+// the velocity but not the gradient
+vec3 fluid_tree_velocity_gradient(struct fluid_sim *sim, vec3 position, vec3 gradient[3])
+{
+	for(int a=0; a<3; a++)
+		gradient[a] = (vec3){{0,0,0}};
+	return fluid_tree_traverse(sim, position, gradient);
 }
 
 
-// exchange the vorticity between two vortons
-void fluid_vorton_exchange(struct vorton *left, struct vorton *right)
+// find the velocity of the fluid at a given position, using the selected method
+vec3 fluid_velocity(struct fluid_sim *sim, vec3 position)
 {
-	float viscosity = 0.01f;
-	float deltatime = 1.0f / 60.0f;
-	vec3 delta = sub(left->w, right->w);
-	vec3 exchange = mul(delta, viscosity * deltatime);
-	left->w = sub(left->w, exchange);
-	right->w = add(right->w, exchange);
+	switch(sim->velocity_mode)
+	{
+	case FLUID_VELOCITY_FMM:
+		return fluid_fmm_velocity(sim, position);
+	case FLUID_VELOCITY_DIRECT:
+		return fluid_direct_velocity(sim->smoothing, &sim->vortons, position);
+	case FLUID_VELOCITY_GRID:
+	case FLUID_VELOCITY_VIC:
+		return fluid_grid_velocity(sim->grid, position);
+	case FLUID_VELOCITY_P3M:
+		return fluid_p3m_velocity(sim, position);
+	case FLUID_VELOCITY_TREE:
+	default:
+		return fluid_tree_velocity(sim, position);
+	}
 }
 
-/*
-void fluid_diffuse(struct fluid_sim *sim)
-{
-	vorton* this;
-	vorton* other;
-	int layer = fluid_tree_size(sim->depth - 1);
-
-	int cells = sim->cells - 1;
-	for(int x=0; x<cells; x++)
-	for(int y=0; y<cells; y++)
-	for(int z=0; z<cells; z++)
-	{
-		int step = 0;
-		this = sim->tree[layer+cell_offset(x,y,z)].next;
-		while(this)
-		{
-			switch(step)
-			{
-			case 0:		// loop over local cell
-				other = this->next; // local exchange should be mul by 2
-				break;
-			case 1:		// loop over x+1 cell
-				other = sim->tree[layer+cell_offset(x+1,y,z)].next;
-				break;
-			case 2:		// loop over y+1 cell
-				other = sim->tree[layer+cell_offset(x,y+1,z)].next;
-				break;
-			case 3:		// loop over z+1 cell
-				other = sim->tree[layer+cell_offset(x,y,z+1)].next;
-				break;
-			}
 
-			while(other)
-			{
-				fluid_vorton_exchange(this, other);
-				other = other->next;
-			}
+struct fluid_advect_job {
+	struct fluid_sim *sim;
+	struct particle *particles;
+	vec3 *velocities;	// from fluid_velocity_batch(), or NULL
+	float deltatime;
+};
 
-			if(step < 3)
+// advect one chunk of tracers, run on a worker thread
+static void fluid_advect_tracers_chunk(void *data, int start, int end, int thread)
+{
+	struct fluid_advect_job *job = data;
+	struct fluid_sim *sim = job->sim;
+	struct particle *particles = job->particles;
+	int tracers = 0;
+
+	if(sim->velocity_mode == FLUID_VELOCITY_GRID || sim->velocity_mode == FLUID_VELOCITY_VIC)
+	{
+		// vectorised across tracers
+		tracers = fluid_grid_advect(sim->grid, particles + start, end - start, job->deltatime);
+	}
+	else
+	{
+		for(int i=start; i<end; i++)
+		{
+			if( particle_inside_bound(particles[i].p, sim->octtree->origin, sim->octtree->volume) )
 			{
-				step++;
-			}
-			else
-			{ // viscosity
-				vec3 temp = mul(this->w, (1.0f/60.0f) * 0.01f);
-				this->w = sub(this->w, temp);
-				step = 0;
-				this = this->next;
+				vec3 velocity = job->velocities ? job->velocities[i]
+					: fluid_velocity(sim, particles[i].p);
+				velocity = mul(velocity, job->deltatime);
+				particles[i].p = add(particles[i].p, velocity);
+				tracers++;
 			}
 		}
 	}
+
+	struct fluid_thread_stats *stats = &sim->stats[thread];
+	stats->chunks++;
+	stats->tracers += tracers;
+	stats->outside += (end - start) - tracers;
 }
-*/
 
-/*
-void fluid_velocity_grid(struct fluid_sim *sim)
+// move tracers along the velocity field for deltatime seconds
+void fluid_advect_tracers(struct fluid_sim *sim, struct particle *particles, int count, float deltatime)
 {
-	int layer = fluid_tree_size(sim->depth - 1);
-
-	int cells = sim->cells;
-	for(int y = 1; y < cells; y++)
-	for(int x = 1; x < cells; x++)
-	for(int z = 1; z < cells; z++)
+	struct fluid_advect_job job;
+	job.sim = sim;
+	job.particles = particles;
+	job.deltatime = deltatime;
+	job.velocities = NULL;
+
+	// the grids have their own vectorised path, the rest share tree walks
+	if(sim->velocity_mode != FLUID_VELOCITY_GRID && sim->velocity_mode != FLUID_VELOCITY_VIC
+	&& !fluid_batch_room(sim, count))
 	{
-		vec3 *v = &sim->tree[layer + cell_offset(x,y,z)].v;
-		vec3 pos = (vec3){{x,y,z}};
-		pos = add(mul(pos, sim->step), sim->octtree->origin);
-		*v = fluid_tree_velocity(sim, pos);
+		vec3 *positions = sim->batch->query;
+		for(int i=0; i<count; i++)
+			positions[i] = particles[i].p;
+		job.velocities = sim->batch->result;
+		fluid_velocity_batch(sim, positions, count, job.velocities);
 	}
-}
 
-float mix(float x, float y, float a)
-{
-	return x * (1.0-a) + y*a;
+	memset(sim->stats, 0, thread_pool_size(sim->pool) * sizeof(struct fluid_thread_stats));
+	thread_pool_run(sim->pool, count, FLUID_TRACER_CHUNK, fluid_advect_tracers_chunk, &job);
 }
 
-
-vec3 fluid_interpolate_velocity(struct fluid_sim *sim, vec3 pos)
+// Hand the simulation tracers to move every step. It keeps where they were
+// a step before, for fluid_tracers_interpolate(). returns 0 on success
+int fluid_tracers(struct fluid_sim *sim, struct particle *particles, int count)
 {
-	int layer = fluid_tree_size(sim->depth - 1);
+	free(sim->tracers_previous);
+	sim->tracers = NULL;
+	sim->tracers_previous = NULL;
+	sim->tracer_count = 0;
+	if(particles == NULL || count <= 0)
+		return 0;
 
-	vec3 rpos = sub(pos, sim->octtree->origin);
-	if( rpos.x < 0.0f || rpos.x > sim->octtree->volume.x )
+	sim->tracers_previous = malloc(count * sizeof(struct particle));
+	if(sim->tracers_previous == NULL)
 	{
-		log_warning("Flail x! x=%f, y=%f, z=%f", pos.x, pos.y, pos.z);
-		return;
+		log_error("malloc(tracers_previous) %s", strerror(errno));
+		return 1;
 	}
-	if( rpos.y < 0.0f || rpos.y > sim->octtree->volume.y )
-	{
-		log_warning("Flail y! x=%f, y=%f, z=%f", pos.x, pos.y, pos.z);
-		return;
-	}
-	if( rpos.z < 0.0f || rpos.z > sim->octtree->volume.z )
+	memcpy(sim->tracers_previous, particles, count * sizeof(struct particle));
+	sim->tracers = particles;
+	sim->tracer_count = count;
+	return 0;
+}
+
+// Where the tracers are for rendering, between their last two steps by
+// how far the clock is into the next step
+void fluid_tracers_interpolate(struct fluid_sim *sim, struct particle *out)
+{
+	float alpha = 1.0f;
+	if(sim->tracers_step > 0.0f)
+		alpha = nmin(sim->accumulator / sim->tracers_step, 1.0f);
+	for(int i=0; i<sim->tracer_count; i++)
 	{
-		log_warning("Flail z! x=%f, y=%f, z=%f", pos.x, pos.y, pos.z);
-		return;
+		struct particle *previous = &sim->tracers_previous[i];
+		struct particle *current = &sim->tracers[i];
+		out[i] = *current;
+		out[i].p.x = previous->p.x + (current->p.x - previous->p.x) * alpha;
+		out[i].p.y = previous->p.y + (current->p.y - previous->p.y) * alpha;
+		out[i].p.z = previous->p.z + (current->p.z - previous->p.z) * alpha;
 	}
-
-	int xp, yp, zp;
-	xp = (int)(rpos.x / sim->step.x);
-	yp = (int)(rpos.y / sim->step.y);
-	zp = (int)(rpos.z / sim->step.z);
-
-	float xd, yd, zd;
-	xd = fmod(rpos.x, sim->step.x) * sim->oneOverStep.x;
-	yd = fmod(rpos.y, sim->step.y) * sim->oneOverStep.y;
-	zd = fmod(rpos.z, sim->step.z) * sim->oneOverStep.z;
-
-	float ixd, iyd, izd;
-	ixd = 1.0f - xd;
-	iyd = 1.0f - yd;
-	izd = 1.0f - zd;
-
-	// http://en.wikipedia.org/wiki/Trilinear_interpolation
-	vec3 *a, *b, *c, *d, *e, *f, *g, *h;
-	a = &sim->tree[layer+cell_offset(xp, yp, zp)].v;	// c000
-	b = &sim->tree[layer+cell_offset(xp, yp, zp+1)].v;	// c001
-	c = &sim->tree[layer+cell_offset(xp, yp+1, zp)].v;	// c010
-	d = &sim->tree[layer+cell_offset(xp, yp+1, zp+1)].v;	// c011
-	e = &sim->tree[layer+cell_offset(xp+1, yp, zp)].v;	// c100
-	f = &sim->tree[layer+cell_offset(xp+1, yp, zp+1)].v;	// c101
-	g = &sim->tree[layer+cell_offset(xp+1, yp+1, zp)].v;	// c110
-	h = &sim->tree[layer+cell_offset(xp+1, yp+1, zp+1)].v;	// c111
-
-	vec3 i1 = add(mul(*a, izd), mul(*b, zd));
-	vec3 i2 = add(mul(*c, izd), mul(*d, zd));
-	vec3 j1 = add(mul(*e, izd), mul(*f, zd));
-	vec3 j2 = add(mul(*g, izd), mul(*h, zd));
-
-	vec3 w1 = add(mul(i1, iyd), mul(i2, yd));
-	vec3 w2 = add(mul(j1, iyd), mul(j2, yd));
-
-	return add(mul(w1, ixd), mul(w2, xd));
 }
 
-void fluid_stretch_tilt(struct fluid_sim *sim)
+// Pick the length of the next step, from the velocities this step started
+// with and the error the integrator estimates it made. The fastest vorton
+// may cross sim->cfl of a leaf cell, and the step shrinks to keep the
+// error under sim->tolerance. It can at most double from one to the next.
+// A step is never taken again, a large error only makes the next shorter
+static void fluid_adapt_step(struct fluid_sim *sim, float deltatime)
 {
-	float deltatime = 1.0f / 60.0f;
-	int layer = fluid_tree_size(sim->depth - 1);
-	int offset;
-
-	for(int i=sim->octtree->node_pool_size; i<sim->vorton_count; i++)
+	struct vorton_soa *vortons = &sim->vortons;
+	float fastest = 0.0f;
+	for(int i=0; i<vortons->count; i++)
 	{
-		struct vorton* vorton = &sim->vortons[i];
-		if( !particle_inside_bound(vorton->p, sim->octtree->origin, sim->octtree->volume) )
-			continue;
-
-		vec3 p = sub(vorton->p, sim->origin);
-
-		int px = (int)(p.x / sim->step.x);
-		int py = (int)(p.y / sim->step.y);
-		int pz = (int)(p.z / sim->step.z);
-
-		offset = layer+cell_offset(px,py,pz);
-		// FIXME: this line causes a segfault
-		// compute jacobian matrix
-		vec3 diff;
-		diff.x = sim->tree[offset].v.x - // TODO: segfault
-			sim->tree[layer+cell_offset(px+1,py,pz)].v.x;
-		diff.y = sim->tree[offset].v.y -
-			sim->tree[layer+cell_offset(px,py+1,pz)].v.x;
-		diff.z = sim->tree[offset].v.z -
-			sim->tree[layer+cell_offset(px,py,pz+1)].v.x;
-
-		mat3x3 jacobian = vec3_jacobian_vec3(diff, sim->step);
-		// multiply jacobian by vorticity vector
-		vec3 dw = mul(jacobian, vorton->w);
+		float speed = vortons->vx[i]*vortons->vx[i]
+			+ vortons->vy[i]*vortons->vy[i]
+			+ vortons->vz[i]*vortons->vz[i];
+		fastest = nmax(fastest, speed);
+	}
 
-		// integrate with euler
-		vec3 *w = &vorton->w;
-		*w = add(*w, mul(dw, deltatime * 0.2));
+	float next = nmin(sim->step_max, deltatime * 2.0f);
+	if(fastest > 0.0f)
+	{
+		vec3 volume = sim->octtree->volume;
+		float cell = ldexpf(nmin(volume.x, nmin(volume.y, volume.z)), -sim->max_depth);
+		next = nmin(next, sim->cfl * cell / sqrtf(fastest));
+	}
+	struct fluid_advect *advect = sim->advect;
+	if(sim->tolerance > 0.0f && advect && advect->error_order && advect->error > 0.0f)
+	{
+		float scale = powf(sim->tolerance / advect->error, 1.0f / advect->error_order);
+		next = nmin(next, deltatime * 0.9f * scale);
 	}
+	sim->step = nmax(next, sim->step_min);
 }
-*/
-void fluid_advect_tracers(struct fluid_sim *sim, struct particle *particles, int count)
-{
-	float deltatime = 1.0f / 60.0f;
 
-	for(int i=0; i<count; i++)
+// evolve the fluid simulation by one step of deltatime seconds
+void fluid_step(struct fluid_sim *sim, float deltatime)
+{
+	fluid_tree_update(sim);
+	// the tracers, the stretching and the first stage of advection all
+	// see the field the step started with, while the octtree's sums still
+	// match the vortons, so they go before anything changes vorticity
+	if(sim->tracer_count)
 	{
-		if( particle_inside_bound(particles[i].p, sim->octtree->origin, sim->octtree->volume) )
-		{
-//			vec3 velocity = fluid_interpolate_velocity(sim, particles[i].p);
-			vec3 velocity = fluid_tree_velocity(sim, particles[i].p);
-			velocity = mul(velocity, deltatime);
-			particles[i].p = add(particles[i].p, velocity);
-		}
+		memcpy(sim->tracers_previous, sim->tracers, sim->tracer_count * sizeof(struct particle));
+		fluid_advect_tracers(sim, sim->tracers, sim->tracer_count, deltatime);
+		sim->tracers_step = deltatime;
 	}
-
+	if(fluid_stretch_tilt(sim, deltatime))
+		log_error("fluid_stretch_tilt() failed");
+	// only needs the octtree's shape, not its sums
+	if(fluid_diffuse(sim, deltatime))
+		log_error("fluid_diffuse() failed");
+	if(fluid_advect_vortons(sim, deltatime))
+		log_error("fluid_advect_vortons() failed");
+	if(sim->adaptive)
+		fluid_adapt_step(sim, deltatime);
 }
 
-/*
-void fluid_advect_vortons(struct fluid_sim *sim)
+// Advance the simulation clock by frametime seconds, taking as many steps
+// of sim->step as fit, and no more than sim->substeps. sim->step is fixed
+// unless sim->adaptive is set. Time a slow frame cannot catch up on is
+// dropped. returns the steps taken
+int fluid_tick(struct fluid_sim *sim, float frametime)
 {
-	float deltatime = 1.0f / 60.0f;
-
-	for(int i=sim->octtree->node_pool_size; i<sim->vorton_count; i++)
+	int steps = 0;
+	sim->accumulator += frametime;
+	while(sim->accumulator >= sim->step)
 	{
-		struct vorton* vorton = &sim->vortons[i];
-		if( particle_inside_bound(vorton->p, sim->octtree->origin, sim->octtree->volume) )
+		if(steps == sim->substeps)
 		{
-			vec3 velocity = fluid_interpolate_velocity(sim, vorton->p);
-			velocity = mul(velocity, deltatime);
-			vorton->p = add(vorton->p, velocity);
+			sim->accumulator = fmodf(sim->accumulator, sim->step);
+			break;
 		}
+		// an adaptive step picks the next one
+		float deltatime = sim->step;
+		fluid_step(sim, deltatime);
+		sim->accumulator -= deltatime;
+		steps++;
 	}
-}
-*/
-
-// evolve the fluid simulation
-void fluid_tick(struct fluid_sim *sim)
-{
-	fluid_tree_update(sim);
-//	fluid_diffuse(sim);
-//	fluid_velocity_grid(sim);
-//	fluid_stretch_tilt(sim);
-//	fluid_advect_vortons(sim);
+	return steps;
 }
 
 // check that a position is inside the fluid volume, expanding it if not
@@ -20,10 +20,27 @@ freely, subject to the following restrictions:
    3. This notice may not be removed or altered from any source
    distribution.
 */
+#ifndef __DPB_FLUID_H__
+#define __DPB_FLUID_H__
+
 #include <stdint.h>
 #include "3dmaths.h"
 #include "octtree.h"
 
+struct fluid_smoothing;
+
+#define FLUID_VORTON_RADIUS 0.5f	// until fluid_kernel() picks another
+
+enum fluid_velocity_mode {
+	FLUID_VELOCITY_TREE,	// Barnes-Hut treecode
+	FLUID_VELOCITY_FMM,	// Fast Multipole Method
+	FLUID_VELOCITY_DIRECT,	// every vorton, vectorised, best for small counts
+	FLUID_VELOCITY_GRID,	// treecode on a grid, trilinear in between
+	FLUID_VELOCITY_VIC,	// vortex-in-cell, FFT on the same grid
+	FLUID_VELOCITY_P3M,	// vortex-in-cell for the far field, and
+				// the vortons near each point summed directly
+};
+
 struct vorton {
 	vec3 p;		// position
 	vec3 w;		// vorticity
@@ -33,12 +50,120 @@ struct vorton {
 	int count;
 };
 
+enum fluid_tree_build {
+	FLUID_TREE_INSERT,	// walk each vorton down the octtree in turn
+	FLUID_TREE_MORTON,	// sort by Morton key, build in parallel
+	FLUID_TREE_REFIT,	// keep the octtree, move vortons that change leaf,
+				// vortons are kept in key order so their indices change
+};
+
+enum fluid_integrator {
+	FLUID_INTEGRATE_EULER,	// one velocity per step, the one already found
+	FLUID_INTEGRATE_RK2,	// midpoint, one more tree update per step
+	FLUID_INTEGRATE_RK4,	// classic Runge-Kutta, three more per step
+};
+
+// how fluid_velocity_batch() walks the octtree, in FLUID_VELOCITY_TREE
+enum fluid_batch_mode {
+	FLUID_BATCH_SINGLE,	// one walk per query, in turn
+	FLUID_BATCH_PACKET,	// one walk per packet of nearby queries
+	FLUID_BATCH_LOCAL,	// one walk per leaf of queries, the far field
+				// as a Taylor series about the leaf
+	FLUID_BATCH_CACHED,	// one walk per leaf of queries, kept for as
+				// long as the octtree keeps its shape
+};
+
+// how much of a node's spread the treecode keeps, see fluid_moments.c
+enum fluid_aggregate {
+	FLUID_AGGREGATE_MONOPOLE,	// a single vorton at the centroid
+	FLUID_AGGREGATE_DIPOLE,		// and its first moment
+	FLUID_AGGREGATE_QUADRUPOLE,	// and its second
+};
+
+// how vorticity is spread around each vorton, see fluid_kernel()
+enum fluid_kernel {
+	FLUID_KERNEL_CORE,	// uniform inside the radius, a point outside it
+	FLUID_KERNEL_ROSENHEAD,	// Rosenhead-Moore, low order algebraic
+	FLUID_KERNEL_GAUSSIAN,	// Gaussian, the radius is its deviation
+	FLUID_KERNEL_ALGEBRAIC,	// Winckelmans-Leonard high order algebraic
+	FLUID_KERNEL_TABLE,	// any law, sampled, see fluid_kernel_table()
+};
+
+// what is beyond the volume, for FLUID_VELOCITY_VIC, P3M is always open
+enum fluid_boundary {
+	FLUID_BOUNDARY_OPEN,	// nothing, solved by FFT
+	FLUID_BOUNDARY_WALLS,	// no flow through the faces, solved by multigrid
+};
+
+// vortons laid out one array per field, each aligned and padded to the
+// widest vector, the padding always has zero vorticity
+struct vorton_soa {
+	int count;
+	int capacity;
+	void *block;	// every array lives in this one allocation
+	float *px, *py, *pz;	// position
+	float *wx, *wy, *wz;	// vorticity
+	float *vx, *vy, *vz;	// velocity
+	float *magnitude;	// for weighted average
+	int32_t *counts;	// vortons beneath an octtree node
+};
+
+// what each worker thread did during the last advection
+struct fluid_thread_stats {
+	int chunks;
+	int tracers;	// advected
+	int outside;	// skipped, outside the volume
+};
+
 struct fluid_sim {
 	int max_depth;
-	int max_vortons;
-	int vorton_count;
-	struct vorton *vortons;
+	float theta;	// Barnes-Hut opening angle, 0 opens every node
+	int max_vortons;	// room in the vorton pool, it grows as needed
+	struct vorton_soa vortons;
+	struct vorton_soa nodes;	// one per octtree node, the sum of its vortons
 	struct octtree *octtree;
+	enum fluid_tree_build tree_build;
+	struct fluid_morton *morton;
+	struct fluid_refit *refit;
+	int tree_builds;	// times the octtree nodes were numbered afresh
+	enum fluid_aggregate aggregate;
+	struct fluid_moments *moments;
+	float refit_stale;	// fraction of stale nodes that forces a full build
+	int keep_order;		// vortons keep their indices, refit does not sort them
+	enum fluid_velocity_mode velocity_mode;
+	struct fluid_smoothing *smoothing;
+	struct fluid_fmm *fmm;
+	struct fluid_grid *grid;
+	int grid_cells;	// velocity grid resolution along each axis,
+			// a power of two for FLUID_VELOCITY_VIC and P3M
+	struct fluid_vic *vic;
+	enum fluid_boundary boundary;
+	int multigrid_cycles;	// V-cycles per step, for FLUID_BOUNDARY_WALLS
+	struct fluid_p3m *p3m;
+	float p3m_split;	// grid cells the far field is smoothed over, or a
+				// fifth of the smoothing if that is wider, the
+				// near field reaches 5 times as far
+	float viscosity;	// kinematic, in squared volume units per second
+	struct fluid_diffuse *diffuse;
+	struct fluid_stretch *stretch;
+	enum fluid_integrator integrator;	// how vortons are advected
+	struct fluid_advect *advect;
+	struct fluid_batch *batch;
+	enum fluid_batch_mode batch_mode;
+	int local_order;	// of the series in FLUID_BATCH_LOCAL, 1 or 2
+	float step;		// simulation timestep, in seconds
+	int substeps;		// most steps in one fluid_tick()
+	float accumulator;	// frame time not yet simulated
+	int adaptive;		// each step picks the next step, see fluid_adapt_step()
+	float cfl;		// most of a leaf cell a vorton may cross in a step
+	float step_min, step_max;
+	float tolerance;	// most a vorton may be moved in error, 0 to not care
+	float tracers_step;	// time between the tracers and where they were
+	struct particle *tracers;	// moved every step, see fluid_tracers()
+	struct particle *tracers_previous;	// where they were a step before
+	int tracer_count;
+	struct thread_pool *pool;
+	struct fluid_thread_stats *stats;	// one per thread in the pool
 };
 
 struct particle {
@@ -48,9 +173,27 @@ struct particle {
 
 struct fluid_sim* fluid_init(float x, float y, float z, int depth);
 void fluid_end(struct fluid_sim *sim);
+int fluid_reserve(struct fluid_sim *sim, int vortons);
+int fluid_grow_nodes(struct fluid_sim *sim, uint32_t size);
+int fluid_velocity_mode(struct fluid_sim *sim, enum fluid_velocity_mode mode);
+int fluid_add_vorton(struct fluid_sim *sim, vec3 position, vec3 vorticity);
+struct vorton vorton_soa_get(struct vorton_soa *soa, int i);
+int vorton_soa_reserve(struct vorton_soa *soa, int count);
+void vorton_soa_free(struct vorton_soa *soa);
+void vorton_soa_zero(struct vorton_soa *soa, int count);
+int vorton_soa_permute(struct vorton_soa *soa, struct vorton_soa *scratch, const uint32_t *order);
 void fluid_tree_update(struct fluid_sim *sim);
+vec3 fluid_tree_velocity(struct fluid_sim *sim, vec3 position);
+vec3 fluid_tree_velocity_gradient(struct fluid_sim *sim, vec3 position, vec3 gradient[3]);
+vec3 fluid_velocity(struct fluid_sim *sim, vec3 position);
 
 
-void fluid_tick(struct fluid_sim *sim);
-void fluid_advect_tracers(struct fluid_sim *sim, struct particle *particles, int count);
+void fluid_step(struct fluid_sim *sim, float deltatime);
+int fluid_tick(struct fluid_sim *sim, float frametime);
+void fluid_advect_tracers(struct fluid_sim *sim, struct particle *particles, int count, float deltatime);
+int fluid_tracers(struct fluid_sim *sim, struct particle *particles, int count);
+void fluid_tracers_interpolate(struct fluid_sim *sim, struct particle *out);
 void fluid_bound(struct fluid_sim *sim, vec3 position);
+int particle_inside_bound(vec3 particle, vec3 origin, vec3 volume);
+
+#endif
@@ -0,0 +1,314 @@
+/*
+Copyright (c) 2020 Daniel Burke
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+// Vortons carried along by their own velocity field.
+// Each stage of the integrator puts every vorton at its trial position,
+// updates the octtree there, and asks it for the velocity at each of them
+// with fluid_velocity_batch(), so the field moves with the vortons as the
+// method expects.
+// The start positions are kept aside, and the vortons are put back at the
+// end with the weighted sum of the stage velocities.
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+
+#include "log.h"
+#include "fluid.h"
+#include "fluid_advect.h"
+#include "fluid_batch.h"
+#include "thread_pool.h"
+
+// vortons are shared out in chunks of this many
+#define FLUID_ADVECT_CHUNK 64
+
+// how far along the step a stage looks from the last stage's velocity,
+// and how much its velocity counts for
+struct fluid_advect_stage {
+	float step;
+	float weight;
+};
+
+// The first stage is the velocity already at each vorton, as
+// fluid_stretch_tilt() found it in sim->velocity_mode. Taking the
+// whole step with the velocity of stage estimate alone is a method one
+// order lower, how far apart the two land estimates the error.
+struct fluid_advect_method {
+	int stages;
+	struct fluid_advect_stage stage[4];
+	float scale;		// of the weighted sum
+	int estimate;		// -1 if there is no lower order method
+	int error_order;	// of the lower order method's error
+};
+
+static const struct fluid_advect_method fluid_advect_methods[] = {
+	[FLUID_INTEGRATE_EULER] = {1, {{0.0f, 1.0f}}, 1.0f, -1, 0},
+	// against Euler
+	[FLUID_INTEGRATE_RK2] = {2, {{0.0f, 0.0f}, {0.5f, 1.0f}}, 1.0f, 0, 2},
+	// against midpoint
+	[FLUID_INTEGRATE_RK4] = {4, {{0.0f, 1.0f}, {0.5f, 2.0f}, {0.5f, 2.0f}, {1.0f, 1.0f}},
+		1.0f / 6.0f, 1, 3},
+};
+
+struct fluid_advect_job {
+	struct fluid_sim *sim;
+	struct fluid_advect *advect;
+	float step;		// deltatime * the stage step
+	float weight;
+	float move;		// deltatime * the method scale
+	int estimate;		// keep this stage's velocity for the error
+	float deltatime;
+	vec3 *query, *result;	// trial positions, and their velocities
+};
+
+void fluid_advect_free(struct fluid_advect *advect)
+{
+	if(advect == NULL)
+		return;
+	free(advect->ox);
+	free(advect->oy);
+	free(advect->oz);
+	free(advect->kx);
+	free(advect->ky);
+	free(advect->kz);
+	free(advect->sx);
+	free(advect->sy);
+	free(advect->sz);
+	free(advect->ex);
+	free(advect->ey);
+	free(advect->ez);
+	free(advect->thread_error);
+	free(advect);
+}
+
+// make sure there is room for count vortons, worked on by threads
+static struct fluid_advect* fluid_advect_reserve(struct fluid_advect *advect,
+	int count, int threads)
+{
+	if(advect && advect->capacity >= count && advect->threads >= threads)
+		return advect;
+	fluid_advect_free(advect);
+
+	advect = malloc(sizeof(struct fluid_advect));
+	if(advect == NULL)
+	{
+		log_error("malloc(fluid_advect) %s", strerror(errno));
+		return NULL;
+	}
+	memset(advect, 0, sizeof(struct fluid_advect));
+	advect->capacity = count;
+	advect->ox = malloc(count * sizeof(float));
+	advect->oy = malloc(count * sizeof(float));
+	advect->oz = malloc(count * sizeof(float));
+	advect->kx = malloc(count * sizeof(float));
+	advect->ky = malloc(count * sizeof(float));
+	advect->kz = malloc(count * sizeof(float));
+	advect->sx = malloc(count * sizeof(float));
+	advect->sy = malloc(count * sizeof(float));
+	advect->sz = malloc(count * sizeof(float));
+	advect->ex = malloc(count * sizeof(float));
+	advect->ey = malloc(count * sizeof(float));
+	advect->ez = malloc(count * sizeof(float));
+	advect->threads = threads;
+	advect->thread_error = malloc(threads * sizeof(float));
+	if(!advect->ox || !advect->oy || !advect->oz
+	|| !advect->kx || !advect->ky || !advect->kz
+	|| !advect->sx || !advect->sy || !advect->sz
+	|| !advect->ex || !advect->ey || !advect->ez || !advect->thread_error)
+	{
+		log_error("malloc(fluid_advect) %s", strerror(errno));
+		fluid_advect_free(advect);
+		return NULL;
+	}
+	return advect;
+}
+
+// vortons that start outside the volume are not in the octtree, and stay put
+static inline int fluid_advect_inside(struct fluid_sim *sim, struct fluid_advect *advect, int i)
+{
+	vec3 p = {{advect->ox[i], advect->oy[i], advect->oz[i]}};
+	return particle_inside_bound(p, sim->octtree->origin, sim->octtree->volume);
+}
+
+// the first stage, the velocity each vorton already has where it starts
+static void fluid_advect_first(void *data, int start, int end, int thread)
+{
+	struct fluid_advect_job *job = data;
+	struct fluid_advect *advect = job->advect;
+	struct vorton_soa *vortons = &job->sim->vortons;
+
+	for(int i=start; i<end; i++)
+	{
+		advect->ox[i] = vortons->px[i];
+		advect->oy[i] = vortons->py[i];
+		advect->oz[i] = vortons->pz[i];
+		advect->kx[i] = vortons->vx[i];
+		advect->ky[i] = vortons->vy[i];
+		advect->kz[i] = vortons->vz[i];
+		advect->sx[i] = vortons->vx[i] * job->weight;
+		advect->sy[i] = vortons->vy[i] * job->weight;
+		advect->sz[i] = vortons->vz[i] * job->weight;
+		advect->ex[i] = vortons->vx[i];
+		advect->ey[i] = vortons->vy[i];
+		advect->ez[i] = vortons->vz[i];
+	}
+}
+
+// put the vortons a step along from the start by the last stage's velocity
+static void fluid_advect_trial(void *data, int start, int end, int thread)
+{
+	struct fluid_advect_job *job = data;
+	struct fluid_advect *advect = job->advect;
+	struct vorton_soa *vortons = &job->sim->vortons;
+
+	for(int i=start; i<end; i++)
+	{
+		if(fluid_advect_inside(job->sim, advect, i))
+		{
+			vortons->px[i] = advect->ox[i] + advect->kx[i] * job->step;
+			vortons->py[i] = advect->oy[i] + advect->ky[i] * job->step;
+			vortons->pz[i] = advect->oz[i] + advect->kz[i] * job->step;
+		}
+		job->query[i] = (vec3){{vortons->px[i], vortons->py[i], vortons->pz[i]}};
+	}
+}
+
+// add in the velocity at each trial position
+static void fluid_advect_stage(void *data, int start, int end, int thread)
+{
+	struct fluid_advect_job *job = data;
+	struct fluid_advect *advect = job->advect;
+
+	for(int i=start; i<end; i++)
+	{
+		if(!fluid_advect_inside(job->sim, advect, i))
+			continue;
+		vec3 velocity = job->result[i];
+		advect->kx[i] = velocity.x;
+		advect->ky[i] = velocity.y;
+		advect->kz[i] = velocity.z;
+		advect->sx[i] += velocity.x * job->weight;
+		advect->sy[i] += velocity.y * job->weight;
+		advect->sz[i] += velocity.z * job->weight;
+		if(job->estimate)
+		{
+			advect->ex[i] = velocity.x;
+			advect->ey[i] = velocity.y;
+			advect->ez[i] = velocity.z;
+		}
+	}
+}
+
+// move the vortons from where they started, once every stage is done,
+// and see how far the lower order step would have put them from there
+static void fluid_advect_move(void *data, int start, int end, int thread)
+{
+	struct fluid_advect_job *job = data;
+	struct fluid_advect *advect = job->advect;
+	struct vorton_soa *vortons = &job->sim->vortons;
+	float error = 0.0f;
+
+	for(int i=start; i<end; i++)
+	{
+		if(!fluid_advect_inside(job->sim, advect, i))
+			continue;
+		float dx = advect->sx[i] * job->move;
+		float dy = advect->sy[i] * job->move;
+		float dz = advect->sz[i] * job->move;
+		vortons->px[i] = advect->ox[i] + dx;
+		vortons->py[i] = advect->oy[i] + dy;
+		vortons->pz[i] = advect->oz[i] + dz;
+
+		dx -= advect->ex[i] * job->deltatime;
+		dy -= advect->ey[i] * job->deltatime;
+		dz -= advect->ez[i] * job->deltatime;
+		error = nmax(error, dx*dx + dy*dy + dz*dz);
+	}
+	advect->thread_error[thread] = nmax(advect->thread_error[thread], error);
+}
+
+// Move each vorton along the velocity field by sim->integrator, the
+// octtree must be up to date and each vorton's velocity already found,
+// as fluid_stretch_tilt() leaves it. Later stages update the octtree, it
+// is left as the last stage had it. An estimate of the error is left in
+// sim->advect. returns 0 on success
+int fluid_advect_vortons(struct fluid_sim *sim, float deltatime)
+{
+	int count = sim->vortons.count;
+	if(count == 0)
+		return 0;
+	if((unsigned)sim->integrator > FLUID_INTEGRATE_RK4)
+	{
+		log_error("fluid_advect_vortons() unknown integrator %d", sim->integrator);
+		return 1;
+	}
+	const struct fluid_advect_method *method = &fluid_advect_methods[sim->integrator];
+
+	int threads = thread_pool_size(sim->pool);
+	sim->advect = fluid_advect_reserve(sim->advect, sim->vortons.capacity, threads);
+	if(sim->advect == NULL)
+		return 1;
+	if(method->stages > 1 && fluid_batch_room(sim, count))
+		return 1;
+	struct fluid_advect *advect = sim->advect;
+
+	struct fluid_advect_job job;
+	job.sim = sim;
+	job.advect = advect;
+	job.move = deltatime * method->scale;
+	job.deltatime = deltatime;
+	job.estimate = 0;
+	job.query = sim->batch ? sim->batch->query : NULL;
+	job.result = sim->batch ? sim->batch->result : NULL;
+
+	job.weight = method->stage[0].weight;
+	thread_pool_run(sim->pool, count, FLUID_ADVECT_CHUNK, fluid_advect_first, &job);
+	// the stages index the vortons, a refit must not sort them
+	int keep_order = sim->keep_order;
+	sim->keep_order = 1;
+	for(int s=1; s<method->stages; s++)
+	{
+		job.step = deltatime * method->stage[s].step;
+		job.weight = method->stage[s].weight;
+		job.estimate = (s == method->estimate);
+		thread_pool_run(sim->pool, count, FLUID_ADVECT_CHUNK, fluid_advect_trial, &job);
+		fluid_tree_update(sim);
+		fluid_velocity_batch(sim, job.query, count, job.result);
+		thread_pool_run(sim->pool, count, FLUID_ADVECT_CHUNK, fluid_advect_stage, &job);
+	}
+	sim->keep_order = keep_order;
+
+	memset(advect->thread_error, 0, threads * sizeof(float));
+	thread_pool_run(sim->pool, count, FLUID_ADVECT_CHUNK, fluid_advect_move, &job);
+	advect->error = 0.0f;
+	advect->error_order = 0;
+	if(method->estimate >= 0)
+	{
+		for(int t=0; t<threads; t++)
+			advect->error = nmax(advect->error, advect->thread_error[t]);
+		advect->error = sqrtf(advect->error);
+		advect->error_order = method->error_order;
+	}
+	return 0;
+}
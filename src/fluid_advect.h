@@ -0,0 +1,45 @@
+/*
+Copyright (c) 2020 Daniel Burke
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+#ifndef __DPB_FLUID_ADVECT_H__
+#define __DPB_FLUID_ADVECT_H__
+
+struct fluid_sim;
+
+// per vorton integrator state
+struct fluid_advect {
+	int capacity;		// vortons
+	float *ox, *oy, *oz;	// position at the start of the step
+	float *kx, *ky, *kz;	// velocity from the last stage
+	float *sx, *sy, *sz;	// weighted sum of the stage velocities
+	float *ex, *ey, *ez;	// velocity of the lower order step in the method
+	int threads;
+	float *thread_error;	// per thread, the largest error squared
+	float error;		// largest distance between the two steps, last step
+	int error_order;	// error goes as deltatime to this power, 0 if none
+};
+
+void fluid_advect_free(struct fluid_advect *advect);
+int fluid_advect_vortons(struct fluid_sim *sim, float deltatime);
+
+#endif
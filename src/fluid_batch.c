@@ -0,0 +1,704 @@
+/*
+Copyright (c) 2020 Daniel Burke
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+// Velocity at many positions at once.
+// The queries are sorted along a Morton curve so neighbours in the list
+// are neighbours in space. In packet mode they are cut into packets, each
+// packet walks the octtree once, accepting a node only if it is far enough
+// from every query in the packet, and gathers what it meets into one list.
+// Every query then sums that list with the vectorised direct kernel.
+// In local mode the queries are cut by octtree leaf instead, and a leaf
+// walks once as a packet would. A node far enough from every query in it
+// is not added to the list but to a Taylor series of the velocity about
+// the middle of the leaf, which each query adds to its own sum for a few
+// multiplies. Dense tracers share one walk between thousands of them.
+// In cached mode the queries are cut by the deepest octtree node their
+// cell has, and that node's walk is kept in fluid_lists.c, so the next
+// batch over the same octtree only sums it again.
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+
+#include "log.h"
+#include "fluid.h"
+#include "fluid_batch.h"
+#include "fluid_morton.h"
+#include "fluid_simd.h"
+#include "fluid_kernel.h"
+#include "fluid_moments.h"
+#include "fluid_lists.h"
+#include "thread_pool.h"
+
+// queries that share one walk of the octtree
+#define FLUID_PACKET_SIZE 16
+// packets handed to a worker at a time
+#define FLUID_BATCH_CHUNK 4
+// depth of the sort key, finer than the octtree so packets stay tight
+#define FLUID_BATCH_DEPTH 10
+// queries handed to a worker at a time, when not using packets
+#define FLUID_BATCH_BLOCK 256
+// queries that share a kept list, on average at the least
+#define FLUID_BATCH_SHARE 4
+
+struct fluid_batch_job {
+	struct fluid_sim *sim;
+	struct fluid_batch *batch;
+	const vec3 *positions;
+	vec3 *out;
+	int count;
+};
+
+void fluid_batch_free(struct fluid_batch *batch)
+{
+	if(batch == NULL)
+		return;
+	free(batch->key);
+	free(batch->order);
+	free(batch->key_scratch);
+	free(batch->order_scratch);
+	free(batch->group);
+	free(batch->target);
+	fluid_lists_free(batch->lists);
+	if(batch->list)
+	{
+		for(int t=0; t<batch->threads; t++)
+			vorton_soa_free(&batch->list[t]);
+		free(batch->list);
+	}
+	if(batch->far)
+	{
+		for(int t=0; t<batch->threads; t++)
+			free(batch->far[t].node);
+		free(batch->far);
+	}
+	free(batch->query);
+	free(batch->result);
+	free(batch);
+}
+
+// make sure the batch exists, with sort room for count queries
+static struct fluid_batch* fluid_batch_reserve(struct fluid_sim *sim, int count)
+{
+	struct fluid_batch *batch = sim->batch;
+	if(batch == NULL)
+	{
+		batch = malloc(sizeof(struct fluid_batch));
+		if(batch == NULL)
+		{
+			log_error("malloc(fluid_batch) %s", strerror(errno));
+			return NULL;
+		}
+		memset(batch, 0, sizeof(struct fluid_batch));
+		batch->threads = thread_pool_size(sim->pool);
+		batch->list = calloc(batch->threads, sizeof(struct vorton_soa));
+		batch->far = calloc(batch->threads, sizeof(struct fluid_batch_far));
+		if(batch->list == NULL || batch->far == NULL)
+		{
+			log_error("calloc(fluid_batch) %s", strerror(errno));
+			free(batch->list);
+			free(batch->far);
+			free(batch);
+			return NULL;
+		}
+		sim->batch = batch;
+	}
+	if(batch->capacity >= count)
+		return batch;
+
+	free(batch->key);
+	free(batch->order);
+	free(batch->key_scratch);
+	free(batch->order_scratch);
+	free(batch->group);
+	free(batch->target);
+	batch->capacity = count;
+	batch->key = malloc(count * sizeof(uint32_t));
+	batch->order = malloc(count * sizeof(uint32_t));
+	batch->key_scratch = malloc(count * sizeof(uint32_t));
+	batch->order_scratch = malloc(count * sizeof(uint32_t));
+	batch->group = malloc((count + 1) * sizeof(uint32_t));
+	batch->target = malloc((count + 1) * sizeof(struct fluid_target));
+	if(!batch->key || !batch->order || !batch->key_scratch || !batch->order_scratch || !batch->group
+	|| !batch->target)
+	{
+		log_error("malloc(fluid_batch) %s", strerror(errno));
+		free(batch->key);
+		free(batch->order);
+		free(batch->key_scratch);
+		free(batch->order_scratch);
+		free(batch->group);
+		free(batch->target);
+		batch->key = batch->order = batch->key_scratch = batch->order_scratch = NULL;
+		batch->group = NULL;
+		batch->target = NULL;
+		batch->capacity = 0;
+		return NULL;
+	}
+	return batch;
+}
+
+// Make sure sim->batch has room for callers to gather count queries and
+// their results into. returns 0 on success
+int fluid_batch_room(struct fluid_sim *sim, int count)
+{
+	struct fluid_batch *batch = fluid_batch_reserve(sim, 0);
+	if(batch == NULL)
+		return 1;
+	if(batch->query_capacity >= count)
+		return 0;
+	free(batch->query);
+	free(batch->result);
+	batch->query = malloc(count * sizeof(vec3));
+	batch->result = malloc(count * sizeof(vec3));
+	if(!batch->query || !batch->result)
+	{
+		log_error("malloc(fluid_batch) %s", strerror(errno));
+		free(batch->query);
+		free(batch->result);
+		batch->query = batch->result = NULL;
+		batch->query_capacity = 0;
+		return 1;
+	}
+	batch->query_capacity = count;
+	return 0;
+}
+
+// one query at a time, for the modes that have no octtree to share
+static void fluid_batch_single(void *data, int start, int end, int thread)
+{
+	struct fluid_batch_job *job = data;
+	for(int i=start; i<end; i++)
+		job->out[i] = fluid_velocity(job->sim, job->positions[i]);
+}
+
+static void fluid_batch_keys(void *data, int start, int end, int thread)
+{
+	struct fluid_batch_job *job = data;
+	struct fluid_batch *batch = job->batch;
+	for(int i=start; i<end; i++)
+	{
+		batch->order[i] = i;
+		batch->key[i] = fluid_morton_key(job->sim->octtree, FLUID_BATCH_DEPTH, job->positions[i]);
+	}
+}
+
+// least significant digit radix sort of the keys and their queries, the
+// keys are 3*FLUID_BATCH_DEPTH bits, and one more for outside the volume
+static void fluid_batch_sort(struct fluid_batch *batch, int count)
+{
+	uint32_t histogram[2048];
+	for(int shift=0; shift < 3*FLUID_BATCH_DEPTH + 1; shift += 11)
+	{
+		memset(histogram, 0, sizeof(histogram));
+		for(int i=0; i<count; i++)
+			histogram[(batch->key[i] >> shift) & 2047]++;
+		uint32_t total = 0;
+		for(int d=0; d<2048; d++)
+		{
+			uint32_t here = histogram[d];
+			histogram[d] = total;
+			total += here;
+		}
+		for(int i=0; i<count; i++)
+		{
+			uint32_t to = histogram[(batch->key[i] >> shift) & 2047]++;
+			batch->key_scratch[to] = batch->key[i];
+			batch->order_scratch[to] = batch->order[i];
+		}
+		uint32_t *swap = batch->key;
+		batch->key = batch->key_scratch;
+		batch->key_scratch = swap;
+		swap = batch->order;
+		batch->order = batch->order_scratch;
+		batch->order_scratch = swap;
+	}
+}
+
+// add a vorton to what the packet interacts with
+static inline int fluid_batch_push(struct vorton_soa *list, struct vorton_soa *from, uint32_t i)
+{
+	if(list->count == list->capacity
+	&& vorton_soa_reserve(list, list->capacity * 2))
+		return 1;
+	int n = list->count++;
+	list->px[n] = from->px[i];
+	list->py[n] = from->py[i];
+	list->pz[n] = from->pz[i];
+	list->wx[n] = from->wx[i];
+	list->wy[n] = from->wy[i];
+	list->wz[n] = from->wz[i];
+	return 0;
+}
+
+// note a node the packet takes whole, to add its moments later
+static inline int fluid_batch_far_push(struct fluid_batch_far *far, uint32_t node)
+{
+	if(far->count == far->capacity)
+	{
+		int capacity = far->capacity ? far->capacity * 2 : 256;
+		uint32_t *grown = realloc(far->node, capacity * sizeof(uint32_t));
+		if(grown == NULL)
+		{
+			log_error("realloc(fluid_batch_far) %s", strerror(errno));
+			return 1;
+		}
+		far->node = grown;
+		far->capacity = capacity;
+	}
+	far->node[far->count++] = node;
+	return 0;
+}
+
+// squared distance from a point to the packet's bounding box
+static inline float fluid_batch_distance2(vec3 low, vec3 high, float x, float y, float z)
+{
+	float dx = nmax(0.0f, nmax(low.x - x, x - high.x));
+	float dy = nmax(0.0f, nmax(low.y - y, y - high.y));
+	float dz = nmax(0.0f, nmax(low.z - z, z - high.z));
+	return dx*dx + dy*dy + dz*dz;
+}
+
+// Walk the octtree once for a packet, as fluid_tree_velocity() does for a
+// single position, with the distance to a node taken from the nearest
+// point of the packet's bounds. Nodes whose moments apply also go on far,
+// if far is not NULL. If local is not NULL, a node whose size and the
+// packet's together pass the opening angle from the packet's middle goes
+// into local instead of the list. returns 0 on success
+static int fluid_batch_walk(struct fluid_sim *sim, struct vorton_soa *list,
+	struct fluid_batch_far *far, struct fluid_local *local, vec3 low, vec3 high)
+{
+	struct octtree *octtree = sim->octtree;
+	struct vorton_soa *nodes = &sim->nodes;
+	struct vorton_soa *vortons = &sim->vortons;
+	const struct fluid_moment *moment = far ? sim->moments->node : NULL;
+	float theta2 = sim->theta * sim->theta;
+	float volume = nmax(octtree->volume.x, nmax(octtree->volume.y, octtree->volume.z));
+	vec3 centre = (vec3){{(low.x + high.x) * 0.5f, (low.y + high.y) * 0.5f, (low.z + high.z) * 0.5f}};
+	vec3 half = sub(high, centre);
+	float radius = sqrtf(half.x*half.x + half.y*half.y + half.z*half.z);
+	float point2 = sim->smoothing->point2;
+	float point = sqrtf(point2);
+	uint32_t stack[8*32+1];
+	int stack_depth[8*32+1];
+	int top = 0;
+
+	list->count = 0;
+	if(far)
+		far->count = 0;
+	if(local)
+		memset(local, 0, sizeof(struct fluid_local));
+	if(nodes->counts[0] == 0)
+		return 0;
+
+	stack[top] = 0;
+	stack_depth[top] = 0;
+	top++;
+	while(top)
+	{
+		top--;
+		uint32_t here = stack[top];
+		int depth = stack_depth[top];
+		int count = nodes->counts[here];
+		float size = ldexpf(volume, -depth);
+
+		if(local)
+		{
+			vec3 r = (vec3){{centre.x - nodes->px[here], centre.y - nodes->py[here], centre.z - nodes->pz[here]}};
+			float reach = size + radius;
+			float gap = reach + point;
+			float d2 = r.x*r.x + r.y*r.y + r.z*r.z;
+			// the series are of the point law, so only clear of smoothing
+			if(reach*reach < theta2 * d2 && gap*gap < d2)
+			{
+				// a few vortons go in as they are
+				struct octtree_node *node = octtree_node(octtree, here);
+				for(int i=0; count <= 8 && i<count; i++)
+				{
+					uint32_t j = node->leaf[i];
+					vec3 w = (vec3){{vortons->wx[j], vortons->wy[j], vortons->wz[j]}};
+					vec3 rj = (vec3){{centre.x - vortons->px[j], centre.y - vortons->py[j], centre.z - vortons->pz[j]}};
+					fluid_local_add(local, w, rj, sim->local_order);
+				}
+				if(count > 8)
+				{
+					vec3 w = (vec3){{nodes->wx[here], nodes->wy[here], nodes->wz[here]}};
+					fluid_local_add(local, w, r, sim->local_order);
+					// the moments only at the middle, they fade faster
+					if(moment)
+						local->u = add(local->u, fluid_moment_velocity(&moment[here], r,
+							sim->aggregate, 1.0f));
+				}
+				continue;
+			}
+		}
+
+		if(count <= 8)
+		{
+			for(int i=0; i<count; i++)
+				if(fluid_batch_push(list, vortons, octtree_node(octtree, here)->leaf[i]))
+					return 1;
+			continue;
+		}
+
+		float dist2 = fluid_batch_distance2(low, high, nodes->px[here], nodes->py[here], nodes->pz[here]);
+		if(size*size < theta2 * dist2)
+		{
+			if(fluid_batch_push(list, nodes, here))
+				return 1;
+			if(far && dist2 > point2 && fluid_batch_far_push(far, here))
+				return 1;
+			continue;
+		}
+		if(depth >= sim->max_depth)
+		{
+			if(fluid_batch_push(list, nodes, here))
+				return 1;
+			continue;
+		}
+
+		for(int i=0; i<8; i++)
+		{
+			uint32_t child = octtree_node(octtree, here)->node[i];
+			if(child == 0)
+				continue;
+			if(top >= 8*32)
+			{
+				if(fluid_batch_push(list, nodes, child))
+					return 1;
+				continue;
+			}
+			stack[top] = child;
+			stack_depth[top] = depth + 1;
+			top++;
+		}
+	}
+	return 0;
+}
+
+// one query at a time in sorted order, to compare interleaving against
+static void fluid_batch_sorted(void *data, int start, int end, int thread)
+{
+	struct fluid_batch_job *job = data;
+	struct fluid_batch *batch = job->batch;
+	for(int q=start; q<end; q++)
+	{
+		uint32_t i = batch->order[q];
+		job->out[i] = fluid_tree_velocity(job->sim, job->positions[i]);
+	}
+}
+
+// Sum what a walk gathered into list for the queries from first up to
+// last in sorted order, with the moments of the far nodes, and with local
+// the Taylor series about centre
+static void fluid_batch_sum(struct fluid_batch_job *job, int first, int last, struct vorton_soa *list,
+	const uint32_t *far, int far_count, struct fluid_local *local, vec3 centre)
+{
+	struct fluid_batch *batch = job->batch;
+	struct fluid_sim *sim = job->sim;
+	struct vorton_soa *nodes = &sim->nodes;
+	const struct fluid_moment *moment = sim->moments ? sim->moments->node : NULL;
+
+	// the kernel works in whole vectors, the rest of the last one
+	// has no vorticity
+	int padded = (list->count + FLUID_SOA_WIDTH - 1) & ~(FLUID_SOA_WIDTH - 1);
+	for(int n=list->count; n<padded; n++)
+		list->wx[n] = list->wy[n] = list->wz[n] = 0.0f;
+
+	for(int q=first; q<last; q++)
+	{
+		uint32_t i = batch->order[q];
+		vec3 position = job->positions[i];
+		vec3 result = fluid_direct_velocity(sim->smoothing, list, position);
+		for(int f=0; f<far_count; f++)
+		{
+			uint32_t n = far[f];
+			vec3 middle = (vec3){{nodes->px[n], nodes->py[n], nodes->pz[n]}};
+			result = add(result, fluid_moment_velocity(&moment[n], sub(position, middle),
+				sim->aggregate, sim->smoothing->scale));
+		}
+		if(local)
+			result = add(result, fluid_local_velocity(local, sub(position, centre),
+				sim->local_order, sim->smoothing->scale));
+		job->out[i] = result;
+	}
+}
+
+// Walk the octtree once for the queries from first up to last in sorted
+// order, and sum what it gathered for each of them. With local, the far
+// field is a Taylor series about the middle of their bounds
+static void fluid_batch_share(struct fluid_batch_job *job, int first, int last,
+	int thread, struct fluid_local *local)
+{
+	struct fluid_batch *batch = job->batch;
+	struct vorton_soa *list = &batch->list[thread];
+	struct fluid_sim *sim = job->sim;
+	struct fluid_moments *moments = sim->moments;
+	const struct fluid_moment *moment = (moments && moments->valid) ? moments->node : NULL;
+	struct fluid_batch_far *far = moment ? &batch->far[thread] : NULL;
+
+	vec3 low = job->positions[batch->order[first]];
+	vec3 high = low;
+	for(int q=first+1; q<last; q++)
+	{
+		vec3 position = job->positions[batch->order[q]];
+		low = (vec3){{nmin(low.x, position.x), nmin(low.y, position.y), nmin(low.z, position.z)}};
+		high = (vec3){{nmax(high.x, position.x), nmax(high.y, position.y), nmax(high.z, position.z)}};
+	}
+	vec3 centre = (vec3){{(low.x + high.x) * 0.5f, (low.y + high.y) * 0.5f, (low.z + high.z) * 0.5f}};
+
+	if(fluid_batch_walk(sim, list, far, local, low, high))
+	{
+		// out of memory for the list, go one at a time
+		for(int q=first; q<last; q++)
+		{
+			uint32_t i = batch->order[q];
+			job->out[i] = fluid_tree_velocity(job->sim, job->positions[i]);
+		}
+		return;
+	}
+	fluid_batch_sum(job, first, last, list, far ? far->node : NULL, far ? far->count : 0, local, centre);
+}
+
+// walk the octtree for each packet, and sum its list for every query in it
+static void fluid_batch_packets(void *data, int start, int end, int thread)
+{
+	struct fluid_batch_job *job = data;
+	for(int p=start; p<end; p++)
+	{
+		int first = p * FLUID_PACKET_SIZE;
+		int last = nmin(first + FLUID_PACKET_SIZE, job->count);
+		fluid_batch_share(job, first, last, thread, NULL);
+	}
+}
+
+// walk the octtree for each leaf's queries, with a local expansion
+static void fluid_batch_leaves(void *data, int start, int end, int thread)
+{
+	struct fluid_batch_job *job = data;
+	struct fluid_batch *batch = job->batch;
+	uint32_t outside = 1u << (3*FLUID_BATCH_DEPTH);
+	struct fluid_local local;
+
+	for(int g=start; g<end; g++)
+	{
+		int first = batch->group[g];
+		int last = batch->group[g+1];
+		// no leaf to share, and the bounds could span anything
+		if(batch->key[first] == outside)
+		{
+			for(int q=first; q<last; q++)
+			{
+				uint32_t i = batch->order[q];
+				job->out[i] = fluid_tree_velocity(job->sim, job->positions[i]);
+			}
+			continue;
+		}
+		fluid_batch_share(job, first, last, thread, &local);
+	}
+}
+
+// Gather a target's kept list into a thread's list, the vortons of its
+// leaves and its nodes, and sum it for the queries from first up to last.
+// returns 0 on success
+static int fluid_batch_list(struct fluid_batch_job *job, int first, int last, int thread,
+	const struct fluid_list *target)
+{
+	struct fluid_sim *sim = job->sim;
+	struct octtree *octtree = sim->octtree;
+	struct vorton_soa *list = &job->batch->list[thread];
+	struct vorton_soa *nodes = &sim->nodes;
+	struct fluid_moments *moments = sim->moments;
+	const uint32_t *entry = job->batch->lists->entry + target->start;
+
+	list->count = 0;
+	for(uint32_t e=0; e<target->leaves; e++)
+	{
+		uint32_t n = entry[e];
+		struct octtree_node *leaf = octtree_node(octtree, n);
+		for(int i=0; i<nodes->counts[n]; i++)
+			if(fluid_batch_push(list, &sim->vortons, leaf->leaf[i]))
+				return 1;
+	}
+	entry += target->leaves;
+	for(uint32_t e=0; e < target->nodes + target->far; e++)
+		if(fluid_batch_push(list, nodes, entry[e]))
+			return 1;
+
+	// without moments the far nodes are only their sums
+	int far = (moments && moments->valid) ? target->far : 0;
+	fluid_batch_sum(job, first, last, list, entry + target->nodes, far, NULL, (vec3){{0,0,0}});
+	return 0;
+}
+
+// sum each group's kept list for every query in it
+static void fluid_batch_cached(void *data, int start, int end, int thread)
+{
+	struct fluid_batch_job *job = data;
+	struct fluid_batch *batch = job->batch;
+	struct fluid_lists *lists = batch->lists;
+
+	for(int g=start; g<end; g++)
+	{
+		int first = batch->group[g];
+		int last = batch->group[g+1];
+		uint32_t node = batch->target[g].node;
+		// outside the volume there is no cell to share
+		if(node == FLUID_LISTS_NONE)
+		{
+			for(int q=first; q<last; q++)
+			{
+				uint32_t i = batch->order[q];
+				job->out[i] = fluid_tree_velocity(job->sim, job->positions[i]);
+			}
+			continue;
+		}
+		if(lists == NULL || lists->list[node].start == FLUID_LISTS_NONE
+		|| fluid_batch_list(job, first, last, thread, &lists->list[node]))
+			fluid_batch_share(job, first, last, thread, NULL);
+	}
+}
+
+// Cut the sorted queries by the deepest octtree node their cell has, no
+// deeper than the sort key, or than leaves a few queries to a cell.
+// Consecutive cells under the same node are one group, and each group
+// notes the node and its cell, for fluid_lists_update()
+static void fluid_batch_targets(struct fluid_sim *sim, struct fluid_batch *batch, int count)
+{
+	int depth = nmin(sim->max_depth, FLUID_BATCH_DEPTH);
+	// a list is gathered once per group, too many groups and that costs
+	// more than the sums
+	while(depth > 0 && ((uint64_t)FLUID_BATCH_SHARE << 3*depth) > (uint64_t)count)
+		depth--;
+	int shift = 3 * (FLUID_BATCH_DEPTH - depth);
+	uint32_t outside = 1u << (3*FLUID_BATCH_DEPTH);
+	int groups = 0;
+	int first = 0;
+	while(first < count)
+	{
+		int last = first + 1;
+		uint32_t cell = batch->key[first] >> shift;
+		while(last < count && (batch->key[last] >> shift) == cell)
+			last++;
+
+		struct fluid_target target = {FLUID_LISTS_NONE, 0, 0};
+		if(batch->key[first] != outside)
+		{
+			target.node = 0;
+			while(target.depth < depth)
+			{
+				uint32_t digit = (cell >> 3*(depth - target.depth - 1)) & 7;
+				uint32_t child = octtree_node(sim->octtree, target.node)->node[digit];
+				if(child == 0)
+					break;
+				target.node = child;
+				target.depth++;
+			}
+			target.key = cell >> 3*(depth - target.depth);
+		}
+		if(groups == 0 || target.node == FLUID_LISTS_NONE
+		|| target.node != batch->target[groups-1].node)
+		{
+			batch->group[groups] = first;
+			batch->target[groups] = target;
+			groups++;
+		}
+		first = last;
+	}
+	batch->group[groups] = count;
+	batch->group_count = groups;
+}
+
+// Cut the sorted queries where their leaf changes, the leaves of a deep
+// octtree are cut no finer than the sort key. Leaves with few queries are
+// run together up to a packet, so sparse queries walk no more than packets
+static void fluid_batch_group(struct fluid_sim *sim, struct fluid_batch *batch, int count)
+{
+	int shift = 3 * (FLUID_BATCH_DEPTH - nmin(sim->max_depth, FLUID_BATCH_DEPTH));
+	uint32_t outside = 1u << (3*FLUID_BATCH_DEPTH);
+	int groups = 0;
+	int first = 0;
+	while(first < count)
+	{
+		int last = first + 1;
+		while(last < count && (batch->key[last] >> shift) == (batch->key[first] >> shift))
+			last++;
+		int size = groups ? first - (int)batch->group[groups-1] : 0;
+		if(groups == 0 || size + (last - first) > FLUID_PACKET_SIZE
+		|| batch->key[first] == outside)
+			batch->group[groups++] = first;
+		first = last;
+	}
+	batch->group[groups] = count;
+	batch->group_count = groups;
+}
+
+// The velocity at each of count positions, into out, walking the octtree
+// as sim->batch_mode says. Runs on the thread pool, so it is called from
+// the main thread and not from a worker.
+void fluid_velocity_batch(struct fluid_sim *sim, const vec3 *positions, int count, vec3 *out)
+{
+	struct fluid_batch_job job;
+	job.sim = sim;
+	job.positions = positions;
+	job.out = out;
+	job.count = count;
+	if(count <= 0)
+		return;
+
+	job.batch = NULL;
+	if(sim->velocity_mode == FLUID_VELOCITY_TREE)
+		job.batch = fluid_batch_reserve(sim, count);
+	if(job.batch == NULL)
+	{
+		thread_pool_run(sim->pool, count, FLUID_BATCH_BLOCK, fluid_batch_single, &job);
+		return;
+	}
+
+	thread_pool_run(sim->pool, count, FLUID_BATCH_BLOCK, fluid_batch_keys, &job);
+	fluid_batch_sort(job.batch, count);
+	switch(sim->batch_mode)
+	{
+	case FLUID_BATCH_PACKET:
+	{
+		int packets = (count + FLUID_PACKET_SIZE - 1) / FLUID_PACKET_SIZE;
+		thread_pool_run(sim->pool, packets, FLUID_BATCH_CHUNK, fluid_batch_packets, &job);
+		break;
+	}
+	case FLUID_BATCH_LOCAL:
+		fluid_batch_group(sim, job.batch, count);
+		thread_pool_run(sim->pool, job.batch->group_count, 1, fluid_batch_leaves, &job);
+		break;
+	case FLUID_BATCH_CACHED:
+		fluid_batch_targets(sim, job.batch, count);
+		job.batch->lists = fluid_lists_update(sim, job.batch->lists, job.batch->target,
+			job.batch->group_count);
+		thread_pool_run(sim->pool, job.batch->group_count, 1, fluid_batch_cached, &job);
+		break;
+	case FLUID_BATCH_SINGLE:
+	default:
+		thread_pool_run(sim->pool, count, FLUID_BATCH_BLOCK, fluid_batch_sorted, &job);
+		break;
+	}
+}
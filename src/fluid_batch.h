@@ -0,0 +1,63 @@
+/*
+Copyright (c) 2020 Daniel Burke
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+#ifndef __DPB_FLUID_BATCH_H__
+#define __DPB_FLUID_BATCH_H__
+
+#include <stdint.h>
+#include "3dmaths.h"
+
+struct fluid_sim;
+struct vorton_soa;
+struct fluid_target;
+struct fluid_lists;
+
+// nodes a packet takes as a whole, so their moments apply
+struct fluid_batch_far {
+	int count;
+	int capacity;
+	uint32_t *node;
+};
+
+// scratch for answering many velocity queries at once
+struct fluid_batch {
+	int capacity;		// queries
+	uint32_t *key;		// per query, where it is along a Morton curve
+	uint32_t *order;	// queries sorted by key
+	uint32_t *key_scratch, *order_scratch;	// room for the sort
+	uint32_t *group;	// where each leaf's queries begin in order
+	struct fluid_target *target;	// per group, the node whose list it sums
+	int group_count;
+	struct fluid_lists *lists;	// kept between batches, in cached mode
+	int threads;
+	struct vorton_soa *list;	// per thread, what one packet interacts with
+	struct fluid_batch_far *far;	// per thread, the nodes in list with moments
+	int query_capacity;
+	vec3 *query, *result;	// room for callers to gather queries into
+};
+
+void fluid_batch_free(struct fluid_batch *batch);
+int fluid_batch_room(struct fluid_sim *sim, int count);
+void fluid_velocity_batch(struct fluid_sim *sim, const vec3 *positions, int count, vec3 *out);
+
+#endif
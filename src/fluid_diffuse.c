@@ -0,0 +1,305 @@
+/*
+Copyright (c) 2020 Daniel Burke
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+// Viscous diffusion by particle strength exchange.
+// Each vorton exchanges vorticity with the vortons near it, weighted by a
+// kernel that reaches one leaf cell, so only the 27 leaves around its own
+// are searched. The kernel is normalised as PSE needs for the Laplacian,
+// and each vorton stands for an equal share of its leaf cell's volume, so
+// sim->viscosity is the kinematic viscosity whatever the octtree depth.
+// What one of a pair gains the other loses, so the total is kept. Every
+// vorton gathers its own change, reading its neighbours but writing only
+// itself, so the leaves are shared out across threads with no ordering
+// between them, and the changes are applied once every vorton has its sum.
+// A first pass finds how fast each vorton may exchange before it would
+// overshoot its neighbours, and a pair goes at the slower of the two.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "log.h"
+#include "fluid.h"
+#include "fluid_diffuse.h"
+#include "fluid_morton.h"
+#include "fluid_refit.h"
+#include "thread_pool.h"
+
+// marks a vorton outside the octtree
+#define DIFFUSE_NONE FLUID_MORTON_NONE
+
+// leaves are shared out in chunks of this many, and vortons in blocks
+#define FLUID_DIFFUSE_CHUNK 16
+#define FLUID_DIFFUSE_BLOCK 4096
+// (1 - r^2)^2 times this has a second moment of 2 in 3D, and times
+// 1/radius^3 at radius r * radius
+#define FLUID_DIFFUSE_NORMAL (945.0f / (16.0f * 3.14159265f))
+
+struct fluid_diffuse_job {
+	struct fluid_sim *sim;
+	struct fluid_diffuse *diffuse;
+	int cells;		// leaf cells along each axis
+	float radius2;		// reach of the kernel, squared
+	float rate;		// viscosity * deltatime / radius^2, times the
+				// kernel's scale and a leaf cell's volume
+	int limit;		// finding each vorton's rate, not exchanging
+};
+
+void fluid_diffuse_free(struct fluid_diffuse *diffuse)
+{
+	if(diffuse == NULL)
+		return;
+	free(diffuse->leaf);
+	free(diffuse->order);
+	free(diffuse->start);
+	free(diffuse->leaves);
+	free(diffuse->dwx);
+	free(diffuse->dwy);
+	free(diffuse->dwz);
+	free(diffuse->rate);
+	free(diffuse);
+}
+
+// make sure there is room for count vortons and nodes octtree nodes
+static struct fluid_diffuse* fluid_diffuse_reserve(struct fluid_diffuse *diffuse,
+	int count, uint32_t nodes)
+{
+	if(diffuse && diffuse->capacity >= count && diffuse->node_capacity >= nodes)
+		return diffuse;
+	fluid_diffuse_free(diffuse);
+
+	diffuse = malloc(sizeof(struct fluid_diffuse));
+	if(diffuse == NULL)
+	{
+		log_error("malloc(fluid_diffuse) %s", strerror(errno));
+		return NULL;
+	}
+	memset(diffuse, 0, sizeof(struct fluid_diffuse));
+	diffuse->capacity = count;
+	diffuse->node_capacity = nodes;
+	diffuse->leaf = malloc(count * sizeof(uint32_t));
+	diffuse->order = malloc(count * sizeof(uint32_t));
+	diffuse->start = malloc((nodes + 2) * sizeof(uint32_t));
+	diffuse->leaves = malloc(nodes * sizeof(uint32_t));
+	diffuse->dwx = malloc(count * sizeof(float));
+	diffuse->dwy = malloc(count * sizeof(float));
+	diffuse->dwz = malloc(count * sizeof(float));
+	diffuse->rate = malloc(count * sizeof(float));
+	if(!diffuse->leaf || !diffuse->order || !diffuse->start || !diffuse->leaves
+	|| !diffuse->dwx || !diffuse->dwy || !diffuse->dwz || !diffuse->rate)
+	{
+		log_error("malloc(fluid_diffuse) %s", strerror(errno));
+		fluid_diffuse_free(diffuse);
+		return NULL;
+	}
+	return diffuse;
+}
+
+// find the leaf of each vorton
+static void fluid_diffuse_leaf(void *data, int start, int end, int thread)
+{
+	struct fluid_diffuse_job *job = data;
+	struct fluid_sim *sim = job->sim;
+	struct vorton_soa *vortons = &sim->vortons;
+	uint32_t *leaf = job->diffuse->leaf;
+	uint64_t outside = 1ull << (3*sim->max_depth);
+
+	// a refit already knows, 0 is outside as the root is never a leaf
+	if(sim->tree_build == FLUID_TREE_REFIT && sim->refit && sim->refit->valid)
+	{
+		for(int i=start; i<end; i++)
+			leaf[i] = sim->refit->leaf[i] ? sim->refit->leaf[i] : DIFFUSE_NONE;
+		return;
+	}
+
+	for(int i=start; i<end; i++)
+	{
+		vec3 position = (vec3){{vortons->px[i], vortons->py[i], vortons->pz[i]}};
+		uint64_t key = fluid_morton_key(sim->octtree, sim->max_depth, position);
+		leaf[i] = (key == outside) ? DIFFUSE_NONE : fluid_morton_leaf(sim, key);
+	}
+}
+
+// sum the exchange with every neighbour for the vortons of some leaves,
+// or with job->limit how fast each of them may exchange
+static void fluid_diffuse_exchange(void *data, int start, int end, int thread)
+{
+	struct fluid_diffuse_job *job = data;
+	struct fluid_sim *sim = job->sim;
+	struct fluid_diffuse *diffuse = job->diffuse;
+	struct vorton_soa *vortons = &sim->vortons;
+	const uint32_t *order = diffuse->order;
+	// leaf n holds order[start[n+1]] up to order[start[n+2]]
+	const uint32_t *range = diffuse->start + 1;
+	float radius2 = job->radius2;
+	float inverse_radius2 = 1.0f / radius2;
+
+	for(int l=start; l<end; l++)
+	{
+		uint32_t here = diffuse->leaves[l];
+
+		// the leaves around this one, including itself
+		uint32_t first = order[range[here]];
+		vec3 position = (vec3){{vortons->px[first], vortons->py[first], vortons->pz[first]}};
+		uint32_t cx, cy, cz;
+		fluid_morton_decode(fluid_morton_key(sim->octtree, sim->max_depth, position), &cx, &cy, &cz);
+		uint32_t near[27];
+		int near_count = 0;
+		for(int z=-1; z<=1; z++)
+		for(int y=-1; y<=1; y++)
+		for(int x=-1; x<=1; x++)
+		{
+			int nx = (int)cx + x, ny = (int)cy + y, nz = (int)cz + z;
+			if(nx < 0 || ny < 0 || nz < 0
+			|| nx >= job->cells || ny >= job->cells || nz >= job->cells)
+				continue;
+			uint32_t node = (x || y || z)
+				? fluid_morton_leaf(sim, fluid_morton_encode(nx, ny, nz)) : here;
+			if(node != DIFFUSE_NONE && range[node] < range[node+1])
+				near[near_count++] = node;
+		}
+
+		// the vortons in a leaf share its volume
+		float volume_i = 1.0f / (float)(range[here+1] - range[here]);
+		for(uint32_t a=range[here]; a<range[here+1]; a++)
+		{
+			uint32_t i = order[a];
+			float px = vortons->px[i], py = vortons->py[i], pz = vortons->pz[i];
+			float wx = vortons->wx[i], wy = vortons->wy[i], wz = vortons->wz[i];
+			float rate_i = diffuse->rate[i];
+			float dwx = 0.0f, dwy = 0.0f, dwz = 0.0f;
+			float total = 0.0f;
+			for(int n=0; n<near_count; n++)
+			{
+				float volume_j = 1.0f / (float)(range[near[n]+1] - range[near[n]]);
+				for(uint32_t b=range[near[n]]; b<range[near[n]+1]; b++)
+				{
+					uint32_t j = order[b];
+					float dx = vortons->px[j] - px;
+					float dy = vortons->py[j] - py;
+					float dz = vortons->pz[j] - pz;
+					float dist2 = dx*dx + dy*dy + dz*dz;
+					if(dist2 >= radius2)
+						continue;
+					// smooth, and zero at the edge of the kernel
+					float q = 1.0f - dist2 * inverse_radius2;
+					float weight = q * q;
+					if(job->limit)
+					{
+						total += weight * volume_j;
+						continue;
+					}
+					// the same for both of the pair, with the sign turned
+					weight *= nmin(rate_i, diffuse->rate[j]);
+					dwx += (volume_i * vortons->wx[j] - volume_j * wx) * weight;
+					dwy += (volume_i * vortons->wy[j] - volume_j * wy) * weight;
+					dwz += (volume_i * vortons->wz[j] - volume_j * wz) * weight;
+				}
+			}
+			if(job->limit)
+			{
+				// past 1 a vorton would overshoot its neighbours, at most
+				// it takes on their weighted average
+				diffuse->rate[i] = total * job->rate > 1.0f ? 1.0f / total : job->rate;
+				continue;
+			}
+			diffuse->dwx[i] = dwx;
+			diffuse->dwy[i] = dwy;
+			diffuse->dwz[i] = dwz;
+		}
+	}
+}
+
+// add the exchanged vorticity, once every vorton has worked out its own
+static void fluid_diffuse_apply(void *data, int start, int end, int thread)
+{
+	struct fluid_diffuse_job *job = data;
+	struct fluid_diffuse *diffuse = job->diffuse;
+	struct vorton_soa *vortons = &job->sim->vortons;
+
+	for(int i=start; i<end; i++)
+	{
+		if(diffuse->leaf[i] == DIFFUSE_NONE)
+			continue;
+		vortons->wx[i] += diffuse->dwx[i];
+		vortons->wy[i] += diffuse->dwy[i];
+		vortons->wz[i] += diffuse->dwz[i];
+	}
+}
+
+// Exchange vorticity between neighbouring vortons, the octtree must be
+// up to date. returns 0 on success
+int fluid_diffuse(struct fluid_sim *sim, float deltatime)
+{
+	struct octtree *octtree = sim->octtree;
+	int count = sim->vortons.count;
+	uint32_t nodes = octtree->node_count;
+	if(count == 0 || sim->viscosity == 0.0f)
+		return 0;
+
+	sim->diffuse = fluid_diffuse_reserve(sim->diffuse, sim->vortons.capacity, nodes);
+	if(sim->diffuse == NULL)
+		return 1;
+	struct fluid_diffuse *diffuse = sim->diffuse;
+
+	struct fluid_diffuse_job job;
+	job.sim = sim;
+	job.diffuse = diffuse;
+	job.cells = 1 << sim->max_depth;
+	// the kernel reaches one leaf cell along the shortest side
+	float radius = nmin(octtree->volume.x, nmin(octtree->volume.y, octtree->volume.z)) / job.cells;
+	job.radius2 = radius * radius;
+	vec3 cell = (vec3){{octtree->volume.x / job.cells, octtree->volume.y / job.cells,
+		octtree->volume.z / job.cells}};
+	job.rate = sim->viscosity * deltatime / job.radius2
+		* FLUID_DIFFUSE_NORMAL / (job.radius2 * radius) * (cell.x * cell.y * cell.z);
+
+	thread_pool_run(sim->pool, count, FLUID_DIFFUSE_BLOCK, fluid_diffuse_leaf, &job);
+
+	// bucket the vortons by leaf, start[n+1] counts leaf n, becomes where
+	// it ends, and then filling backwards leaves it where leaf n begins
+	uint32_t *start = diffuse->start;
+	memset(start, 0, (nodes + 2) * sizeof(uint32_t));
+	for(int i=0; i<count; i++)
+		if(diffuse->leaf[i] != DIFFUSE_NONE)
+			start[diffuse->leaf[i] + 1]++;
+	diffuse->leaf_count = 0;
+	for(uint32_t n=0; n<nodes; n++)
+	{
+		if(start[n+1])
+			diffuse->leaves[diffuse->leaf_count++] = n;
+		start[n+1] += start[n];
+	}
+	start[nodes+1] = start[nodes];
+	for(int i=count-1; i>=0; i--)
+		if(diffuse->leaf[i] != DIFFUSE_NONE)
+			diffuse->order[--start[diffuse->leaf[i] + 1]] = i;
+
+	job.limit = 1;
+	thread_pool_run(sim->pool, diffuse->leaf_count, FLUID_DIFFUSE_CHUNK, fluid_diffuse_exchange, &job);
+	job.limit = 0;
+	thread_pool_run(sim->pool, diffuse->leaf_count, FLUID_DIFFUSE_CHUNK, fluid_diffuse_exchange, &job);
+	thread_pool_run(sim->pool, count, FLUID_DIFFUSE_BLOCK, fluid_diffuse_apply, &job);
+	return 0;
+}
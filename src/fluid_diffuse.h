@@ -0,0 +1,47 @@
+/*
+Copyright (c) 2020 Daniel Burke
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+#ifndef __DPB_FLUID_DIFFUSE_H__
+#define __DPB_FLUID_DIFFUSE_H__
+
+#include <stdint.h>
+
+struct fluid_sim;
+
+// vortons bucketed by octtree leaf, and what they exchange
+struct fluid_diffuse {
+	int capacity;		// vortons
+	uint32_t node_capacity;
+	uint32_t *leaf;		// per vorton, its leaf node
+	uint32_t *order;	// vortons grouped by leaf
+	uint32_t *start;	// per node, where its vortons are in order
+	uint32_t *leaves;	// the nodes that hold vortons
+	uint32_t leaf_count;
+	float *dwx, *dwy, *dwz;	// per vorton, the change in vorticity
+	float *rate;		// per vorton, how fast it may exchange
+};
+
+void fluid_diffuse_free(struct fluid_diffuse *diffuse);
+int fluid_diffuse(struct fluid_sim *sim, float deltatime);
+
+#endif
@@ -0,0 +1,608 @@
+/*
+Copyright (c) 2020 Daniel Burke
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+// A Cartesian Fast Multipole Method for the vorton velocity field.
+// The velocity is the curl of a vector potential, psi = sum(w / r), so each
+// component of vorticity is a Laplace source. Multipoles live on the octtree
+// nodes, local expansions live on a dense grid of cells at every level, so
+// tracers anywhere in the volume can find theirs directly. Expansion terms
+// are kept while the combined order is at most FLUID_FMM_ORDER.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <math.h>
+
+#include "log.h"
+#include "fluid.h"
+#include "fluid_fmm.h"
+#include "fluid_simd.h"
+#include "fluid_kernel.h"
+
+#define P FLUID_FMM_ORDER
+#define TERMS FLUID_FMM_TERMS
+
+// end of a leaf's vorton list
+#define FMM_NONE UINT32_MAX
+
+// a term of an expansion operator, out += coefficient * in * monomial
+struct fmm_term {
+	uint8_t out, in, monomial;
+	float coefficient;
+};
+
+// multi-index tables, built once by fmm_tables()
+static int fmm_tables_built = 0;
+static uint8_t fmm_index[P+1][P+1][P+1];
+static uint8_t fmm_power[TERMS][3];
+static uint8_t fmm_order[TERMS];
+static struct fmm_term fmm_m2m_terms[TERMS*TERMS];
+static int fmm_m2m_count;
+static struct fmm_term fmm_m2l_terms[TERMS*TERMS];
+static int fmm_m2l_count;
+static struct fmm_term fmm_l2l_terms[TERMS*TERMS];
+static int fmm_l2l_count;
+
+static float fmm_binomial(int n, int k)
+{
+	float ret = 1.0f;
+	for(int i=1; i<=k; i++)
+		ret = ret * (float)(n - k + i) / (float)i;
+	return ret;
+}
+
+// binomial coefficient of two multi-indices
+static float fmm_multi_binomial(int n, int k)
+{
+	return fmm_binomial(fmm_power[n][0], fmm_power[k][0])
+		* fmm_binomial(fmm_power[n][1], fmm_power[k][1])
+		* fmm_binomial(fmm_power[n][2], fmm_power[k][2]);
+}
+
+// is multi-index k less than or equal to n in every dimension
+static int fmm_within(int k, int n)
+{
+	return fmm_power[k][0] <= fmm_power[n][0]
+		&& fmm_power[k][1] <= fmm_power[n][1]
+		&& fmm_power[k][2] <= fmm_power[n][2];
+}
+
+static int fmm_difference(int n, int k)
+{
+	return fmm_index[fmm_power[n][0] - fmm_power[k][0]]
+		[fmm_power[n][1] - fmm_power[k][1]]
+		[fmm_power[n][2] - fmm_power[k][2]];
+}
+
+static void fmm_tables(void)
+{
+	if(fmm_tables_built)
+		return;
+
+	// multi-indices, sorted by order
+	int i = 0;
+	for(int n=0; n<=P; n++)
+	for(int x=n; x>=0; x--)
+	for(int y=n-x; y>=0; y--)
+	{
+		int z = n - x - y;
+		fmm_index[x][y][z] = i;
+		fmm_power[i][0] = x;
+		fmm_power[i][1] = y;
+		fmm_power[i][2] = z;
+		fmm_order[i] = n;
+		i++;
+	}
+
+	// M[a] += C(a,g) M'[g] s^(a-g)
+	fmm_m2m_count = 0;
+	for(int a=0; a<TERMS; a++)
+	for(int g=0; g<TERMS; g++)
+	{
+		if(!fmm_within(g, a))
+			continue;
+		fmm_m2m_terms[fmm_m2m_count++] = (struct fmm_term){
+			a, g, fmm_difference(a, g), fmm_multi_binomial(a, g) };
+	}
+
+	// L[b] += (-1)^|b| C(a+b,b) M[a] d[a+b]
+	fmm_m2l_count = 0;
+	for(int b=0; b<TERMS; b++)
+	for(int a=0; a<TERMS; a++)
+	{
+		if(fmm_order[a] + fmm_order[b] > P)
+			continue;
+		int ab = fmm_index[fmm_power[a][0] + fmm_power[b][0]]
+			[fmm_power[a][1] + fmm_power[b][1]]
+			[fmm_power[a][2] + fmm_power[b][2]];
+		float sign = (fmm_order[b] & 1) ? -1.0f : 1.0f;
+		fmm_m2l_terms[fmm_m2l_count++] = (struct fmm_term){
+			b, a, ab, sign * fmm_multi_binomial(ab, b) };
+	}
+
+	// L'[g] += C(b,g) L[b] t^(b-g)
+	fmm_l2l_count = 0;
+	for(int g=0; g<TERMS; g++)
+	for(int b=0; b<TERMS; b++)
+	{
+		if(!fmm_within(g, b))
+			continue;
+		fmm_l2l_terms[fmm_l2l_count++] = (struct fmm_term){
+			g, b, fmm_difference(b, g), fmm_multi_binomial(b, g) };
+	}
+
+	fmm_tables_built = 1;
+}
+
+// every monomial of v, up to order P
+static void fmm_monomials(float *out, vec3 v)
+{
+	out[0] = 1.0f;
+	for(int i=1; i<TERMS; i++)
+	{
+		// peel off one power, from the first dimension that has one
+		int d = fmm_power[i][0] ? 0 : (fmm_power[i][1] ? 1 : 2);
+		int x = fmm_power[i][0] - (d == 0);
+		int y = fmm_power[i][1] - (d == 1);
+		int z = fmm_power[i][2] - (d == 2);
+		out[i] = out[fmm_index[x][y][z]] * v.f[d];
+	}
+}
+
+// Taylor coefficients of 1/|r - y| in powers of y, D^k(1/r) (-1)^|k| / k!
+// using the recurrence from Lindsay & Krasny
+static void fmm_coefficients(float *out, vec3 r)
+{
+	float r2 = r.x*r.x + r.y*r.y + r.z*r.z;
+	float inv_r2 = 1.0f / r2;
+	out[0] = sqrtf(inv_r2);
+	for(int i=1; i<TERMS; i++)
+	{
+		int n = fmm_order[i];
+		float sum1 = 0.0f;
+		float sum2 = 0.0f;
+		for(int d=0; d<3; d++)
+		{
+			int k[3] = {fmm_power[i][0], fmm_power[i][1], fmm_power[i][2]};
+			if(k[d] < 1)
+				continue;
+			k[d]--;
+			sum1 += r.f[d] * out[fmm_index[k[0]][k[1]][k[2]]];
+			if(k[d] < 1)
+				continue;
+			k[d]--;
+			sum2 += out[fmm_index[k[0]][k[1]][k[2]]];
+		}
+		out[i] = ((2*n - 1) * sum1 - (n - 1) * sum2) * inv_r2 / (float)n;
+	}
+}
+
+static int fmm_cells(int level)
+{
+	return 1 << level;
+}
+
+// offset of the first cell of a level, in the dense local array
+static uint32_t fmm_level_offset(int level)
+{
+	return ((1u << (3*level)) - 1) / 7;
+}
+
+static uint32_t fmm_cell_index(int level, int x, int y, int z)
+{
+	int n = fmm_cells(level);
+	return fmm_level_offset(level) + ((uint32_t)z*n + y)*n + x;
+}
+
+static uint32_t fmm_pack_cell(int level, int x, int y, int z)
+{
+	return ((uint32_t)level << 24) | ((uint32_t)z << 16) | ((uint32_t)y << 8) | (uint32_t)x;
+}
+
+static void fmm_unpack_cell(uint32_t cell, int *level, int *x, int *y, int *z)
+{
+	*level = cell >> 24;
+	*z = (cell >> 16) & 0xff;
+	*y = (cell >> 8) & 0xff;
+	*x = cell & 0xff;
+}
+
+// the centre of a cell, in world space
+static vec3 fmm_cell_centre(struct fluid_sim *sim, int level, int x, int y, int z)
+{
+	vec3 step = div(sim->octtree->volume, (float)fmm_cells(level));
+	vec3 offset = (vec3){{
+		step.x * ((float)x + 0.5f),
+		step.y * ((float)y + 0.5f),
+		step.z * ((float)z + 0.5f) }};
+	return add(sim->octtree->origin, offset);
+}
+
+// particle to multipole
+static void fmm_p2m(struct fmm_multipole *m, struct vorton_soa *vortons, int j, vec3 centre)
+{
+	float d[TERMS];
+	vec3 p = (vec3){{vortons->px[j], vortons->py[j], vortons->pz[j]}};
+	vec3 w = (vec3){{vortons->wx[j], vortons->wy[j], vortons->wz[j]}};
+	fmm_monomials(d, sub(p, centre));
+	for(int i=0; i<TERMS; i++)
+		m->m[i] = add(m->m[i], mul(w, d[i]));
+}
+
+// multipole to multipole, shifting a child expansion by s = child - parent
+static void fmm_m2m(struct fmm_multipole *parent, struct fmm_multipole *child, vec3 s)
+{
+	float monomial[TERMS];
+	fmm_monomials(monomial, s);
+	for(int i=0; i<fmm_m2m_count; i++)
+	{
+		struct fmm_term *t = &fmm_m2m_terms[i];
+		parent->m[t->out] = add(parent->m[t->out],
+			mul(child->m[t->in], t->coefficient * monomial[t->monomial]));
+	}
+}
+
+// multipole to local, r is the target centre minus the source centre
+static void fmm_m2l(struct fmm_local *l, struct fmm_multipole *m, vec3 r)
+{
+	float coefficient[TERMS];
+	fmm_coefficients(coefficient, r);
+	for(int i=0; i<fmm_m2l_count; i++)
+	{
+		struct fmm_term *t = &fmm_m2l_terms[i];
+		l->l[t->out] = add(l->l[t->out],
+			mul(m->m[t->in], t->coefficient * coefficient[t->monomial]));
+	}
+}
+
+// local to local, shifting a parent expansion by t = child - parent
+static void fmm_l2l(struct fmm_local *child, struct fmm_local *parent, vec3 shift)
+{
+	float monomial[TERMS];
+	fmm_monomials(monomial, shift);
+	for(int i=0; i<fmm_l2l_count; i++)
+	{
+		struct fmm_term *t = &fmm_l2l_terms[i];
+		child->l[t->out] = add(child->l[t->out],
+			mul(parent->l[t->in], t->coefficient * monomial[t->monomial]));
+	}
+}
+
+// gradient of the local expansion, at offset e from its centre
+static void fmm_l2p(struct fmm_local *l, vec3 e, vec3 gradient[3])
+{
+	float monomial[TERMS];
+	fmm_monomials(monomial, e);
+	for(int d=0; d<3; d++)
+		gradient[d] = (vec3){{0,0,0}};
+	for(int i=1; i<TERMS; i++)
+	for(int d=0; d<3; d++)
+	{
+		int k[3] = {fmm_power[i][0], fmm_power[i][1], fmm_power[i][2]};
+		if(k[d] < 1)
+			continue;
+		float scale = (float)k[d];
+		k[d]--;
+		scale *= monomial[fmm_index[k[0]][k[1]][k[2]]];
+		gradient[d] = add(gradient[d], mul(l->l[i], scale));
+	}
+}
+
+
+// grow the per node and per vorton arrays to match the pools
+// returns 0 on success
+static int fmm_reserve(struct fluid_fmm *fmm, uint32_t node_pool_size, int max_vortons)
+{
+	if(node_pool_size > fmm->node_pool_size)
+	{
+		void *multipole = realloc(fmm->multipole, node_pool_size * sizeof(struct fmm_multipole));
+		if(multipole == NULL)
+			goto fail;
+		fmm->multipole = multipole;
+		void *node_cell = realloc(fmm->node_cell, node_pool_size * sizeof(uint32_t));
+		if(node_cell == NULL)
+			goto fail;
+		fmm->node_cell = node_cell;
+		void *leaf_first = realloc(fmm->leaf_first, node_pool_size * sizeof(uint32_t));
+		if(leaf_first == NULL)
+			goto fail;
+		fmm->leaf_first = leaf_first;
+		fmm->node_pool_size = node_pool_size;
+	}
+	if(max_vortons > fmm->max_vortons)
+	{
+		void *vorton_next = realloc(fmm->vorton_next, max_vortons * sizeof(uint32_t));
+		if(vorton_next == NULL)
+			goto fail;
+		fmm->vorton_next = vorton_next;
+		fmm->max_vortons = max_vortons;
+	}
+	return 0;
+fail:
+	log_error("realloc(fluid_fmm) %s", strerror(errno));
+	return 1;
+}
+
+struct fluid_fmm* fluid_fmm_init(int depth, uint32_t node_pool_size, int max_vortons)
+{
+	struct fluid_fmm *fmm;
+
+	if(depth > FLUID_FMM_MAX_DEPTH)
+	{
+		log_error("fluid_fmm_init() depth %d is greater than %d", depth, FLUID_FMM_MAX_DEPTH);
+		return NULL;
+	}
+
+	fmm = malloc(sizeof(struct fluid_fmm));
+	if(fmm == NULL)
+	{
+		log_error("malloc(fluid_fmm) %s", strerror(errno));
+		return NULL;
+	}
+	memset(fmm, 0, sizeof(struct fluid_fmm));
+	fmm_tables();
+	fmm->depth = depth;
+
+	uint32_t leaf_cells = 1u << (3*depth);
+	uint32_t total_cells = fmm_level_offset(depth + 1);
+	fmm->leaf_node = malloc(leaf_cells * sizeof(uint32_t));
+	fmm->local = malloc(total_cells * sizeof(struct fmm_local));
+	if(fmm->leaf_node == NULL || fmm->local == NULL)
+	{
+		log_error("malloc(fluid_fmm) %s", strerror(errno));
+		fluid_fmm_free(fmm);
+		return NULL;
+	}
+	if(fmm_reserve(fmm, node_pool_size, max_vortons))
+	{
+		fluid_fmm_free(fmm);
+		return NULL;
+	}
+	return fmm;
+}
+
+void fluid_fmm_free(struct fluid_fmm *fmm)
+{
+	if(fmm == NULL)
+		return;
+	free(fmm->multipole);
+	free(fmm->node_cell);
+	free(fmm->leaf_first);
+	free(fmm->vorton_next);
+	free(fmm->leaf_node);
+	free(fmm->local);
+	free(fmm);
+}
+
+// walk a vorton down the octtree, returning the leaf it was added to
+static uint32_t fmm_vorton_leaf(struct fluid_sim *sim, vec3 position)
+{
+	struct octtree *octtree = sim->octtree;
+	vec3 rel_position = sub(position, octtree->origin);
+	if(vec3_lessthan_vec3(rel_position, (vec3){{0,0,0}}))
+		return 0;
+	if(vec3_greaterthan_vec3(rel_position, octtree->volume))
+		return 0;
+
+	vec3 node_volume = octtree->volume;
+	uint32_t here = 0;
+	for(int i=0; i<sim->fmm->level; i++)
+	{
+		node_volume = mul(node_volume, 0.5);
+		int offset = octtree_child_position(rel_position, node_volume);
+		rel_position = octtree_child_relative(rel_position, node_volume);
+		here = octtree_node(octtree, here)->node[offset];
+		if(here == 0)
+			return 0;
+	}
+	return here;
+}
+
+// label each node with its cell, and build its multipole from its children
+static void fmm_upward(struct fluid_sim *sim, uint32_t here, int level, int x, int y, int z)
+{
+	struct fluid_fmm *fmm = sim->fmm;
+	struct fmm_multipole *m = &fmm->multipole[here];
+	vec3 centre = fmm_cell_centre(sim, level, x, y, z);
+
+	memset(m, 0, sizeof(struct fmm_multipole));
+	fmm->node_cell[here] = fmm_pack_cell(level, x, y, z);
+
+	if(level == fmm->level)
+	{
+		fmm->leaf_node[fmm_cell_index(level, x, y, z) - fmm_level_offset(level)] = here;
+		for(uint32_t j = fmm->leaf_first[here]; j != FMM_NONE; j = fmm->vorton_next[j])
+			fmm_p2m(m, &sim->vortons, j, centre);
+		return;
+	}
+
+	for(int i=0; i<8; i++)
+	{
+		uint32_t child = octtree_node(sim->octtree, here)->node[i];
+		if(child == 0)
+			continue;
+		int cx = x*2 + (i & 1);
+		int cy = y*2 + ((i >> 1) & 1);
+		int cz = z*2 + ((i >> 2) & 1);
+		fmm_upward(sim, child, level+1, cx, cy, cz);
+		vec3 s = sub(fmm_cell_centre(sim, level+1, cx, cy, cz), centre);
+		fmm_m2m(m, &fmm->multipole[child], s);
+	}
+}
+
+// leaf cells each way a smoothing reaching sqrt(point2) spans at a level
+static int fmm_reach(vec3 volume, int level, float point2)
+{
+	float leaf = nmin(volume.x, nmin(volume.y, volume.z)) / fmm_cells(level);
+	return nmax(1, (int)ceilf(sqrtf(point2) / leaf));
+}
+
+// The expansions are of the point law, so every vorton whose smoothing
+// still matters has to be in the near field. Finds the deepest leaf level
+// where that is at most FLUID_FMM_MAX_REACH cells, the volume only grows
+// so it never has to get deeper. returns 0 if the smoothing is too wide
+// to leave any far field
+int fluid_fmm_level(struct fluid_fmm *fmm, vec3 volume, float point2)
+{
+	for(int level=fmm->depth; level>=2; level--)
+		if(fmm_reach(volume, level, point2) <= FLUID_FMM_MAX_REACH)
+			return level;
+	return 0;
+}
+
+// build the multipoles and local expansions for the current octtree
+// returns 0 on success
+int fluid_fmm_update(struct fluid_sim *sim)
+{
+	struct fluid_fmm *fmm = sim->fmm;
+	struct vorton_soa *vortons = &sim->vortons;
+
+	// the pools may have grown since the last update
+	if(fmm_reserve(fmm, sim->octtree->node_pool_size, sim->max_vortons))
+		return 1;
+
+	// fluid_kernel() and fluid_velocity_mode() have already checked this
+	vec3 volume = sim->octtree->volume;
+	int depth = fluid_fmm_level(fmm, volume, sim->smoothing->point2);
+	if(depth == 0)
+	{
+		log_error("fluid_fmm_update() the smoothing is wider than the far field");
+		return 1;
+	}
+	int reach = fmm_reach(volume, depth, sim->smoothing->point2);
+	fmm->level = depth;
+	fmm->reach = reach;
+
+	// bucket the vortons into their leaves
+	memset(fmm->leaf_first, 0xff, fmm->node_pool_size * sizeof(uint32_t));
+	memset(fmm->leaf_node, 0, (1u << (3*depth)) * sizeof(uint32_t));
+	for(int i=0; i<vortons->count; i++)
+	{
+		vec3 p = (vec3){{vortons->px[i], vortons->py[i], vortons->pz[i]}};
+		uint32_t leaf = fmm_vorton_leaf(sim, p);
+		fmm->vorton_next[i] = FMM_NONE;
+		if(leaf == 0)
+			continue;
+		fmm->vorton_next[i] = fmm->leaf_first[leaf];
+		fmm->leaf_first[leaf] = i;
+	}
+
+	memset(fmm->local, 0, fmm_level_offset(depth + 1) * sizeof(struct fmm_local));
+	if(sim->nodes.counts[0] == 0)
+		return 0;
+
+	// nodes below the leaf level are not labelled, leave them past it
+	memset(fmm->node_cell, 0xff, fmm->node_pool_size * sizeof(uint32_t));
+
+	fmm_upward(sim, 0, 0, 0, 0, 0);
+
+	// each node interacts with the children of its parents neighbours,
+	// that are not its own neighbours, neighbours being within reach
+	for(uint32_t i=0; i<sim->octtree->node_count; i++)
+	{
+		int level, x, y, z;
+		fmm_unpack_cell(fmm->node_cell[i], &level, &x, &y, &z);
+		if(level < 2 || level > depth)
+			continue;
+		vec3 source = fmm_cell_centre(sim, level, x, y, z);
+		int parents = fmm_cells(level-1);
+		for(int pz = nmax(z/2-reach, 0); pz <= nmin(z/2+reach, parents-1); pz++)
+		for(int py = nmax(y/2-reach, 0); py <= nmin(y/2+reach, parents-1); py++)
+		for(int px = nmax(x/2-reach, 0); px <= nmin(x/2+reach, parents-1); px++)
+		for(int c=0; c<8; c++)
+		{
+			int tx = px*2 + (c & 1);
+			int ty = py*2 + ((c >> 1) & 1);
+			int tz = pz*2 + ((c >> 2) & 1);
+			if(abs(tx - x) <= reach && abs(ty - y) <= reach && abs(tz - z) <= reach)
+				continue;
+			vec3 target = fmm_cell_centre(sim, level, tx, ty, tz);
+			fmm_m2l(&fmm->local[fmm_cell_index(level, tx, ty, tz)],
+				&fmm->multipole[i], sub(target, source));
+		}
+	}
+
+	// push the far field down to the leaves
+	for(int level=2; level<depth; level++)
+	{
+		int n = fmm_cells(level);
+		for(int z=0; z<n; z++)
+		for(int y=0; y<n; y++)
+		for(int x=0; x<n; x++)
+		{
+			struct fmm_local *parent = &fmm->local[fmm_cell_index(level, x, y, z)];
+			vec3 centre = fmm_cell_centre(sim, level, x, y, z);
+			for(int c=0; c<8; c++)
+			{
+				int cx = x*2 + (c & 1);
+				int cy = y*2 + ((c >> 1) & 1);
+				int cz = z*2 + ((c >> 2) & 1);
+				vec3 t = sub(fmm_cell_centre(sim, level+1, cx, cy, cz), centre);
+				fmm_l2l(&fmm->local[fmm_cell_index(level+1, cx, cy, cz)], parent, t);
+			}
+		}
+	}
+	return 0;
+}
+
+// find the velocity of the fluid at a given position, from the local
+// expansion of its leaf cell plus the vortons in the leaves within reach
+vec3 fluid_fmm_velocity(struct fluid_sim *sim, vec3 position)
+{
+	struct fluid_fmm *fmm = sim->fmm;
+	int depth = fmm->level;
+	int n = fmm_cells(depth);
+	vec3 rel_position = sub(position, sim->octtree->origin);
+	vec3 volume = sim->octtree->volume;
+	int x = nmin(nmax((int)floorf(rel_position.x / volume.x * n), 0), n-1);
+	int y = nmin(nmax((int)floorf(rel_position.y / volume.y * n), 0), n-1);
+	int z = nmin(nmax((int)floorf(rel_position.z / volume.z * n), 0), n-1);
+
+	// far field, velocity is the curl of the vector potential
+	vec3 g[3];
+	vec3 e = sub(position, fmm_cell_centre(sim, depth, x, y, z));
+	fmm_l2p(&fmm->local[fmm_cell_index(depth, x, y, z)], e, g);
+	vec3 result = (vec3){{
+		g[1].z - g[2].y,
+		g[2].x - g[0].z,
+		g[0].y - g[1].x }};
+	result = mul(result, sim->smoothing->scale);
+
+	// near field, every leaf within reach
+	int reach = fmm->reach;
+	struct fluid_gather gather;
+	fluid_gather_init(&gather, sim->smoothing, NULL);
+	for(int nz = nmax(z-reach, 0); nz <= nmin(z+reach, n-1); nz++)
+	for(int ny = nmax(y-reach, 0); ny <= nmin(y+reach, n-1); ny++)
+	for(int nx = nmax(x-reach, 0); nx <= nmin(x+reach, n-1); nx++)
+	{
+		uint32_t leaf = fmm->leaf_node[((uint32_t)nz*n + ny)*n + nx];
+		if(leaf == 0)
+			continue;
+		for(uint32_t j = fmm->leaf_first[leaf]; j != FMM_NONE; j = fmm->vorton_next[j])
+			fluid_gather_add(&gather, &sim->vortons, j, position, &result);
+	}
+	fluid_gather_flush(&gather, position, &result);
+	return result;
+}
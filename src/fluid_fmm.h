@@ -0,0 +1,73 @@
+/*
+Copyright (c) 2020 Daniel Burke
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+#ifndef __DPB_FLUID_FMM_H__
+#define __DPB_FLUID_FMM_H__
+
+#include <stdint.h>
+#include "3dmaths.h"
+
+struct fluid_sim;
+
+// expansions are Cartesian, to this order
+#define FLUID_FMM_ORDER 4
+#define FLUID_FMM_TERMS ((FLUID_FMM_ORDER+1)*(FLUID_FMM_ORDER+2)*(FLUID_FMM_ORDER+3)/6)
+
+// multipole expansion of the vortons beneath an octtree node, about its centre
+struct fmm_multipole {
+	vec3 m[FLUID_FMM_TERMS];
+};
+
+// local expansion of the far field vector potential, about a cells centre
+struct fmm_local {
+	vec3 l[FLUID_FMM_TERMS];
+};
+
+struct fluid_fmm {
+	int depth;			// deepest leaf level, cells are dense below this
+	int level;			// leaf level in use, shallower for wide smoothing
+	int reach;			// leaf cells each way summed directly, so the
+					// far field is clear of the smoothing
+	uint32_t node_pool_size;
+	int max_vortons;
+	struct fmm_multipole *multipole;	// one per octtree node
+	uint32_t *node_cell;		// per node, packed level and cell coordinates
+	uint32_t *leaf_first;		// per node, first vorton in this leaf
+	uint32_t *vorton_next;		// per vorton, next vorton in the same leaf
+	uint32_t *leaf_node;		// dense leaf cells, octtree node or 0
+	struct fmm_local *local;	// dense cells of every level
+};
+
+// dense local expansions grow as 8^depth, so keep it reasonable
+#define FLUID_FMM_MAX_DEPTH 6
+// each cell of reach grows the interaction lists by about the cube, past
+// this the treecode is faster
+#define FLUID_FMM_MAX_REACH 2
+
+struct fluid_fmm* fluid_fmm_init(int depth, uint32_t node_pool_size, int max_vortons);
+void fluid_fmm_free(struct fluid_fmm *fmm);
+int fluid_fmm_level(struct fluid_fmm *fmm, vec3 volume, float point2);
+int fluid_fmm_update(struct fluid_sim *sim);
+vec3 fluid_fmm_velocity(struct fluid_sim *sim, vec3 position);
+
+#endif
@@ -0,0 +1,375 @@
+/*
+Copyright (c) 2020 Daniel Burke
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+// Velocity cached on a regular grid over the volume.
+// The grid points are evaluated once per frame with the treecode, in
+// parallel, and tracers then sample the grid with trilinear interpolation,
+// so a tracer costs the same however many vortons there are. Advecting
+// tracers through the grid is vectorised across tracers, picked at runtime
+// from what the CPU supports.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FLUID_GRID_X86
+#include <immintrin.h>
+#endif
+
+#include "log.h"
+#include "fluid.h"
+#include "fluid_grid.h"
+#include "thread_pool.h"
+
+// points are filled in chunks of this many
+#define FLUID_GRID_CHUNK 64
+
+typedef int (*fluid_grid_advect_fn)(const struct fluid_grid *grid,
+	struct particle *particles, int count, float deltatime);
+
+static int grid_advect_scalar(const struct fluid_grid *grid,
+	struct particle *particles, int count, float deltatime);
+static fluid_grid_advect_fn fluid_grid_kernel = grid_advect_scalar;
+
+struct fluid_grid_job {
+	struct fluid_sim *sim;
+	struct fluid_grid *grid;
+	vec3 step;
+};
+
+static float lerp(float a, float b, float t)
+{
+	return a + (b - a) * t;
+}
+
+// trilinear sample at a position relative to the origin, clamped to the grid
+static void grid_sample(const struct fluid_grid *grid, float rx, float ry, float rz, float *out)
+{
+	float g[3] = {rx * grid->inverse_step.x, ry * grid->inverse_step.y, rz * grid->inverse_step.z};
+	int c[3];
+	float f[3];
+	for(int d=0; d<3; d++)
+	{
+		if(!(g[d] > 0.0f))
+			g[d] = 0.0f;
+		if(g[d] > (float)grid->cells)
+			g[d] = (float)grid->cells;
+		c[d] = (int)g[d];
+		if(c[d] > grid->cells - 1)
+			c[d] = grid->cells - 1;
+		f[d] = g[d] - (float)c[d];
+	}
+
+	int dy = grid->points;
+	int dz = grid->points * grid->points;
+	int cell = c[0] + c[1] * dy + c[2] * dz;
+	const float *arrays[3] = {grid->vx, grid->vy, grid->vz};
+	for(int i=0; i<3; i++)
+	{
+		const float *a = arrays[i] + cell;
+		float x00 = lerp(a[0], a[1], f[0]);
+		float x10 = lerp(a[dy], a[dy+1], f[0]);
+		float x01 = lerp(a[dz], a[dz+1], f[0]);
+		float x11 = lerp(a[dy+dz], a[dy+dz+1], f[0]);
+		out[i] = lerp(lerp(x00, x10, f[1]), lerp(x01, x11, f[1]), f[2]);
+	}
+}
+
+// same test as particle_inside_bound()
+static int grid_inside(const struct fluid_grid *grid, float rx, float ry, float rz)
+{
+	return rx >= 0.0f && ry >= 0.0f && rz >= 0.0f
+		&& rx <= grid->volume.x && ry <= grid->volume.y && rz <= grid->volume.z;
+}
+
+static int grid_advect_scalar(const struct fluid_grid *grid,
+	struct particle *particles, int count, float deltatime)
+{
+	int inside = 0;
+	for(int i=0; i<count; i++)
+	{
+		vec3 *p = &particles[i].p;
+		float rx = p->x - grid->origin.x;
+		float ry = p->y - grid->origin.y;
+		float rz = p->z - grid->origin.z;
+		if(!grid_inside(grid, rx, ry, rz))
+			continue;
+		float v[3];
+		grid_sample(grid, rx, ry, rz, v);
+		p->x += v[0] * deltatime;
+		p->y += v[1] * deltatime;
+		p->z += v[2] * deltatime;
+		inside++;
+	}
+	return inside;
+}
+
+#ifdef FLUID_GRID_X86
+
+// interpolate one array between the 8 corners of each lane's cell
+__attribute__((target("avx2,fma")))
+static inline __m256 grid_lerp_avx2(const float *a, __m256i cell, __m256i dy, __m256i dz,
+	__m256 fx, __m256 fy, __m256 fz)
+{
+	__m256i one = _mm256_set1_epi32(1);
+	__m256i c010 = _mm256_add_epi32(cell, dy);
+	__m256i c001 = _mm256_add_epi32(cell, dz);
+	__m256i c011 = _mm256_add_epi32(c010, dz);
+	__m256 a000 = _mm256_i32gather_ps(a, cell, 4);
+	__m256 a100 = _mm256_i32gather_ps(a, _mm256_add_epi32(cell, one), 4);
+	__m256 a010 = _mm256_i32gather_ps(a, c010, 4);
+	__m256 a110 = _mm256_i32gather_ps(a, _mm256_add_epi32(c010, one), 4);
+	__m256 a001 = _mm256_i32gather_ps(a, c001, 4);
+	__m256 a101 = _mm256_i32gather_ps(a, _mm256_add_epi32(c001, one), 4);
+	__m256 a011 = _mm256_i32gather_ps(a, c011, 4);
+	__m256 a111 = _mm256_i32gather_ps(a, _mm256_add_epi32(c011, one), 4);
+	__m256 x00 = _mm256_fmadd_ps(_mm256_sub_ps(a100, a000), fx, a000);
+	__m256 x10 = _mm256_fmadd_ps(_mm256_sub_ps(a110, a010), fx, a010);
+	__m256 x01 = _mm256_fmadd_ps(_mm256_sub_ps(a101, a001), fx, a001);
+	__m256 x11 = _mm256_fmadd_ps(_mm256_sub_ps(a111, a011), fx, a011);
+	__m256 y0 = _mm256_fmadd_ps(_mm256_sub_ps(x10, x00), fy, x00);
+	__m256 y1 = _mm256_fmadd_ps(_mm256_sub_ps(x11, x01), fy, x01);
+	return _mm256_fmadd_ps(_mm256_sub_ps(y1, y0), fz, y0);
+}
+
+// which cell each lane is in along one axis, and how far across it
+__attribute__((target("avx2,fma")))
+static inline __m256i grid_cell_avx2(__m256 r, __m256 inverse_step, __m256 cells, __m256 *f)
+{
+	__m256 g = _mm256_mul_ps(r, inverse_step);
+	g = _mm256_min_ps(_mm256_max_ps(g, _mm256_setzero_ps()), cells);
+	__m256 c = _mm256_min_ps(_mm256_floor_ps(g), _mm256_sub_ps(cells, _mm256_set1_ps(1.0f)));
+	*f = _mm256_sub_ps(g, c);
+	return _mm256_cvttps_epi32(c);
+}
+
+__attribute__((target("avx2,fma")))
+static int grid_advect_avx2(const struct fluid_grid *grid,
+	struct particle *particles, int count, float deltatime)
+{
+	// particles are gathered straight out of the array of structs
+	const int stride = sizeof(struct particle) / sizeof(float);
+	__m256i index = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+		_mm256_set1_epi32(stride));
+	__m256 ox = _mm256_set1_ps(grid->origin.x);
+	__m256 oy = _mm256_set1_ps(grid->origin.y);
+	__m256 oz = _mm256_set1_ps(grid->origin.z);
+	__m256 vol_x = _mm256_set1_ps(grid->volume.x);
+	__m256 vol_y = _mm256_set1_ps(grid->volume.y);
+	__m256 vol_z = _mm256_set1_ps(grid->volume.z);
+	__m256 inv_x = _mm256_set1_ps(grid->inverse_step.x);
+	__m256 inv_y = _mm256_set1_ps(grid->inverse_step.y);
+	__m256 inv_z = _mm256_set1_ps(grid->inverse_step.z);
+	__m256 cells = _mm256_set1_ps((float)grid->cells);
+	__m256i dy = _mm256_set1_epi32(grid->points);
+	__m256i dz = _mm256_set1_epi32(grid->points * grid->points);
+	__m256 dt = _mm256_set1_ps(deltatime);
+	__m256 zero = _mm256_setzero_ps();
+	int inside = 0;
+	int i = 0;
+
+	for(; i+8 <= count; i+=8)
+	{
+		float *base = &particles[i].p.x;
+		__m256 px = _mm256_i32gather_ps(base, index, 4);
+		__m256 py = _mm256_i32gather_ps(base + 1, index, 4);
+		__m256 pz = _mm256_i32gather_ps(base + 2, index, 4);
+		__m256 rx = _mm256_sub_ps(px, ox);
+		__m256 ry = _mm256_sub_ps(py, oy);
+		__m256 rz = _mm256_sub_ps(pz, oz);
+		__m256 mask = _mm256_and_ps(
+			_mm256_and_ps(_mm256_cmp_ps(rx, zero, _CMP_GE_OQ), _mm256_cmp_ps(rx, vol_x, _CMP_LE_OQ)),
+			_mm256_and_ps(_mm256_cmp_ps(ry, zero, _CMP_GE_OQ), _mm256_cmp_ps(ry, vol_y, _CMP_LE_OQ)));
+		mask = _mm256_and_ps(mask,
+			_mm256_and_ps(_mm256_cmp_ps(rz, zero, _CMP_GE_OQ), _mm256_cmp_ps(rz, vol_z, _CMP_LE_OQ)));
+		int lanes = _mm256_movemask_ps(mask);
+		if(lanes == 0)
+			continue;
+
+		__m256 fx, fy, fz;
+		__m256i cx = grid_cell_avx2(rx, inv_x, cells, &fx);
+		__m256i cy = grid_cell_avx2(ry, inv_y, cells, &fy);
+		__m256i cz = grid_cell_avx2(rz, inv_z, cells, &fz);
+		__m256i cell = _mm256_add_epi32(cx, _mm256_add_epi32(
+			_mm256_mullo_epi32(cy, dy), _mm256_mullo_epi32(cz, dz)));
+
+		__m256 vx = grid_lerp_avx2(grid->vx, cell, dy, dz, fx, fy, fz);
+		__m256 vy = grid_lerp_avx2(grid->vy, cell, dy, dz, fx, fy, fz);
+		__m256 vz = grid_lerp_avx2(grid->vz, cell, dy, dz, fx, fy, fz);
+		px = _mm256_blendv_ps(px, _mm256_fmadd_ps(vx, dt, px), mask);
+		py = _mm256_blendv_ps(py, _mm256_fmadd_ps(vy, dt, py), mask);
+		pz = _mm256_blendv_ps(pz, _mm256_fmadd_ps(vz, dt, pz), mask);
+
+		float x[8], y[8], z[8];
+		_mm256_storeu_ps(x, px);
+		_mm256_storeu_ps(y, py);
+		_mm256_storeu_ps(z, pz);
+		for(int j=0; j<8; j++)
+		{
+			particles[i+j].p.x = x[j];
+			particles[i+j].p.y = y[j];
+			particles[i+j].p.z = z[j];
+		}
+		inside += __builtin_popcount(lanes);
+	}
+	return inside + grid_advect_scalar(grid, particles + i, count - i, deltatime);
+}
+
+#endif
+
+struct fluid_grid* fluid_grid_init(int cells)
+{
+	struct fluid_grid *grid;
+
+	// the corner offsets are 32 bit in the vector kernel
+	if(cells < 1 || cells > 1023)
+	{
+		log_error("fluid_grid_init() %d cells is out of range", cells);
+		return NULL;
+	}
+
+	grid = malloc(sizeof(struct fluid_grid));
+	if(grid == NULL)
+	{
+		log_error("malloc(fluid_grid) %s", strerror(errno));
+		return NULL;
+	}
+	memset(grid, 0, sizeof(struct fluid_grid));
+	grid->cells = cells;
+	grid->points = cells + 1;
+	grid->volume = (vec3){{1.0f, 1.0f, 1.0f}};
+	grid->inverse_step = (vec3){{(float)cells, (float)cells, (float)cells}};
+
+	size_t points = (size_t)grid->points * grid->points * grid->points;
+	grid->vx = calloc(points * 3, sizeof(float));
+	if(grid->vx == NULL)
+	{
+		log_error("calloc(fluid_grid) %s", strerror(errno));
+		free(grid);
+		return NULL;
+	}
+	grid->vy = grid->vx + points;
+	grid->vz = grid->vy + points;
+
+#ifdef FLUID_GRID_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+		fluid_grid_kernel = grid_advect_avx2;
+#endif
+	return grid;
+}
+
+void fluid_grid_free(struct fluid_grid *grid)
+{
+	if(grid == NULL)
+		return;
+	free(grid->vx);
+	free(grid);
+}
+
+// evaluate one chunk of grid points with the treecode
+static void fluid_grid_fill(void *data, int start, int end, int thread)
+{
+	struct fluid_grid_job *job = data;
+	struct fluid_grid *grid = job->grid;
+	int points = grid->points;
+
+	for(int i=start; i<end; i++)
+	{
+		int x = i % points;
+		int y = (i / points) % points;
+		int z = i / (points * points);
+		vec3 position = (vec3){{
+			grid->origin.x + x * job->step.x,
+			grid->origin.y + y * job->step.y,
+			grid->origin.z + z * job->step.z }};
+		vec3 velocity = fluid_tree_velocity(job->sim, position);
+		grid->vx[i] = velocity.x;
+		grid->vy[i] = velocity.y;
+		grid->vz[i] = velocity.z;
+	}
+}
+
+// Make the grid cover the octtree's volume, resizing it if
+// sim->grid_cells has changed. returns 0 on success
+int fluid_grid_fit(struct fluid_sim *sim)
+{
+	if(sim->grid == NULL || sim->grid->cells != sim->grid_cells)
+	{
+		fluid_grid_free(sim->grid);
+		sim->grid = fluid_grid_init(sim->grid_cells);
+		if(sim->grid == NULL)
+			return 1;
+	}
+	struct fluid_grid *grid = sim->grid;
+	float cells = (float)grid->cells;
+
+	// the volume may have grown since the last frame
+	grid->origin = sim->octtree->origin;
+	grid->volume = sim->octtree->volume;
+	grid->inverse_step = (vec3){{
+		cells / grid->volume.x,
+		cells / grid->volume.y,
+		cells / grid->volume.z }};
+	return 0;
+}
+
+// Fill the grid from the current octtree, resizing it if sim->grid_cells
+// has changed. returns 0 on success
+int fluid_grid_update(struct fluid_sim *sim)
+{
+	if(fluid_grid_fit(sim))
+		return 1;
+	struct fluid_grid *grid = sim->grid;
+	float cells = (float)grid->cells;
+
+	struct fluid_grid_job job;
+	job.sim = sim;
+	job.grid = grid;
+	job.step = (vec3){{
+		grid->volume.x / cells,
+		grid->volume.y / cells,
+		grid->volume.z / cells }};
+	thread_pool_run(sim->pool, grid->points * grid->points * grid->points,
+		FLUID_GRID_CHUNK, fluid_grid_fill, &job);
+	return 0;
+}
+
+// the velocity at a position, outside the volume it is taken from the edge
+vec3 fluid_grid_velocity(struct fluid_grid *grid, vec3 position)
+{
+	vec3 result;
+	grid_sample(grid, position.x - grid->origin.x,
+		position.y - grid->origin.y,
+		position.z - grid->origin.z, result.f);
+	return result;
+}
+
+// Move each tracer inside the volume along the grid velocity.
+// returns how many were inside
+int fluid_grid_advect(struct fluid_grid *grid, struct particle *particles, int count, float deltatime)
+{
+	return fluid_grid_kernel(grid, particles, count, deltatime);
+}
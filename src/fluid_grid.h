@@ -0,0 +1,49 @@
+/*
+Copyright (c) 2020 Daniel Burke
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+#ifndef __DPB_FLUID_GRID_H__
+#define __DPB_FLUID_GRID_H__
+
+#include "3dmaths.h"
+
+struct fluid_sim;
+struct particle;
+
+// velocity sampled on a regular grid of points spanning the volume
+struct fluid_grid {
+	int cells;		// along each axis
+	int points;		// along each axis, cells + 1
+	vec3 origin;
+	vec3 volume;
+	vec3 inverse_step;	// cells per unit length
+	float *vx, *vy, *vz;	// points^3 each, x varies fastest
+};
+
+struct fluid_grid* fluid_grid_init(int cells);
+void fluid_grid_free(struct fluid_grid *grid);
+int fluid_grid_fit(struct fluid_sim *sim);
+int fluid_grid_update(struct fluid_sim *sim);
+vec3 fluid_grid_velocity(struct fluid_grid *grid, vec3 position);
+int fluid_grid_advect(struct fluid_grid *grid, struct particle *particles, int count, float deltatime);
+
+#endif
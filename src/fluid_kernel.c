@@ -0,0 +1,193 @@
+/*
+Copyright (c) 2020 Daniel Burke
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+// Smoothing kernels, how the vorticity of a vorton is spread around it.
+// A point vortex has a velocity that grows without limit close to it, a
+// kernel spreads it over about one radius so it stays finite, and they
+// differ in how quickly they reach the point vortex law further out.
+// Each kernel has its own sums in fluid_simd.c, chosen here once, so the
+// law is never looked up per vorton.
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+
+#include "log.h"
+#include "fluid.h"
+#include "fluid_kernel.h"
+#include "fluid_fmm.h"
+#include "fluid_simd.h"
+
+void fluid_smoothing_free(struct fluid_smoothing *smoothing)
+{
+	if(smoothing == NULL)
+		return;
+	free(smoothing->table);
+	free(smoothing);
+}
+
+// where each law is within about 0.1% of a point, squared, Rosenhead-Moore
+// never gets much closer than 1% in reach
+static float fluid_kernel_point2(enum fluid_kernel kernel, float radius)
+{
+	float point = radius;
+	switch(kernel)
+	{
+	case FLUID_KERNEL_ROSENHEAD:
+		point = 10.0f * radius;
+		break;
+	case FLUID_KERNEL_GAUSSIAN:
+		point = 4.0f * radius;
+		break;
+	case FLUID_KERNEL_ALGEBRAIC:
+		point = 6.0f * radius;
+		break;
+	default:
+		break;
+	}
+	return point * point;
+}
+
+// the FMM only expands the point law, so its far field has to be clear
+// of the smoothing. returns 0 if the sim can take a smoothing this wide
+static int fluid_kernel_fits(struct fluid_sim *sim, float point2)
+{
+	if(sim->velocity_mode != FLUID_VELOCITY_FMM || sim->fmm == NULL)
+		return 0;
+	if(fluid_fmm_level(sim->fmm, sim->octtree->volume, point2))
+		return 0;
+	log_error("fluid_kernel() the smoothing reaches %g, too wide for the FMM's far field",
+		sqrtf(point2));
+	return 1;
+}
+
+// the sim's smoothing, with the constants of a kernel and radius worked out
+static struct fluid_smoothing* fluid_smoothing_set(struct fluid_sim *sim,
+	enum fluid_kernel kernel, float radius)
+{
+	if(!(radius > 0.0f) || kernel < 0 || kernel >= FLUID_KERNEL_COUNT)
+	{
+		log_error("fluid_kernel(%d, %g) is not a kernel", kernel, radius);
+		return NULL;
+	}
+	if(sim->smoothing == NULL)
+	{
+		sim->smoothing = calloc(1, sizeof(struct fluid_smoothing));
+		if(sim->smoothing == NULL)
+		{
+			log_error("calloc(fluid_smoothing) %s", strerror(errno));
+			return NULL;
+		}
+	}
+	struct fluid_smoothing *smoothing = sim->smoothing;
+	smoothing->kernel = kernel;
+	smoothing->radius = radius;
+	smoothing->rad2 = radius * radius;
+	smoothing->inv_radius = 1.0f / radius;
+	smoothing->inv_rad2 = 1.0f / smoothing->rad2;
+	smoothing->inv_rad3 = smoothing->inv_rad2 * smoothing->inv_radius;
+	smoothing->inv_rad5 = smoothing->inv_rad3 * smoothing->inv_rad2;
+	// (1 / 4 pi) * 8 R^3
+	smoothing->scale = 0.636619772367f * smoothing->rad2 * radius;
+	smoothing->point2 = fluid_kernel_point2(kernel, radius);
+	fluid_simd_kernel(smoothing);
+	return smoothing;
+}
+
+// Pick the smoothing kernel and its radius, the sim starts with the core
+// kernel and FLUID_VORTON_RADIUS. The tabulated kernel is filled with the
+// Gaussian, see fluid_kernel_table() for any other law. The FMM refuses a
+// smoothing too wide to leave it any far field.
+// returns 0 on success
+int fluid_kernel(struct fluid_sim *sim, enum fluid_kernel kernel, float radius)
+{
+	if(kernel == FLUID_KERNEL_TABLE)
+		return fluid_kernel_table(sim, fluid_kernel_gaussian, 6.0f, radius);
+	if(fluid_kernel_fits(sim, fluid_kernel_point2(kernel, radius)))
+		return 1;
+	struct fluid_smoothing *smoothing = fluid_smoothing_set(sim, kernel, radius);
+	if(smoothing == NULL)
+		return 1;
+	free(smoothing->table);
+	smoothing->table = NULL;
+	smoothing->table_size = 0;
+	return 0;
+}
+
+// Use a tabulated kernel, law(s) gives the law times R^3 at s = r^2/R^2,
+// and is sampled out to reach radii, past which the law is 1/r^3. It
+// should meet 1/r^3 there, as every other kernel does.
+// returns 0 on success
+int fluid_kernel_table(struct fluid_sim *sim, float (*law)(float s), float reach, float radius)
+{
+	if(!(reach > 0.0f))
+	{
+		log_error("fluid_kernel_table() reach %g", reach);
+		return 1;
+	}
+	if(fluid_kernel_fits(sim, reach * reach * radius * radius))
+		return 1;
+	float *table = malloc(FLUID_KERNEL_TABLE_SIZE * sizeof(float));
+	if(table == NULL)
+	{
+		log_error("malloc(fluid_kernel_table) %s", strerror(errno));
+		return 1;
+	}
+	struct fluid_smoothing *smoothing = fluid_smoothing_set(sim, FLUID_KERNEL_TABLE, radius);
+	if(smoothing == NULL)
+	{
+		free(table);
+		return 1;
+	}
+	free(smoothing->table);
+	smoothing->table = table;
+	smoothing->table_size = FLUID_KERNEL_TABLE_SIZE;
+	smoothing->reach2 = reach * reach;
+	smoothing->point2 = smoothing->reach2 * smoothing->rad2;
+	smoothing->table_scale = (FLUID_KERNEL_TABLE_SIZE - 1) / smoothing->reach2;
+	for(int i=0; i<FLUID_KERNEL_TABLE_SIZE; i++)
+		table[i] = law(i / smoothing->table_scale);
+	return 0;
+}
+
+// The Gaussian kernel's law times R^3 at s = r^2/R^2, in full precision,
+// it is the fraction of the vorticity within r, over (r/R)^3
+float fluid_kernel_gaussian(float s)
+{
+	const double root_2_over_pi = 0.79788456080286536;
+	if(s < 4.0f)
+	{
+		// the power series, the closed form cancels badly near 0
+		double sum = 0.0, term = root_2_over_pi;
+		for(int n=0; n<24; n++)
+		{
+			sum += term / (2*n + 3);
+			term *= -s / (2.0 * (n + 1));
+		}
+		return sum;
+	}
+	double p = sqrt(s);
+	double k = erf(p * 0.70710678118654752) - root_2_over_pi * p * exp(-0.5 * s);
+	return k / (s * p);
+}
@@ -0,0 +1,66 @@
+/*
+Copyright (c) 2020 Daniel Burke
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+#ifndef __DPB_FLUID_KERNEL_H__
+#define __DPB_FLUID_KERNEL_H__
+
+#include "3dmaths.h"
+#include "fluid.h"
+
+// enum fluid_kernel has this many kernels
+#define FLUID_KERNEL_COUNT 5
+// samples of the law in a tabulated kernel
+#define FLUID_KERNEL_TABLE_SIZE 4096
+// added to the squared distance by the core kernel, so it is never zero
+#define FLUID_KERNEL_EPSILON 0.001f
+
+// The smoothing kernel a sim was set up with. Velocity from a vorton is
+// scale * (w x d) * law(|d|^2), every kernel's law tends to 1/r^3 far from
+// the vorton, and each has its own direct sum with the law built in.
+struct fluid_smoothing {
+	enum fluid_kernel kernel;
+	float radius;
+	float rad2, inv_radius, inv_rad2, inv_rad3, inv_rad5;
+	float scale;		// 8 R^3 / 4 pi, one cube of side 2R of vorticity
+	float *table;		// the law times R^3, for s = r^2/R^2 in even steps
+	int table_size;
+	float table_scale;	// table steps per unit of s
+	float reach2;		// s past which the table is not used, and the law is 1/r^3
+	float point2;		// r^2 past which the law is near enough 1/r^3 for series
+	// the vorton sum, the widest this CPU can run
+	void (*direct)(const struct fluid_smoothing *smoothing, struct vorton_soa *soa,
+		vec3 position, float *out);
+	// plain C, for when there are only a few vortons
+	void (*scalar)(const struct fluid_smoothing *smoothing, struct vorton_soa *soa,
+		vec3 position, float *out);
+	// as scalar, and adds the derivative of the velocity to gradient
+	void (*gradient)(const struct fluid_smoothing *smoothing, struct vorton_soa *soa,
+		vec3 position, float *out, vec3 gradient[3]);
+};
+
+void fluid_smoothing_free(struct fluid_smoothing *smoothing);
+int fluid_kernel(struct fluid_sim *sim, enum fluid_kernel kernel, float radius);
+int fluid_kernel_table(struct fluid_sim *sim, float (*law)(float s), float reach, float radius);
+float fluid_kernel_gaussian(float s);
+
+#endif
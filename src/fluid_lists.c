@@ -0,0 +1,510 @@
+/*
+Copyright (c) 2020 Daniel Burke
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+// Interaction lists kept between velocity batches.
+// Queries in the same octtree cell walk the octtree the same way, so the
+// walk is done once per cell and what it decided is kept, as node indices
+// only, so the nodes' sums are read fresh each time. Nodes are accepted by
+// the distance from the middle of their cell to the target's cell, not
+// from their centroid, so a list holds for as long as the octtree keeps
+// its shape, wherever the vortons move inside their cells. A refit keeps
+// the shape, but adds a node where a vorton moves into an empty cell, and
+// a node may cross the 8 vortons that decide whether it is taken as its
+// vortons. Those are found by a sweep of the octtree, and only the lists
+// that could have reached them are thrown away. Everything else renumbers
+// the nodes, and every list goes.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "log.h"
+#include "fluid.h"
+#include "fluid_lists.h"
+#include "fluid_morton.h"
+#include "fluid_kernel.h"
+#include "thread_pool.h"
+
+// a target whose list is being made this batch
+#define FLUID_LISTS_PENDING (UINT32_MAX - 1)
+// lists made on a worker at a time
+#define FLUID_LISTS_CHUNK 4
+// changed nodes are checked against every list, past this many checks
+// per entry kept it is cheaper to walk again
+#define FLUID_LISTS_CHECKS 4
+
+struct fluid_lists_job {
+	struct fluid_sim *sim;
+	struct fluid_lists *lists;
+};
+
+// an octtree node on a walk, and its cell
+struct fluid_lists_step {
+	uint32_t node;
+	int depth;
+	uint32_t x, y, z;
+};
+
+static void fluid_lists_thread_free(struct fluid_lists_thread *thread)
+{
+	free(thread->entry);
+	for(int s=0; s<3; s++)
+		free(thread->scratch[s]);
+}
+
+void fluid_lists_free(struct fluid_lists *lists)
+{
+	if(lists == NULL)
+		return;
+	free(lists->list);
+	free(lists->small);
+	free(lists->target);
+	free(lists->entry);
+	free(lists->pending);
+	free(lists->pending_thread);
+	free(lists->dirty);
+	if(lists->thread)
+	{
+		for(int t=0; t<lists->threads; t++)
+			fluid_lists_thread_free(&lists->thread[t]);
+		free(lists->thread);
+	}
+	free(lists);
+}
+
+// array grown to hold need elements of size bytes, doubling, or NULL
+// with array left as it was
+static void* fluid_lists_grow(void *array, uint32_t *capacity, uint32_t need, size_t size)
+{
+	if(need <= *capacity)
+		return array;
+	uint32_t grown_capacity = *capacity ? *capacity : 256;
+	while(grown_capacity < need)
+		grown_capacity *= 2;
+	void *grown = realloc(array, grown_capacity * size);
+	if(grown == NULL)
+	{
+		log_error("realloc(fluid_lists) %s", strerror(errno));
+		return NULL;
+	}
+	*capacity = grown_capacity;
+	return grown;
+}
+
+// add a node to one of a thread's scratch lists
+static inline int fluid_lists_push(struct fluid_lists_thread *thread, int s, uint32_t node)
+{
+	if(thread->scratch_count[s] == thread->scratch_capacity[s])
+	{
+		uint32_t *grown = fluid_lists_grow(thread->scratch[s], &thread->scratch_capacity[s],
+			thread->scratch_count[s] + 1, sizeof(uint32_t));
+		if(grown == NULL)
+			return 1;
+		thread->scratch[s] = grown;
+	}
+	thread->scratch[s][thread->scratch_count[s]++] = node;
+	return 0;
+}
+
+// the bounds of a cell at some depth
+static void fluid_lists_cell(struct octtree *octtree, int depth, uint32_t x, uint32_t y, uint32_t z,
+	vec3 *low, vec3 *high)
+{
+	vec3 size = (vec3){{ldexpf(octtree->volume.x, -depth), ldexpf(octtree->volume.y, -depth),
+		ldexpf(octtree->volume.z, -depth)}};
+	*low = (vec3){{octtree->origin.x + x * size.x, octtree->origin.y + y * size.y,
+		octtree->origin.z + z * size.z}};
+	*high = add(*low, size);
+}
+
+// squared distance from the middle of a cell to the nearest point of a box
+static inline float fluid_lists_distance2(vec3 low, vec3 high, vec3 cell_low, vec3 cell_high)
+{
+	float x = (cell_low.x + cell_high.x) * 0.5f;
+	float y = (cell_low.y + cell_high.y) * 0.5f;
+	float z = (cell_low.z + cell_high.z) * 0.5f;
+	float dx = nmax(0.0f, nmax(low.x - x, x - high.x));
+	float dy = nmax(0.0f, nmax(low.y - y, y - high.y));
+	float dz = nmax(0.0f, nmax(low.z - z, z - high.z));
+	return dx*dx + dy*dy + dz*dz;
+}
+
+// Walk the octtree for every query in a cell at once, as
+// fluid_batch_walk() does for a packet, into a thread's scratch lists.
+// A node is taken whole if the middle of its cell passes the opening angle
+// from the nearest point of the target's. returns 0 on success
+static int fluid_lists_walk(struct fluid_sim *sim, struct fluid_lists_thread *thread,
+	vec3 low, vec3 high)
+{
+	struct octtree *octtree = sim->octtree;
+	struct vorton_soa *nodes = &sim->nodes;
+	float theta2 = sim->theta * sim->theta;
+	float volume = nmax(octtree->volume.x, nmax(octtree->volume.y, octtree->volume.z));
+	float point2 = sim->smoothing->point2;
+	int moments = sim->aggregate != FLUID_AGGREGATE_MONOPOLE;
+	struct fluid_lists_step stack[8*32+1];
+	int top = 0;
+
+	for(int s=0; s<3; s++)
+		thread->scratch_count[s] = 0;
+	if(nodes->counts[0] == 0)
+		return 0;
+
+	stack[top++] = (struct fluid_lists_step){0, 0, 0, 0, 0};
+	while(top)
+	{
+		struct fluid_lists_step step = stack[--top];
+		uint32_t here = step.node;
+		if(nodes->counts[here] <= 8)
+		{
+			if(fluid_lists_push(thread, 0, here))
+				return 1;
+			continue;
+		}
+
+		vec3 node_low, node_high;
+		fluid_lists_cell(octtree, step.depth, step.x, step.y, step.z, &node_low, &node_high);
+		float dist2 = fluid_lists_distance2(low, high, node_low, node_high);
+		float size = ldexpf(volume, -step.depth);
+		if(size*size < theta2 * dist2)
+		{
+			if(fluid_lists_push(thread, (moments && dist2 > point2) ? 2 : 1, here))
+				return 1;
+			continue;
+		}
+		if(step.depth >= sim->max_depth)
+		{
+			if(fluid_lists_push(thread, 1, here))
+				return 1;
+			continue;
+		}
+
+		for(int i=0; i<8; i++)
+		{
+			uint32_t child = octtree_node(octtree, here)->node[i];
+			if(child == 0)
+				continue;
+			if(top >= 8*32)
+			{
+				if(fluid_lists_push(thread, 1, child))
+					return 1;
+				continue;
+			}
+			stack[top++] = (struct fluid_lists_step){child, step.depth + 1,
+				2*step.x + (i & 1), 2*step.y + ((i >> 1) & 1), 2*step.z + ((i >> 2) & 1)};
+		}
+	}
+	return 0;
+}
+
+// make the lists of some pending targets, each into its thread's entries
+static void fluid_lists_make(void *data, int start, int end, int thread)
+{
+	struct fluid_lists_job *job = data;
+	struct fluid_sim *sim = job->sim;
+	struct fluid_lists *lists = job->lists;
+	struct fluid_lists_thread *here = &lists->thread[thread];
+
+	for(int p=start; p<end; p++)
+	{
+		struct fluid_list *list = &lists->list[lists->pending[p]];
+		uint32_t x, y, z;
+		fluid_morton_decode(list->key, &x, &y, &z);
+		vec3 low, high;
+		fluid_lists_cell(sim->octtree, list->depth, x, y, z, &low, &high);
+		lists->pending_thread[p] = FLUID_LISTS_NONE;
+		if(fluid_lists_walk(sim, here, low, high))
+			continue;
+
+		uint32_t length = here->scratch_count[0] + here->scratch_count[1] + here->scratch_count[2];
+		uint32_t *grown = fluid_lists_grow(here->entry, &here->capacity,
+			here->count + length, sizeof(uint32_t));
+		if(grown == NULL)
+			continue;
+		here->entry = grown;
+		list->start = here->count;
+		list->leaves = here->scratch_count[0];
+		list->nodes = here->scratch_count[1];
+		list->far = here->scratch_count[2];
+		for(int s=0; s<3; s++)
+		{
+			memcpy(here->entry + here->count, here->scratch[s], here->scratch_count[s] * sizeof(uint32_t));
+			here->count += here->scratch_count[s];
+		}
+		lists->pending_thread[p] = thread;
+	}
+}
+
+// throw every list away
+static void fluid_lists_clear(struct fluid_lists *lists)
+{
+	for(uint32_t t=0; t<lists->target_count; t++)
+		lists->list[lists->target[t]].start = FLUID_LISTS_NONE;
+	lists->target_count = 0;
+	lists->entry_count = 0;
+	lists->garbage = 0;
+}
+
+// note the parent of a node that changed, the lists that opened it are stale
+static int fluid_lists_dirty(struct fluid_lists *lists, vec3 low, vec3 high)
+{
+	vec3 *grown = fluid_lists_grow(lists->dirty, &lists->dirty_capacity,
+		2 * (lists->dirty_count + 1), sizeof(vec3));
+	if(grown == NULL)
+		return 1;
+	lists->dirty = grown;
+	lists->dirty[lists->dirty_count*2] = low;
+	lists->dirty[lists->dirty_count*2+1] = high;
+	lists->dirty_count++;
+	return 0;
+}
+
+// Sweep the octtree for nodes added since the last check, or that have
+// crossed 8 vortons, and throw away the lists that could have reached
+// them. returns 0 on success, or 1 if every list has to go
+static int fluid_lists_check(struct fluid_sim *sim, struct fluid_lists *lists)
+{
+	struct octtree *octtree = sim->octtree;
+	struct vorton_soa *nodes = &sim->nodes;
+	uint32_t known = lists->node_count;
+	lists->dirty_count = 0;
+	if((nodes->counts[0] <= 8) != lists->small[0])
+		return 1;
+
+	struct fluid_lists_step stack[8*32+1];
+	int top = 0;
+	stack[top++] = (struct fluid_lists_step){0, 0, 0, 0, 0};
+	while(top)
+	{
+		struct fluid_lists_step step = stack[--top];
+		struct octtree_node *node = octtree_node(octtree, step.node);
+		int parent = 0;
+		for(int i=0; i<8; i++)
+		{
+			uint32_t child = node->node[i];
+			if(child == 0)
+				continue;
+			uint8_t small = nodes->counts[child] <= 8;
+			if(child >= known || small != lists->small[child])
+				parent = 1;
+			lists->small[child] = small;
+			if(top >= 8*32)
+				return 1;
+			stack[top++] = (struct fluid_lists_step){child, step.depth + 1,
+				2*step.x + (i & 1), 2*step.y + ((i >> 1) & 1), 2*step.z + ((i >> 2) & 1)};
+		}
+		if(parent)
+		{
+			vec3 low, high;
+			fluid_lists_cell(octtree, step.depth, step.x, step.y, step.z, &low, &high);
+			if(fluid_lists_dirty(lists, low, high))
+				return 1;
+		}
+	}
+	if(lists->dirty_count == 0)
+		return 0;
+	if((uint64_t)lists->dirty_count * lists->target_count
+	> (uint64_t)FLUID_LISTS_CHECKS * lists->entry_count)
+		return 1;
+
+	// a list reached a node only if the walk opened its parent
+	float theta2 = sim->theta * sim->theta;
+	for(uint32_t t=0; t<lists->target_count; )
+	{
+		struct fluid_list *list = &lists->list[lists->target[t]];
+		uint32_t x, y, z;
+		fluid_morton_decode(list->key, &x, &y, &z);
+		vec3 low, high;
+		fluid_lists_cell(octtree, list->depth, x, y, z, &low, &high);
+		int stale = 0;
+		for(uint32_t d=0; d<lists->dirty_count && !stale; d++)
+		{
+			vec3 parent_low = lists->dirty[d*2], parent_high = lists->dirty[d*2+1];
+			vec3 extent = sub(parent_high, parent_low);
+			float size = nmax(extent.x, nmax(extent.y, extent.z));
+			stale = size*size >= theta2 * fluid_lists_distance2(low, high, parent_low, parent_high);
+		}
+		if(stale)
+		{
+			lists->garbage += list->leaves + list->nodes + list->far;
+			list->start = FLUID_LISTS_NONE;
+			lists->target[t] = lists->target[--lists->target_count];
+		}
+		else
+			t++;
+	}
+	return 0;
+}
+
+// make sure there is a list entry for every node, and a thread for the
+// pool, or free the lists and return NULL
+static struct fluid_lists* fluid_lists_reserve(struct fluid_sim *sim, struct fluid_lists *lists)
+{
+	if(lists == NULL)
+	{
+		lists = calloc(1, sizeof(struct fluid_lists));
+		if(lists == NULL)
+		{
+			log_error("calloc(fluid_lists) %s", strerror(errno));
+			return NULL;
+		}
+		lists->threads = thread_pool_size(sim->pool);
+		lists->thread = calloc(lists->threads, sizeof(struct fluid_lists_thread));
+		if(lists->thread == NULL)
+		{
+			log_error("calloc(fluid_lists) %s", strerror(errno));
+			free(lists);
+			return NULL;
+		}
+		lists->tree_builds = -1;
+	}
+
+	uint32_t nodes = sim->octtree->node_count;
+	uint32_t capacity = lists->capacity;
+	struct fluid_list *list = fluid_lists_grow(lists->list, &capacity, nodes, sizeof(struct fluid_list));
+	if(list)
+		lists->list = list;
+	capacity = lists->capacity;
+	uint8_t *small = fluid_lists_grow(lists->small, &capacity, nodes, sizeof(uint8_t));
+	if(small)
+		lists->small = small;
+	if(list == NULL || small == NULL)
+	{
+		fluid_lists_free(lists);
+		return NULL;
+	}
+	for(uint32_t n=lists->capacity; n<capacity; n++)
+	{
+		lists->list[n].start = FLUID_LISTS_NONE;
+		lists->small[n] = 0;
+	}
+	lists->capacity = capacity;
+	return lists;
+}
+
+// Make sure each target has a list, keeping the ones still right from
+// the last batch, targets with node FLUID_LISTS_NONE are skipped.
+// returns the lists, or NULL if they could not be made, a target whose
+// list could not be made has start FLUID_LISTS_NONE
+struct fluid_lists* fluid_lists_update(struct fluid_sim *sim, struct fluid_lists *lists,
+	const struct fluid_target *targets, int count)
+{
+	lists = fluid_lists_reserve(sim, lists);
+	if(lists == NULL)
+		return NULL;
+	struct octtree *octtree = sim->octtree;
+	struct vorton_soa *nodes = &sim->nodes;
+
+	if(lists->tree_builds != sim->tree_builds || lists->theta != sim->theta
+	|| lists->point2 != sim->smoothing->point2 || lists->aggregate != sim->aggregate
+	|| lists->node_count > octtree->node_count
+	|| lists->garbage > lists->entry_count / 2
+	|| (sim->tree_build == FLUID_TREE_REFIT && fluid_lists_check(sim, lists)))
+	{
+		fluid_lists_clear(lists);
+		for(uint32_t n=0; n<octtree->node_count; n++)
+			lists->small[n] = nodes->counts[n] <= 8;
+		lists->tree_builds = sim->tree_builds;
+		lists->theta = sim->theta;
+		lists->point2 = sim->smoothing->point2;
+		lists->aggregate = sim->aggregate;
+	}
+	lists->node_count = octtree->node_count;
+
+	// each target once, even if its queries are in several groups
+	lists->pending_count = 0;
+	lists->kept = 0;
+	for(int g=0; g<count; g++)
+	{
+		if(targets[g].node == FLUID_LISTS_NONE)
+			continue;
+		struct fluid_list *list = &lists->list[targets[g].node];
+		if(list->start == FLUID_LISTS_PENDING)
+			continue;
+		if(list->start != FLUID_LISTS_NONE)
+		{
+			lists->kept++;
+			continue;
+		}
+		uint32_t *pending = fluid_lists_grow(lists->pending, &lists->pending_capacity,
+			lists->pending_count + 1, sizeof(uint32_t));
+		if(pending == NULL)
+			break;
+		lists->pending = pending;
+		list->start = FLUID_LISTS_PENDING;
+		list->key = targets[g].key;
+		list->depth = targets[g].depth;
+		lists->pending[lists->pending_count++] = targets[g].node;
+	}
+	free(lists->pending_thread);
+	lists->pending_thread = malloc((lists->pending_count + 1) * sizeof(uint32_t));
+	if(lists->pending_thread == NULL)
+	{
+		log_error("malloc(fluid_lists) %s", strerror(errno));
+		for(uint32_t p=0; p<lists->pending_count; p++)
+			lists->list[lists->pending[p]].start = FLUID_LISTS_NONE;
+		return lists;
+	}
+
+	struct fluid_lists_job job;
+	job.sim = sim;
+	job.lists = lists;
+	for(int t=0; t<lists->threads; t++)
+		lists->thread[t].count = 0;
+	thread_pool_run(sim->pool, lists->pending_count, FLUID_LISTS_CHUNK, fluid_lists_make, &job);
+
+	// gather what each thread made into one run
+	lists->made = 0;
+	for(uint32_t p=0; p<lists->pending_count; p++)
+	{
+		uint32_t node = lists->pending[p];
+		struct fluid_list *list = &lists->list[node];
+		uint32_t thread = lists->pending_thread[p];
+		uint32_t length = list->leaves + list->nodes + list->far;
+		uint32_t *entry = NULL, *target = NULL;
+		if(thread != FLUID_LISTS_NONE)
+		{
+			entry = fluid_lists_grow(lists->entry, &lists->entry_capacity,
+				lists->entry_count + length, sizeof(uint32_t));
+			if(entry)
+				lists->entry = entry;
+			target = fluid_lists_grow(lists->target, &lists->target_capacity,
+				lists->target_count + 1, sizeof(uint32_t));
+			if(target)
+				lists->target = target;
+		}
+		if(entry == NULL || target == NULL)
+		{
+			list->start = FLUID_LISTS_NONE;
+			continue;
+		}
+		memcpy(lists->entry + lists->entry_count, lists->thread[thread].entry + list->start,
+			length * sizeof(uint32_t));
+		list->start = lists->entry_count;
+		lists->entry_count += length;
+		lists->target[lists->target_count++] = node;
+		lists->made++;
+	}
+	return lists;
+}
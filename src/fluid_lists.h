@@ -0,0 +1,88 @@
+/*
+Copyright (c) 2020 Daniel Burke
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+#ifndef __DPB_FLUID_LISTS_H__
+#define __DPB_FLUID_LISTS_H__
+
+#include <stdint.h>
+#include "3dmaths.h"
+#include "fluid.h"
+
+// a node with no list
+#define FLUID_LISTS_NONE UINT32_MAX
+
+// where queries share a list, an octtree node and its cell
+struct fluid_target {
+	uint32_t node;
+	uint32_t key;		// Morton key of the cell at its depth
+	int depth;
+};
+
+// what every query in a node's cell interacts with, a run of entries
+struct fluid_list {
+	uint32_t start;		// in entry, or FLUID_LISTS_NONE
+	uint32_t leaves;	// nodes of 8 vortons or fewer, taken as their vortons
+	uint32_t nodes;		// nodes taken whole
+	uint32_t far;		// nodes taken whole, with their moments
+	uint32_t key;		// of the cell, as in fluid_target
+	int depth;
+};
+
+// a list being made on a worker thread
+struct fluid_lists_thread {
+	uint32_t count, capacity;
+	uint32_t *entry;	// the lists made so far
+	uint32_t scratch_count[3], scratch_capacity[3];
+	uint32_t *scratch[3];	// leaves, nodes and far, for the list being walked
+};
+
+// Interaction lists kept between velocity batches, for as long as the
+// octtree keeps its shape, see fluid_lists.c
+struct fluid_lists {
+	int tree_builds;	// of the sim when the lists were made
+	float theta;		// and what they were made with
+	float point2;
+	enum fluid_aggregate aggregate;
+	uint32_t capacity;	// nodes
+	uint32_t node_count;	// nodes when last checked
+	struct fluid_list *list;	// per node
+	uint8_t *small;		// per node, 8 vortons or fewer when last checked
+	uint32_t *target;	// nodes with a list
+	uint32_t target_count, target_capacity;
+	uint32_t *entry;	// every list, one after another
+	uint32_t entry_count, entry_capacity;
+	uint32_t garbage;	// entries of lists thrown away
+	uint32_t *pending;	// targets that need a list, this batch
+	uint32_t *pending_thread;	// and the thread that made it
+	uint32_t pending_count, pending_capacity;
+	int threads;
+	struct fluid_lists_thread *thread;
+	vec3 *dirty;		// low and high of the parents of changed nodes
+	uint32_t dirty_count, dirty_capacity;
+	int made, kept;		// lists in the last batch
+};
+
+void fluid_lists_free(struct fluid_lists *lists);
+struct fluid_lists* fluid_lists_update(struct fluid_sim *sim, struct fluid_lists *lists,
+	const struct fluid_target *targets, int count);
+
+#endif
@@ -0,0 +1,228 @@
+/*
+Copyright (c) 2020 Daniel Burke
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+// Dipole and quadrupole moments of the octtree nodes.
+// A node far from a position is applied as a single vorton at its
+// centroid, the moments add the next two terms of its Taylor series, so
+// the error falls as (size/distance)^3 rather than (size/distance), and
+// fewer nodes need opening.
+// Once the octtree and its centroids are built, the vortons are bucketed
+// by leaf, every leaf sums its own vortons about its centroid, and then
+// each node adds up its children's moments, moved to its own centroid.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "log.h"
+#include "fluid.h"
+#include "fluid_moments.h"
+#include "fluid_morton.h"
+#include "fluid_refit.h"
+#include "thread_pool.h"
+
+// leaves are shared out in chunks of this many, and vortons in blocks
+#define FLUID_MOMENTS_CHUNK 64
+#define FLUID_MOMENTS_BLOCK 4096
+
+void fluid_moments_free(struct fluid_moments *moments)
+{
+	if(moments == NULL)
+		return;
+	free(moments->node);
+	free(moments->leaf);
+	free(moments->order);
+	free(moments->start);
+	free(moments->leaves);
+	free(moments);
+}
+
+// make sure there is room for count vortons and nodes octtree nodes
+static struct fluid_moments* fluid_moments_reserve(struct fluid_moments *moments,
+	int count, uint32_t nodes)
+{
+	if(moments && moments->vorton_capacity >= count && moments->capacity >= nodes)
+		return moments;
+	fluid_moments_free(moments);
+
+	moments = malloc(sizeof(struct fluid_moments));
+	if(moments == NULL)
+	{
+		log_error("malloc(fluid_moments) %s", strerror(errno));
+		return NULL;
+	}
+	memset(moments, 0, sizeof(struct fluid_moments));
+	moments->vorton_capacity = count;
+	moments->capacity = nodes;
+	moments->node = malloc(nodes * sizeof(struct fluid_moment));
+	moments->leaf = malloc(count * sizeof(uint32_t));
+	moments->order = malloc(count * sizeof(uint32_t));
+	moments->start = malloc((nodes + 2) * sizeof(uint32_t));
+	moments->leaves = malloc(nodes * sizeof(uint32_t));
+	if(!moments->node || !moments->leaf || !moments->order || !moments->start || !moments->leaves)
+	{
+		log_error("malloc(fluid_moments) %s", strerror(errno));
+		fluid_moments_free(moments);
+		return NULL;
+	}
+	return moments;
+}
+
+// find the leaf of each vorton
+static void fluid_moments_leaf(void *data, int start, int end, int thread)
+{
+	struct fluid_sim *sim = data;
+	struct vorton_soa *vortons = &sim->vortons;
+	uint32_t *leaf = sim->moments->leaf;
+	uint64_t outside = 1ull << (3*sim->max_depth);
+
+	// a refit already knows, 0 is outside as the root is never a leaf
+	if(sim->tree_build == FLUID_TREE_REFIT && sim->refit && sim->refit->valid)
+	{
+		for(int i=start; i<end; i++)
+			leaf[i] = sim->refit->leaf[i] ? sim->refit->leaf[i] : FLUID_MORTON_NONE;
+		return;
+	}
+
+	for(int i=start; i<end; i++)
+	{
+		vec3 position = (vec3){{vortons->px[i], vortons->py[i], vortons->pz[i]}};
+		uint64_t key = fluid_morton_key(sim->octtree, sim->max_depth, position);
+		leaf[i] = (key == outside) ? FLUID_MORTON_NONE : fluid_morton_leaf(sim, key);
+	}
+}
+
+// sum the vortons of some leaves about each leaf's centroid
+static void fluid_moments_leaves(void *data, int start, int end, int thread)
+{
+	struct fluid_sim *sim = data;
+	struct fluid_moments *moments = sim->moments;
+	struct vorton_soa *vortons = &sim->vortons;
+	struct vorton_soa *nodes = &sim->nodes;
+	// leaf n holds order[start[n+1]] up to order[start[n+2]]
+	const uint32_t *range = moments->start + 1;
+
+	for(int l=start; l<end; l++)
+	{
+		uint32_t n = moments->leaves[l];
+		struct fluid_moment *m = &moments->node[n];
+		for(uint32_t a=range[n]; a<range[n+1]; a++)
+		{
+			uint32_t i = moments->order[a];
+			float y[3] = {
+				vortons->px[i] - nodes->px[n],
+				vortons->py[i] - nodes->py[n],
+				vortons->pz[i] - nodes->pz[n] };
+			float w[3] = { vortons->wx[i], vortons->wy[i], vortons->wz[i] };
+			for(int c=0; c<3; c++)
+			{
+				m->d[0].f[c] += y[0] * w[c];
+				m->d[1].f[c] += y[1] * w[c];
+				m->d[2].f[c] += y[2] * w[c];
+				m->q[0].f[c] += y[0] * y[0] * w[c];
+				m->q[1].f[c] += y[0] * y[1] * w[c];
+				m->q[2].f[c] += y[0] * y[2] * w[c];
+				m->q[3].f[c] += y[1] * y[1] * w[c];
+				m->q[4].f[c] += y[1] * y[2] * w[c];
+				m->q[5].f[c] += y[2] * y[2] * w[c];
+			}
+		}
+	}
+}
+
+// Work out the moments of every node for the octtree as it is now, after
+// fluid_tree_update() has found the centroids. returns 0 on success
+int fluid_moments_update(struct fluid_sim *sim)
+{
+	struct octtree *octtree = sim->octtree;
+	struct vorton_soa *nodes = &sim->nodes;
+	int count = sim->vortons.count;
+	uint32_t node_count = octtree->node_count;
+
+	sim->moments = fluid_moments_reserve(sim->moments, sim->vortons.capacity,
+		octtree->node_pool_size);
+	if(sim->moments == NULL)
+		return 1;
+	struct fluid_moments *moments = sim->moments;
+	memset(moments->node, 0, node_count * sizeof(struct fluid_moment));
+
+	thread_pool_run(sim->pool, count, FLUID_MOMENTS_BLOCK, fluid_moments_leaf, sim);
+
+	// bucket the vortons by leaf, as fluid_diffuse() does
+	uint32_t *start = moments->start;
+	memset(start, 0, (node_count + 2) * sizeof(uint32_t));
+	for(int i=0; i<count; i++)
+		if(moments->leaf[i] != FLUID_MORTON_NONE)
+			start[moments->leaf[i] + 1]++;
+	moments->leaf_count = 0;
+	for(uint32_t n=0; n<node_count; n++)
+	{
+		if(start[n+1])
+			moments->leaves[moments->leaf_count++] = n;
+		start[n+1] += start[n];
+	}
+	start[node_count+1] = start[node_count];
+	for(int i=count-1; i>=0; i--)
+		if(moments->leaf[i] != FLUID_MORTON_NONE)
+			moments->order[--start[moments->leaf[i] + 1]] = i;
+
+	thread_pool_run(sim->pool, moments->leaf_count, FLUID_MOMENTS_CHUNK, fluid_moments_leaves, sim);
+
+	// children are numbered after their parent, so going backwards every
+	// child is done before its parent, y from the parent's centroid is
+	// y from the child's plus the step e between them
+	for(uint32_t n=node_count; n-- > 0; )
+	{
+		struct octtree_node *node = octtree_node(octtree, n);
+		struct fluid_moment *m = &moments->node[n];
+		for(int c=0; c<8; c++)
+		{
+			uint32_t child = node->node[c];
+			if(child == 0)
+				continue;
+			const struct fluid_moment *cm = &moments->node[child];
+			float e[3] = {
+				nodes->px[child] - nodes->px[n],
+				nodes->py[child] - nodes->py[n],
+				nodes->pz[child] - nodes->pz[n] };
+			float w[3] = { nodes->wx[child], nodes->wy[child], nodes->wz[child] };
+			for(int a=0; a<3; a++)
+			{
+				for(int i=0; i<3; i++)
+					m->d[i].f[a] += cm->d[i].f[a] + e[i] * w[a];
+				// ik = xx, xy, xz, yy, yz, zz
+				static const int pair[6][2] = {{0,0}, {0,1}, {0,2}, {1,1}, {1,2}, {2,2}};
+				for(int p=0; p<6; p++)
+				{
+					int i = pair[p][0], k = pair[p][1];
+					m->q[p].f[a] += cm->q[p].f[a]
+						+ e[i] * cm->d[k].f[a] + e[k] * cm->d[i].f[a]
+						+ e[i] * e[k] * w[a];
+				}
+			}
+		}
+	}
+	moments->valid = 1;
+	return 0;
+}
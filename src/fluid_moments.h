@@ -0,0 +1,161 @@
+/*
+Copyright (c) 2020 Daniel Burke
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+#ifndef __DPB_FLUID_MOMENTS_H__
+#define __DPB_FLUID_MOMENTS_H__
+
+#include <stdint.h>
+#include <math.h>
+#include "3dmaths.h"
+
+struct fluid_sim;
+
+// How a node's vorticity is spread about its centroid, y is from the
+// centroid to each vorton. The monopole is the node itself in sim->nodes.
+struct fluid_moment {
+	vec3 d[3];	// sum of w y_i, for each axis i
+	vec3 q[6];	// sum of w y_i y_k, for ik = xx, xy, xz, yy, yz, zz
+};
+
+struct fluid_moments {
+	int valid;		// built for the octtree as it is now
+	uint32_t capacity;	// nodes
+	int vorton_capacity;
+	struct fluid_moment *node;
+	uint32_t *leaf;		// per vorton
+	uint32_t *order;	// vortons, bucketed by leaf
+	uint32_t *start;	// per node, where its vortons begin in order
+	uint32_t *leaves;	// nodes that hold vortons
+	uint32_t leaf_count;
+};
+
+// The far field about a point c, as its Taylor series to second order,
+// for queries at c + y. Sources are added as point vortices.
+struct fluid_local {
+	vec3 u;		// velocity at c
+	vec3 g[3];	// its derivative along each axis k
+	vec3 h[6];	// its second along km = xx, xy, xz, yy, yz, zz
+};
+
+void fluid_moments_free(struct fluid_moments *moments);
+int fluid_moments_update(struct fluid_sim *sim);
+
+// The dipole, and if order is 2 the quadrupole, terms of a node's velocity
+// at r from its centroid. They come from the Taylor series of the point
+// vortex law, so they are only for r past the smoothing's point2.
+static inline vec3 fluid_moment_velocity(const struct fluid_moment *m, vec3 r, int order, float scale)
+{
+	// the law and its first two derivatives, by r^2
+	float inv = 1.0f / (r.x*r.x + r.y*r.y + r.z*r.z);
+	float law = inv * sqrtf(inv);
+	float slope = -1.5f * law * inv;
+	float curve = -2.5f * slope * inv;
+
+	// -sum_i D_i x e_i - 2 law' (sum_i r_i D_i) x r
+	const vec3 *d = m->d;
+	vec3 b;
+	for(int a=0; a<3; a++)
+		b.f[a] = r.x * d[0].f[a] + r.y * d[1].f[a] + r.z * d[2].f[a];
+	vec3 u;
+	u.x = -law * (d[2].y - d[1].z) - 2.0f * slope * (b.y * r.z - b.z * r.y);
+	u.y = -law * (d[0].z - d[2].x) - 2.0f * slope * (b.z * r.x - b.x * r.z);
+	u.z = -law * (d[1].x - d[0].y) - 2.0f * slope * (b.x * r.y - b.y * r.x);
+	if(order < 2)
+		return (vec3){{u.x * scale, u.y * scale, u.z * scale}};
+
+	// law' (2 sum_i P_i x e_i + T x r) + 2 law'' (sum_i r_i P_i) x r, with
+	// P_i = sum_k r_k Q_ik, and T the trace of Q
+	const vec3 *q = m->q;
+	vec3 p[3], t, c;
+	for(int a=0; a<3; a++)
+	{
+		p[0].f[a] = r.x * q[0].f[a] + r.y * q[1].f[a] + r.z * q[2].f[a];
+		p[1].f[a] = r.x * q[1].f[a] + r.y * q[3].f[a] + r.z * q[4].f[a];
+		p[2].f[a] = r.x * q[2].f[a] + r.y * q[4].f[a] + r.z * q[5].f[a];
+		t.f[a] = q[0].f[a] + q[3].f[a] + q[5].f[a];
+		c.f[a] = r.x * p[0].f[a] + r.y * p[1].f[a] + r.z * p[2].f[a];
+	}
+	u.x += slope * (2.0f * (p[2].y - p[1].z) + t.y * r.z - t.z * r.y)
+		+ 2.0f * curve * (c.y * r.z - c.z * r.y);
+	u.y += slope * (2.0f * (p[0].z - p[2].x) + t.z * r.x - t.x * r.z)
+		+ 2.0f * curve * (c.z * r.x - c.x * r.z);
+	u.z += slope * (2.0f * (p[1].x - p[0].y) + t.x * r.y - t.y * r.x)
+		+ 2.0f * curve * (c.x * r.y - c.y * r.x);
+	return (vec3){{u.x * scale, u.y * scale, u.z * scale}};
+}
+
+// add a point vortex of vorticity w at r from it to a local expansion,
+// order 1 keeps the gradient, 2 the second derivatives as well
+static inline void fluid_local_add(struct fluid_local *l, vec3 w, vec3 r, int order)
+{
+	float inv = 1.0f / (r.x*r.x + r.y*r.y + r.z*r.z);
+	float law = inv * sqrtf(inv);
+	float slope = -1.5f * law * inv;
+	float curve = -2.5f * slope * inv;
+
+	// w x r, and w x e_k for each axis
+	vec3 v = (vec3){{w.y*r.z - w.z*r.y, w.z*r.x - w.x*r.z, w.x*r.y - w.y*r.x}};
+	vec3 e[3];
+	e[0] = (vec3){{0.0f, w.z, -w.y}};
+	e[1] = (vec3){{-w.z, 0.0f, w.x}};
+	e[2] = (vec3){{w.y, -w.x, 0.0f}};
+
+	for(int a=0; a<3; a++)
+	{
+		l->u.f[a] += law * v.f[a];
+		for(int k=0; k<3; k++)
+			l->g[k].f[a] += law * e[k].f[a] + 2.0f * slope * v.f[a] * r.f[k];
+	}
+	if(order < 2)
+		return;
+
+	// 2 law' ((w x e_k) r_m + (w x e_m) r_k) + (w x r) (2 law' d_km + 4 law'' r_k r_m)
+	int km = 0;
+	for(int k=0; k<3; k++)
+	for(int m=k; m<3; m++, km++)
+	{
+		float diagonal = (k == m) ? 2.0f * slope : 0.0f;
+		float along = diagonal + 4.0f * curve * r.f[k] * r.f[m];
+		for(int a=0; a<3; a++)
+			l->h[km].f[a] += 2.0f * slope * (e[k].f[a] * r.f[m] + e[m].f[a] * r.f[k])
+				+ v.f[a] * along;
+	}
+}
+
+// the velocity at y from the centre of a local expansion
+static inline vec3 fluid_local_velocity(const struct fluid_local *l, vec3 y, int order, float scale)
+{
+	vec3 u;
+	for(int a=0; a<3; a++)
+		u.f[a] = l->u.f[a] + l->g[0].f[a] * y.x + l->g[1].f[a] * y.y + l->g[2].f[a] * y.z;
+	if(order >= 2)
+	{
+		const vec3 *h = l->h;
+		for(int a=0; a<3; a++)
+			u.f[a] += 0.5f * (h[0].f[a] * y.x*y.x + h[3].f[a] * y.y*y.y + h[5].f[a] * y.z*y.z)
+				+ h[1].f[a] * y.x*y.y + h[2].f[a] * y.x*y.z + h[4].f[a] * y.y*y.z;
+	}
+	return (vec3){{u.x * scale, u.y * scale, u.z * scale}};
+}
+
+#endif
@@ -0,0 +1,487 @@
+/*
+Copyright (c) 2020 Daniel Burke
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+// Octtree construction from sorted Morton keys.
+// Each vorton gets the key of its leaf cell, the keys are radix sorted, and
+// then every node is a run of vortons sharing a key prefix. The runs are
+// found, linked and summed in parallel blocks, from the leaves up, with
+// no data dependent walks down the tree.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include "log.h"
+#include "fluid.h"
+#include "fluid_morton.h"
+#include "fluid_refit.h"
+#include "thread_pool.h"
+
+// vortons per block, blocks are the unit of parallel work
+#define FLUID_MORTON_BLOCK 4096
+
+struct fluid_morton_job {
+	struct fluid_sim *sim;
+	struct fluid_morton *morton;
+	int count;		// vortons
+	int valid;		// vortons inside the volume
+	int shift;		// radix sort digit
+	int level;		// being summed
+	struct fluid_refit *refit;	// records each vorton's leaf, if not NULL
+	uint32_t level_offset[FLUID_MORTON_MAX_DEPTH+2];
+};
+
+void fluid_morton_free(struct fluid_morton *morton)
+{
+	if(morton == NULL)
+		return;
+	free(morton->key);
+	free(morton->key_swap);
+	free(morton->index);
+	free(morton->index_swap);
+	free(morton->first);
+	free(morton->histogram);
+	free(morton->level_count);
+	free(morton);
+}
+
+// make sure there is room for count vortons and node_pool_size nodes
+static struct fluid_morton* fluid_morton_reserve(struct fluid_morton *morton,
+	int count, uint32_t node_pool_size)
+{
+	if(morton && morton->capacity >= count && morton->node_capacity >= node_pool_size)
+		return morton;
+	fluid_morton_free(morton);
+
+	morton = malloc(sizeof(struct fluid_morton));
+	if(morton == NULL)
+	{
+		log_error("malloc(fluid_morton) %s", strerror(errno));
+		return NULL;
+	}
+	memset(morton, 0, sizeof(struct fluid_morton));
+	morton->capacity = count;
+	morton->node_capacity = node_pool_size;
+	morton->blocks = (count + FLUID_MORTON_BLOCK - 1) / FLUID_MORTON_BLOCK;
+	if(morton->blocks < 1)
+		morton->blocks = 1;
+	morton->key = malloc(count * sizeof(uint64_t));
+	morton->key_swap = malloc(count * sizeof(uint64_t));
+	morton->index = malloc(count * sizeof(uint32_t));
+	morton->index_swap = malloc(count * sizeof(uint32_t));
+	morton->first = malloc(node_pool_size * sizeof(uint32_t));
+	morton->histogram = malloc(morton->blocks * 256 * sizeof(uint32_t));
+	morton->level_count = malloc(morton->blocks * (FLUID_MORTON_MAX_DEPTH+1) * sizeof(uint32_t));
+	if(!morton->key || !morton->key_swap || !morton->index || !morton->index_swap
+	|| !morton->first || !morton->histogram || !morton->level_count)
+	{
+		log_error("malloc(fluid_morton) %s", strerror(errno));
+		fluid_morton_free(morton);
+		return NULL;
+	}
+	return morton;
+}
+
+// spread the bits of x out so there are two zeroes between each
+static uint64_t fluid_morton_spread(uint64_t x)
+{
+	x &= 0x1fffff;
+	x = (x | x << 32) & 0x1f00000000ffffull;
+	x = (x | x << 16) & 0x1f0000ff0000ffull;
+	x = (x | x << 8)  & 0x100f00f00f00f00full;
+	x = (x | x << 4)  & 0x10c30c30c30c30c3ull;
+	x = (x | x << 2)  & 0x1249249249249249ull;
+	return x;
+}
+
+// gather every third bit of x back together, undoing fluid_morton_spread()
+static uint32_t fluid_morton_compact(uint64_t x)
+{
+	x &= 0x1249249249249249ull;
+	x = (x | x >> 2)  & 0x10c30c30c30c30c3ull;
+	x = (x | x >> 4)  & 0x100f00f00f00f00full;
+	x = (x | x >> 8)  & 0x1f0000ff0000ffull;
+	x = (x | x >> 16) & 0x1f00000000ffffull;
+	x = (x | x >> 32) & 0x1fffff;
+	return (uint32_t)x;
+}
+
+// the key of leaf cell x, y, z
+uint64_t fluid_morton_encode(uint32_t x, uint32_t y, uint32_t z)
+{
+	return fluid_morton_spread(x)
+		| fluid_morton_spread(y) << 1
+		| fluid_morton_spread(z) << 2;
+}
+
+// the leaf cell of a key
+void fluid_morton_decode(uint64_t key, uint32_t *x, uint32_t *y, uint32_t *z)
+{
+	*x = fluid_morton_compact(key);
+	*y = fluid_morton_compact(key >> 1);
+	*z = fluid_morton_compact(key >> 2);
+}
+
+// the leaf cell along one axis, a position on a boundary belongs to the
+// lower cell, as it does in octtree_child_position()
+static uint64_t fluid_morton_cell(float position, float volume, int cells)
+{
+	int cell = (int)ceilf(position / volume * (float)cells) - 1;
+	if(cell < 0)
+		cell = 0;
+	if(cell >= cells)
+		cell = cells - 1;
+	return (uint64_t)cell;
+}
+
+// The Morton key of the leaf cell holding position, or the key past
+// every cell, 1 << (3*depth), if it is outside the volume
+uint64_t fluid_morton_key(struct octtree *octtree, int depth, vec3 position)
+{
+	vec3 rel_position = sub(position, octtree->origin);
+	vec3 volume = octtree->volume;
+	int cells = 1 << depth;
+	if(vec3_lessthan_vec3(rel_position, (vec3){{0,0,0}})
+	|| vec3_greaterthan_vec3(rel_position, volume))
+		return 1ull << (3*depth);
+	// child offsets are x + 2y + 4z, so x is the lowest bit
+	return fluid_morton_encode(fluid_morton_cell(rel_position.x, volume.x, cells),
+		fluid_morton_cell(rel_position.y, volume.y, cells),
+		fluid_morton_cell(rel_position.z, volume.z, cells));
+}
+
+// the leaf node of a key, or FLUID_MORTON_NONE if there isn't one
+uint32_t fluid_morton_leaf(struct fluid_sim *sim, uint64_t key)
+{
+	struct octtree *octtree = sim->octtree;
+	uint32_t here = 0;
+	for(int level=1; level<=sim->max_depth; level++)
+	{
+		int offset = (key >> (3*(sim->max_depth - level))) & 7;
+		here = octtree_node(octtree, here)->node[offset];
+		if(here == 0)
+			return FLUID_MORTON_NONE;
+	}
+	return here;
+}
+
+static void fluid_morton_keys(void *data, int start, int end, int thread)
+{
+	struct fluid_morton_job *job = data;
+	struct fluid_sim *sim = job->sim;
+	struct fluid_morton *morton = job->morton;
+	struct vorton_soa *vortons = &sim->vortons;
+
+	for(int i=start; i<end; i++)
+	{
+		vec3 position = (vec3){{vortons->px[i], vortons->py[i], vortons->pz[i]}};
+		morton->index[i] = i;
+		morton->key[i] = fluid_morton_key(sim->octtree, sim->max_depth, position);
+	}
+}
+
+static void fluid_morton_histogram(void *data, int start, int end, int thread)
+{
+	struct fluid_morton_job *job = data;
+	struct fluid_morton *morton = job->morton;
+	for(int b=start; b<end; b++)
+	{
+		uint32_t *histogram = &morton->histogram[b*256];
+		int last = nmin((b+1) * FLUID_MORTON_BLOCK, job->count);
+		memset(histogram, 0, 256 * sizeof(uint32_t));
+		for(int i=b*FLUID_MORTON_BLOCK; i<last; i++)
+			histogram[(morton->key[i] >> job->shift) & 0xff]++;
+	}
+}
+
+static void fluid_morton_scatter(void *data, int start, int end, int thread)
+{
+	struct fluid_morton_job *job = data;
+	struct fluid_morton *morton = job->morton;
+	for(int b=start; b<end; b++)
+	{
+		uint32_t *offset = &morton->histogram[b*256];
+		int last = nmin((b+1) * FLUID_MORTON_BLOCK, job->count);
+		for(int i=b*FLUID_MORTON_BLOCK; i<last; i++)
+		{
+			uint64_t key = morton->key[i];
+			uint32_t to = offset[(key >> job->shift) & 0xff]++;
+			morton->key_swap[to] = key;
+			morton->index_swap[to] = morton->index[i];
+		}
+	}
+}
+
+// stable least significant digit radix sort, of the keys and indices
+static void fluid_morton_sort(struct fluid_morton_job *job, int bits)
+{
+	struct fluid_morton *morton = job->morton;
+	int blocks = (job->count + FLUID_MORTON_BLOCK - 1) / FLUID_MORTON_BLOCK;
+	for(job->shift = 0; job->shift < bits; job->shift += 8)
+	{
+		thread_pool_run(job->sim->pool, blocks, 1, fluid_morton_histogram, job);
+
+		// turn the counts into where each block writes each digit
+		uint32_t total = 0;
+		for(int d=0; d<256; d++)
+		for(int b=0; b<blocks; b++)
+		{
+			uint32_t count = morton->histogram[b*256 + d];
+			morton->histogram[b*256 + d] = total;
+			total += count;
+		}
+
+		thread_pool_run(job->sim->pool, blocks, 1, fluid_morton_scatter, job);
+
+		uint64_t *key = morton->key;
+		morton->key = morton->key_swap;
+		morton->key_swap = key;
+		uint32_t *index = morton->index;
+		morton->index = morton->index_swap;
+		morton->index_swap = index;
+	}
+}
+
+// does vorton i start a new node, on the level with this shift
+static int fluid_morton_starts(uint64_t *key, int i, int shift)
+{
+	return i == 0 || (key[i] >> shift) != (key[i-1] >> shift);
+}
+
+// count the nodes that start in each block, on each level
+static void fluid_morton_count(void *data, int start, int end, int thread)
+{
+	struct fluid_morton_job *job = data;
+	struct fluid_morton *morton = job->morton;
+	int depth = job->sim->max_depth;
+	for(int b=start; b<end; b++)
+	{
+		uint32_t *count = &morton->level_count[b * (FLUID_MORTON_MAX_DEPTH+1)];
+		int last = nmin((b+1) * FLUID_MORTON_BLOCK, job->valid);
+		memset(count, 0, (depth+1) * sizeof(uint32_t));
+		for(int i=b*FLUID_MORTON_BLOCK; i<last; i++)
+		for(int level=0; level<=depth; level++)
+			count[level] += fluid_morton_starts(morton->key, i, 3*(depth-level));
+	}
+}
+
+// number each node, and link it to its parent
+static void fluid_morton_link(void *data, int start, int end, int thread)
+{
+	struct fluid_morton_job *job = data;
+	struct fluid_morton *morton = job->morton;
+	struct octtree *octtree = job->sim->octtree;
+	int depth = job->sim->max_depth;
+	for(int b=start; b<end; b++)
+	{
+		uint32_t *count = &morton->level_count[b * (FLUID_MORTON_MAX_DEPTH+1)];
+		uint32_t current[FLUID_MORTON_MAX_DEPTH+1];
+		int last = nmin((b+1) * FLUID_MORTON_BLOCK, job->valid);
+
+		// the block may start partway through a node
+		for(int level=0; level<=depth; level++)
+			current[level] = job->level_offset[level] + count[level] - 1;
+
+		for(int i=b*FLUID_MORTON_BLOCK; i<last; i++)
+		for(int level=0; level<=depth; level++)
+		{
+			int shift = 3*(depth-level);
+			if(!fluid_morton_starts(morton->key, i, shift))
+				continue;
+			uint32_t node = ++current[level];
+			morton->first[node] = i;
+			if(level > 0)
+			{
+				int offset = (morton->key[i] >> shift) & 7;
+				octtree_node(octtree, current[level-1])->node[offset] = node;
+			}
+		}
+	}
+}
+
+// sum the vortons beneath each node of one level
+static void fluid_morton_sum(void *data, int start, int end, int thread)
+{
+	struct fluid_morton_job *job = data;
+	struct fluid_morton *morton = job->morton;
+	struct fluid_sim *sim = job->sim;
+	struct vorton_soa *vortons = &sim->vortons;
+	struct vorton_soa *nodes = &sim->nodes;
+	struct octtree *octtree = sim->octtree;
+	int level = job->level;
+	uint32_t level_end = job->level_offset[level+1];
+
+	for(uint32_t n=job->level_offset[level]+start; n<job->level_offset[level]+end; n++)
+	{
+		uint32_t first = morton->first[n];
+		uint32_t last = (n+1 < level_end) ? morton->first[n+1] : (uint32_t)job->valid;
+		nodes->counts[n] = last - first;
+
+		// add the index of the vorton to the leaf array, for diffusion later
+		for(uint32_t i=0; i<8 && first+i<last; i++)
+			octtree_node(octtree, n)->leaf[i] = morton->index[first+i];
+
+		if(level == sim->max_depth)
+		{
+			for(uint32_t i=first; i<last; i++)
+			{
+				uint32_t j = morton->index[i];
+				if(job->refit)
+				{
+					job->refit->leaf[j] = n;
+					job->refit->key[j] = morton->key[i];
+				}
+				float magnitude = vortons->wx[j]*vortons->wx[j]
+					+ vortons->wy[j]*vortons->wy[j]
+					+ vortons->wz[j]*vortons->wz[j];
+				// position is weighted proportionally to the magnitude of the vorton
+				nodes->px[n] += vortons->px[j] * magnitude;
+				nodes->py[n] += vortons->py[j] * magnitude;
+				nodes->pz[n] += vortons->pz[j] * magnitude;
+				nodes->wx[n] += vortons->wx[j];
+				nodes->wy[n] += vortons->wy[j];
+				nodes->wz[n] += vortons->wz[j];
+				nodes->magnitude[n] += magnitude;
+			}
+			continue;
+		}
+
+		for(int c=0; c<8; c++)
+		{
+			uint32_t child = octtree_node(octtree, n)->node[c];
+			if(child == 0)
+				continue;
+			nodes->px[n] += nodes->px[child];
+			nodes->py[n] += nodes->py[child];
+			nodes->pz[n] += nodes->pz[child];
+			nodes->wx[n] += nodes->wx[child];
+			nodes->wy[n] += nodes->wy[child];
+			nodes->wz[n] += nodes->wz[child];
+			nodes->magnitude[n] += nodes->magnitude[child];
+		}
+	}
+}
+
+// Build the octtree and its aggregates from sorted Morton keys.
+// The octtree and nodes must already be empty. Returns 0 on success, or 1
+// if it could not be built this way, and nothing has been added.
+int fluid_morton_build(struct fluid_sim *sim)
+{
+	struct octtree *octtree = sim->octtree;
+	int depth = sim->max_depth;
+	int count = sim->vortons.count;
+	if(depth > FLUID_MORTON_MAX_DEPTH)
+		return 1;
+	if(count == 0)
+		return 0;
+
+	sim->morton = fluid_morton_reserve(sim->morton, sim->max_vortons, octtree->node_pool_size);
+	if(sim->morton == NULL)
+		return 1;
+	struct fluid_morton *morton = sim->morton;
+
+	struct fluid_morton_job job;
+	memset(&job, 0, sizeof(job));
+	job.sim = sim;
+	job.morton = morton;
+	job.count = count;
+	if(sim->tree_build == FLUID_TREE_REFIT)
+		job.refit = sim->refit;
+
+	thread_pool_run(sim->pool, count, FLUID_MORTON_BLOCK, fluid_morton_keys, &job);
+	fluid_morton_sort(&job, 3*depth + 1);
+
+	// the vortons outside the volume sort to the end
+	uint64_t outside = 1ull << (3*depth);
+	int low = 0, high = count;
+	while(low < high)
+	{
+		int middle = (low + high) / 2;
+		if(morton->key[middle] < outside)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	job.valid = low;
+
+	// refit reads the vortons every frame, so store them in key order,
+	// unless something is holding on to their indices
+	if(job.refit && !sim->keep_order && !vorton_soa_permute(&sim->vortons, &job.refit->sorted, morton->index))
+	{
+		for(int i=0; i<count; i++)
+			morton->index[i] = i;
+	}
+
+	if(job.valid < count)
+		log_warning("%d vortons are outside the Volume", count - job.valid);
+	if(job.valid == 0)
+		return 0;
+
+	// find how many nodes are on each level
+	int blocks = (job.valid + FLUID_MORTON_BLOCK - 1) / FLUID_MORTON_BLOCK;
+	thread_pool_run(sim->pool, blocks, 1, fluid_morton_count, &job);
+	uint32_t total = 0;
+	for(int level=0; level<=depth; level++)
+	{
+		job.level_offset[level] = total;
+		for(int b=0; b<blocks; b++)
+		{
+			uint32_t *level_count = &morton->level_count[b * (FLUID_MORTON_MAX_DEPTH+1)];
+			uint32_t c = level_count[level];
+			level_count[level] = total - job.level_offset[level];
+			total += c;
+		}
+	}
+	job.level_offset[depth+1] = total;
+	if(fluid_grow_nodes(sim, total))
+	{
+		log_warning("Attempted to add too many nodes");
+		return 1;
+	}
+	if(total > morton->node_capacity)
+	{
+		uint32_t *first = realloc(morton->first, total * sizeof(uint32_t));
+		if(first == NULL)
+		{
+			log_error("realloc(fluid_morton) %s", strerror(errno));
+			return 1;
+		}
+		morton->first = first;
+		morton->node_capacity = total;
+	}
+
+	thread_pool_run(sim->pool, blocks, 1, fluid_morton_link, &job);
+	octtree->node_count = total;
+	if(job.refit)
+		job.refit->leaf_start = job.level_offset[depth];
+
+	// sum from the leaves up
+	for(job.level = depth; job.level >= 0; job.level--)
+	{
+		int nodes = job.level_offset[job.level+1] - job.level_offset[job.level];
+		thread_pool_run(sim->pool, nodes, 256, fluid_morton_sum, &job);
+	}
+	return 0;
+}
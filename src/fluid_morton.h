@@ -0,0 +1,56 @@
+/*
+Copyright (c) 2020 Daniel Burke
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+#ifndef __DPB_FLUID_MORTON_H__
+#define __DPB_FLUID_MORTON_H__
+
+#include <stdint.h>
+#include "3dmaths.h"
+
+struct fluid_sim;
+struct octtree;
+
+// keys have 3 bits per level, plus one to mark vortons outside the volume
+#define FLUID_MORTON_MAX_DEPTH 21
+// no node for a key
+#define FLUID_MORTON_NONE UINT32_MAX
+
+struct fluid_morton {
+	int capacity;		// vortons
+	uint32_t node_capacity;
+	int blocks;		// vortons are split into blocks of FLUID_MORTON_BLOCK
+	uint64_t *key, *key_swap;
+	uint32_t *index, *index_swap;	// vorton, in key order
+	uint32_t *first;	// per node, its first vorton in key order
+	uint32_t *histogram;	// per block, 256 digit counts
+	uint32_t *level_count;	// per block, nodes started on each level
+};
+
+void fluid_morton_free(struct fluid_morton *morton);
+uint64_t fluid_morton_encode(uint32_t x, uint32_t y, uint32_t z);
+void fluid_morton_decode(uint64_t key, uint32_t *x, uint32_t *y, uint32_t *z);
+uint64_t fluid_morton_key(struct octtree *octtree, int depth, vec3 position);
+uint32_t fluid_morton_leaf(struct fluid_sim *sim, uint64_t key);
+int fluid_morton_build(struct fluid_sim *sim);
+
+#endif
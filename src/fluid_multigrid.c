@@ -0,0 +1,445 @@
+/*
+Copyright (c) 2020 Daniel Burke
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+// Geometric multigrid for -laplacian(u) = f on a box, for when the box
+// has walls, where an FFT would wrap round or leak out.
+// Each face holds u at zero, or its derivative across the face at zero,
+// which is a ghost point mirroring the one inside. Gauss-Seidel smooths
+// the error, red and black points in turn, as a red point only reads
+// black ones a colour can be done in parallel, and along a row in vectors
+// that work out every point and keep the colour being done. What it
+// leaves is smooth, so it is carried to a grid half as fine, solved
+// there the same way, and the correction brought back, a V-cycle.
+// The first solve starts on the coarsest grid and brings each solution
+// up as the guess for the next, full multigrid, and later solves start
+// from the last solution, which changes little from one step to the next.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FLUID_MULTIGRID_X86
+#include <immintrin.h>
+#endif
+
+#include "log.h"
+#include "fluid_multigrid.h"
+#include "thread_pool.h"
+
+// smoothing sweeps before and after each coarse correction, and on the
+// coarsest grid, where there are only a few points
+#define FLUID_MULTIGRID_SMOOTH 2
+#define FLUID_MULTIGRID_COARSE 32
+
+typedef void (*fluid_multigrid_row_fn)(float *u, const float *f, size_t dy, size_t dz,
+	int lo, int hi, int odd, const float *k);
+
+static void multigrid_row_scalar(float *u, const float *f, size_t dy, size_t dz,
+	int lo, int hi, int odd, const float *k);
+static fluid_multigrid_row_fn fluid_multigrid_row = multigrid_row_scalar;
+
+struct fluid_multigrid_job {
+	struct fluid_multigrid *mg;
+	struct fluid_multigrid_level *level;	// the one being worked on
+	struct fluid_multigrid_level *coarse;	// the next one down
+	float k[4];	// 1/h^2 along each axis, and 1/the diagonal
+	int colour;	// of the points being smoothed
+	int add;	// the correction adds to the solution, or replaces it
+	const float *from;	// restricted to coarse->f
+};
+
+// Gauss-Seidel on the points of one colour in a row, the ones with
+// x & 1 == odd, from lo to hi
+static void multigrid_row_scalar(float *u, const float *f, size_t dy, size_t dz,
+	int lo, int hi, int odd, const float *k)
+{
+	for(int x=lo + ((lo & 1) != odd); x<=hi; x+=2)
+	{
+		float sum = f[x] + (u[x-1] + u[x+1]) * k[0]
+			+ (u[x-dy] + u[x+dy]) * k[1]
+			+ (u[x-dz] + u[x+dz]) * k[2];
+		u[x] = sum * k[3];
+	}
+}
+
+#ifdef FLUID_MULTIGRID_X86
+
+// eight points at a time, only the colour being done is stored, as the
+// other is being read by the threads on the planes either side
+__attribute__((target("avx2,fma")))
+static void multigrid_row_avx2(float *u, const float *f, size_t dy, size_t dz,
+	int lo, int hi, int odd, const float *k)
+{
+	__m256 kx = _mm256_set1_ps(k[0]);
+	__m256 ky = _mm256_set1_ps(k[1]);
+	__m256 kz = _mm256_set1_ps(k[2]);
+	__m256 inverse = _mm256_set1_ps(k[3]);
+	// lanes are x, x+1, ..., and x keeps the same parity along the row
+	int even = (lo & 1) == odd;
+	__m256i keep = even ? _mm256_setr_epi32(-1, 0, -1, 0, -1, 0, -1, 0)
+		: _mm256_setr_epi32(0, -1, 0, -1, 0, -1, 0, -1);
+	int x = lo;
+	for(; x+8 <= hi+1; x+=8)
+	{
+		__m256 sum = _mm256_loadu_ps(f + x);
+		sum = _mm256_fmadd_ps(_mm256_add_ps(_mm256_loadu_ps(u + x - 1), _mm256_loadu_ps(u + x + 1)), kx, sum);
+		sum = _mm256_fmadd_ps(_mm256_add_ps(_mm256_loadu_ps(u + x - dy), _mm256_loadu_ps(u + x + dy)), ky, sum);
+		sum = _mm256_fmadd_ps(_mm256_add_ps(_mm256_loadu_ps(u + x - dz), _mm256_loadu_ps(u + x + dz)), kz, sum);
+		_mm256_maskstore_ps(u + x, keep, _mm256_mul_ps(sum, inverse));
+	}
+	if(x <= hi)
+		multigrid_row_scalar(u, f, dy, dz, x, hi, odd, k);
+}
+
+#endif
+
+static void fluid_multigrid_level_free(struct fluid_multigrid_level *level)
+{
+	free(level->u);
+	free(level->f);
+	free(level->r);
+}
+
+void fluid_multigrid_free(struct fluid_multigrid *mg)
+{
+	if(mg == NULL)
+		return;
+	for(int l=0; l<mg->levels; l++)
+		fluid_multigrid_level_free(&mg->level[l]);
+	free(mg);
+}
+
+// Make a solver for a box of cells along each axis, a power of two, with
+// what holds at each face, at least one should be zero for u to be
+// unique. returns NULL on failure
+struct fluid_multigrid* fluid_multigrid_init(int cells, const enum fluid_face face[6])
+{
+	if(cells < 2 || (cells & (cells - 1)) || cells > (1 << FLUID_MULTIGRID_LEVELS))
+	{
+		log_error("fluid_multigrid_init() %d cells is not a power of two", cells);
+		return NULL;
+	}
+	struct fluid_multigrid *mg = calloc(1, sizeof(struct fluid_multigrid));
+	if(mg == NULL)
+	{
+		log_error("calloc(fluid_multigrid) %s", strerror(errno));
+		return NULL;
+	}
+	memcpy(mg->face, face, sizeof(mg->face));
+
+	for(int n=cells; n>=2; n/=2)
+	{
+		struct fluid_multigrid_level *level = &mg->level[mg->levels++];
+		size_t m = n + 3;
+		level->cells = n;
+		level->dy = m;
+		level->dz = m * m;
+		level->origin = 1 + level->dy + level->dz;
+		for(int a=0; a<3; a++)
+		{
+			level->lo[a] = (face[2*a] == FLUID_FACE_DIRICHLET) ? 1 : 0;
+			level->hi[a] = (face[2*a+1] == FLUID_FACE_DIRICHLET) ? n - 1 : n;
+		}
+		level->u = calloc(m * m * m, sizeof(float));
+		level->f = calloc(m * m * m, sizeof(float));
+		level->r = calloc(m * m * m, sizeof(float));
+		if(!level->u || !level->f || !level->r)
+		{
+			log_error("calloc(fluid_multigrid) %s", strerror(errno));
+			fluid_multigrid_free(mg);
+			return NULL;
+		}
+	}
+
+#ifdef FLUID_MULTIGRID_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+		fluid_multigrid_row = multigrid_row_avx2;
+#endif
+	return mg;
+}
+
+// Set the ghost points beyond each face whose derivative is zero to the
+// point inside they mirror. Each axis covers the ghosts of the ones
+// before it, so the edges and corners are mirrored too
+static void fluid_multigrid_ghosts(struct fluid_multigrid *mg,
+	struct fluid_multigrid_level *level, float *array)
+{
+	int n = level->cells;
+	size_t stride[3] = {1, level->dy, level->dz};
+	float *o = array + level->origin;
+	for(int a=0; a<3; a++)
+	{
+		size_t s = stride[a];
+		size_t s1 = stride[(a+1) % 3], s2 = stride[(a+2) % 3];
+		for(int side=0; side<2; side++)
+		{
+			if(mg->face[2*a + side] != FLUID_FACE_NEUMANN)
+				continue;
+			long ghost = side ? n + 1 : -1;
+			long inside = side ? n - 1 : 1;
+			for(long j=-1; j<=n+1; j++)
+			for(long i=-1; i<=n+1; i++)
+			{
+				ptrdiff_t across = i * (ptrdiff_t)s1 + j * (ptrdiff_t)s2;
+				o[ghost * (ptrdiff_t)s + across] = o[inside * (ptrdiff_t)s + across];
+			}
+		}
+	}
+}
+
+// the spacing of a level, and the weights of its stencil
+static void fluid_multigrid_weights(struct fluid_multigrid_job *job, vec3 step, int l)
+{
+	float scale = (float)(1 << l);
+	float hx = step.x * scale, hy = step.y * scale, hz = step.z * scale;
+	job->k[0] = 1.0f / (hx * hx);
+	job->k[1] = 1.0f / (hy * hy);
+	job->k[2] = 1.0f / (hz * hz);
+	job->k[3] = 1.0f / (2.0f * (job->k[0] + job->k[1] + job->k[2]));
+}
+
+// one colour of some planes
+static void fluid_multigrid_smooth_planes(void *data, int start, int end, int thread)
+{
+	struct fluid_multigrid_job *job = data;
+	struct fluid_multigrid_level *level = job->level;
+	float *u = level->u + level->origin;
+	const float *f = level->f + level->origin;
+	for(int i=start; i<end; i++)
+	{
+		int z = level->lo[2] + i;
+		for(int y=level->lo[1]; y<=level->hi[1]; y++)
+		{
+			size_t row = y * level->dy + z * level->dz;
+			int odd = (job->colour + y + z) & 1;
+			fluid_multigrid_row(u + row, f + row, level->dy, level->dz,
+				level->lo[0], level->hi[0], odd, job->k);
+		}
+	}
+}
+
+static void fluid_multigrid_smooth(struct fluid_multigrid_job *job, struct thread_pool *pool, int sweeps)
+{
+	struct fluid_multigrid_level *level = job->level;
+	int planes = level->hi[2] - level->lo[2] + 1;
+	for(int s=0; s<sweeps; s++)
+	for(job->colour=0; job->colour<2; job->colour++)
+	{
+		fluid_multigrid_ghosts(job->mg, level, level->u);
+		thread_pool_run(pool, planes, 1, fluid_multigrid_smooth_planes, job);
+	}
+}
+
+// r = f + laplacian(u), on some planes
+static void fluid_multigrid_residual_planes(void *data, int start, int end, int thread)
+{
+	struct fluid_multigrid_job *job = data;
+	struct fluid_multigrid_level *level = job->level;
+	const float *u = level->u + level->origin;
+	const float *f = level->f + level->origin;
+	float *r = level->r + level->origin;
+	size_t dy = level->dy, dz = level->dz;
+	const float *k = job->k;
+	float diagonal = 1.0f / k[3];
+	for(int i=start; i<end; i++)
+	{
+		int z = level->lo[2] + i;
+		for(int y=level->lo[1]; y<=level->hi[1]; y++)
+		{
+			size_t row = y * dy + z * dz;
+			for(int x=level->lo[0]; x<=level->hi[0]; x++)
+			{
+				size_t p = row + x;
+				r[p] = f[p] - diagonal * u[p] + (u[p-1] + u[p+1]) * k[0]
+					+ (u[p-dy] + u[p+dy]) * k[1]
+					+ (u[p-dz] + u[p+dz]) * k[2];
+			}
+		}
+	}
+}
+
+static void fluid_multigrid_residual_level(struct fluid_multigrid_job *job, struct thread_pool *pool)
+{
+	struct fluid_multigrid_level *level = job->level;
+	fluid_multigrid_ghosts(job->mg, level, level->u);
+	thread_pool_run(pool, level->hi[2] - level->lo[2] + 1, 1, fluid_multigrid_residual_planes, job);
+	fluid_multigrid_ghosts(job->mg, level, level->r);
+}
+
+// full weighting of job->from onto some planes of the coarse level's f
+static void fluid_multigrid_restrict_planes(void *data, int start, int end, int thread)
+{
+	struct fluid_multigrid_job *job = data;
+	struct fluid_multigrid_level *level = job->level;
+	struct fluid_multigrid_level *coarse = job->coarse;
+	const float *from = job->from + level->origin;
+	float *to = coarse->f + coarse->origin;
+	size_t dy = level->dy, dz = level->dz;
+	static const float weight[3] = {0.25f, 0.5f, 0.25f};
+	for(int i=start; i<end; i++)
+	{
+		int z = coarse->lo[2] + i;
+		for(int y=coarse->lo[1]; y<=coarse->hi[1]; y++)
+		for(int x=coarse->lo[0]; x<=coarse->hi[0]; x++)
+		{
+			const float *centre = from + 2*x + 2*y * dy + 2*z * dz;
+			float sum = 0.0f;
+			for(int c=-1; c<=1; c++)
+			for(int b=-1; b<=1; b++)
+			{
+				const float *line = centre + b * (ptrdiff_t)dy + c * (ptrdiff_t)dz;
+				sum += weight[b+1] * weight[c+1]
+					* (0.25f * line[-1] + 0.5f * line[0] + 0.25f * line[1]);
+			}
+			to[x + y * coarse->dy + z * coarse->dz] = sum;
+		}
+	}
+}
+
+static void fluid_multigrid_restrict(struct fluid_multigrid_job *job, struct thread_pool *pool)
+{
+	struct fluid_multigrid_level *coarse = job->coarse;
+	thread_pool_run(pool, coarse->hi[2] - coarse->lo[2] + 1, 1, fluid_multigrid_restrict_planes, job);
+}
+
+// trilinear from the coarse level's u onto some planes of the level's u
+static void fluid_multigrid_prolong_planes(void *data, int start, int end, int thread)
+{
+	struct fluid_multigrid_job *job = data;
+	struct fluid_multigrid_level *level = job->level;
+	struct fluid_multigrid_level *coarse = job->coarse;
+	float *u = level->u + level->origin;
+	const float *from = coarse->u + coarse->origin;
+	size_t cy = coarse->dy, cz = coarse->dz;
+	for(int i=start; i<end; i++)
+	{
+		int z = level->lo[2] + i;
+		for(int y=level->lo[1]; y<=level->hi[1]; y++)
+		for(int x=level->lo[0]; x<=level->hi[0]; x++)
+		{
+			// half way points take both neighbours along that axis
+			const float *c = from + (x >> 1) + (y >> 1) * cy + (z >> 1) * cz;
+			size_t ox = x & 1, oy = (y & 1) * cy, oz = (z & 1) * cz;
+			float value = 0.125f * (c[0] + c[ox] + c[oy] + c[ox + oy]
+				+ c[oz] + c[ox + oz] + c[oy + oz] + c[ox + oy + oz]);
+			size_t p = x + y * level->dy + z * level->dz;
+			u[p] = job->add ? u[p] + value : value;
+		}
+	}
+}
+
+static void fluid_multigrid_prolong(struct fluid_multigrid_job *job, struct thread_pool *pool, int add)
+{
+	struct fluid_multigrid_level *level = job->level;
+	job->add = add;
+	thread_pool_run(pool, level->hi[2] - level->lo[2] + 1, 1, fluid_multigrid_prolong_planes, job);
+}
+
+// one V-cycle from level l down, improving its u
+static void fluid_multigrid_cycle(struct fluid_multigrid *mg, struct thread_pool *pool, vec3 step, int l)
+{
+	struct fluid_multigrid_job job;
+	memset(&job, 0, sizeof(job));
+	job.mg = mg;
+	job.level = &mg->level[l];
+	fluid_multigrid_weights(&job, step, l);
+	if(l == mg->levels - 1)
+	{
+		fluid_multigrid_smooth(&job, pool, FLUID_MULTIGRID_COARSE);
+		return;
+	}
+
+	fluid_multigrid_smooth(&job, pool, FLUID_MULTIGRID_SMOOTH);
+	fluid_multigrid_residual_level(&job, pool);
+	job.coarse = &mg->level[l+1];
+	job.from = job.level->r;
+	fluid_multigrid_restrict(&job, pool);
+	size_t m = job.coarse->cells + 3;
+	memset(job.coarse->u, 0, m * m * m * sizeof(float));
+	fluid_multigrid_cycle(mg, pool, step, l+1);
+	fluid_multigrid_prolong(&job, pool, 1);
+	fluid_multigrid_smooth(&job, pool, FLUID_MULTIGRID_SMOOTH);
+}
+
+// Solve for u on the finest level, given its f, with points step apart.
+// The first solve, or one after the step changes, is full multigrid and
+// then cycles-1 V-cycles, later ones are cycles V-cycles from the last u
+void fluid_multigrid_solve(struct fluid_multigrid *mg, struct thread_pool *pool, vec3 step, int cycles)
+{
+	if(!mg->warm || step.x != mg->step.x || step.y != mg->step.y || step.z != mg->step.z)
+	{
+		struct fluid_multigrid_job job;
+		memset(&job, 0, sizeof(job));
+		job.mg = mg;
+		// f on every level, and solve on the coarsest
+		for(int l=0; l<mg->levels-1; l++)
+		{
+			job.level = &mg->level[l];
+			job.coarse = &mg->level[l+1];
+			fluid_multigrid_ghosts(mg, job.level, job.level->f);
+			job.from = job.level->f;
+			fluid_multigrid_restrict(&job, pool);
+		}
+		struct fluid_multigrid_level *coarsest = &mg->level[mg->levels-1];
+		size_t m = coarsest->cells + 3;
+		memset(coarsest->u, 0, m * m * m * sizeof(float));
+		fluid_multigrid_cycle(mg, pool, step, mg->levels-1);
+		// each solution is the guess for the next level up
+		for(int l=mg->levels-2; l>=0; l--)
+		{
+			job.level = &mg->level[l];
+			job.coarse = &mg->level[l+1];
+			fluid_multigrid_prolong(&job, pool, 0);
+			fluid_multigrid_cycle(mg, pool, step, l);
+		}
+		cycles--;
+		mg->warm = 1;
+		mg->step = step;
+	}
+	for(int c=0; c<cycles; c++)
+		fluid_multigrid_cycle(mg, pool, step, 0);
+}
+
+// the largest residual on the finest level, over the largest f
+float fluid_multigrid_residual(struct fluid_multigrid *mg, struct thread_pool *pool, vec3 step)
+{
+	struct fluid_multigrid_job job;
+	memset(&job, 0, sizeof(job));
+	job.mg = mg;
+	job.level = &mg->level[0];
+	fluid_multigrid_weights(&job, step, 0);
+	fluid_multigrid_residual_level(&job, pool);
+	struct fluid_multigrid_level *level = job.level;
+	size_t m = level->cells + 3;
+	float largest = 0.0f, scale = 0.0f;
+	for(size_t i=0; i<m*m*m; i++)
+	{
+		largest = fmaxf(largest, fabsf(level->r[i]));
+		scale = fmaxf(scale, fabsf(level->f[i]));
+	}
+	return scale > 0.0f ? largest / scale : largest;
+}
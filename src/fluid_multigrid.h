@@ -0,0 +1,66 @@
+/*
+Copyright (c) 2020 Daniel Burke
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+#ifndef __DPB_FLUID_MULTIGRID_H__
+#define __DPB_FLUID_MULTIGRID_H__
+
+#include <stddef.h>
+#include "3dmaths.h"
+
+struct thread_pool;
+
+// coarsest is 2 cells, so this reaches 1024
+#define FLUID_MULTIGRID_LEVELS 10
+
+// what holds at a face of the box
+enum fluid_face {
+	FLUID_FACE_DIRICHLET,	// the solution is zero
+	FLUID_FACE_NEUMANN,	// its derivative across the face is zero
+};
+
+// one grid of the hierarchy, the points run from 0 to cells along each
+// axis with a ghost point beyond each face
+struct fluid_multigrid_level {
+	int cells;
+	int lo[3], hi[3];	// the points solved for, the rest stay zero
+	size_t dy, dz;		// between rows and planes
+	size_t origin;		// where point 0,0,0 is
+	float *u;		// the solution, or the correction on coarse levels
+	float *f;		// the right hand side
+	float *r;		// the residual
+};
+
+// -laplacian(u) = f on a box of points, by multigrid
+struct fluid_multigrid {
+	int levels;
+	enum fluid_face face[6];	// -x, +x, -y, +y, -z, +z
+	int warm;		// u holds the last solution, so start from it
+	vec3 step;		// of the finest level, when it was warm
+	struct fluid_multigrid_level level[FLUID_MULTIGRID_LEVELS];
+};
+
+struct fluid_multigrid* fluid_multigrid_init(int cells, const enum fluid_face face[6]);
+void fluid_multigrid_free(struct fluid_multigrid *mg);
+void fluid_multigrid_solve(struct fluid_multigrid *mg, struct thread_pool *pool, vec3 step, int cycles);
+float fluid_multigrid_residual(struct fluid_multigrid *mg, struct thread_pool *pool, vec3 step);
+
+#endif
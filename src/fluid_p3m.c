@@ -0,0 +1,309 @@
+/*
+Copyright (c) 2020 Daniel Burke
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+// Particle-particle particle-mesh velocity, a treecode's accuracy at
+// about a grid's cost for clumped vortons.
+// The law between vortons is split in two. The far part is the law of a
+// Gaussian blob some grid cells wide, smooth enough for vortex-in-cell to
+// get right on the grid, and at least a fifth as wide as the smoothing.
+// The near part is what is left, the sim's own kernel less the Gaussian,
+// which is gone a few deviations from each vorton, so it is summed
+// directly over the vortons in the octtree nodes around a point, nodes at
+// least that reach wide. The grid is filled once a step, and each point
+// adds its near part as it is asked for.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include "log.h"
+#include "fluid.h"
+#include "fluid_grid.h"
+#include "fluid_kernel.h"
+#include "fluid_vic.h"
+#include "fluid_p3m.h"
+#include "fluid_simd.h"
+#include "thread_pool.h"
+
+// marks a vorton outside the volume
+#define FLUID_P3M_NONE UINT32_MAX
+// vortons are bucketed in blocks of this many
+#define FLUID_P3M_BLOCK 4096
+// deviations from a vorton past which the near part is left out, the
+// Gaussian's law is within about 1e-5 of 1/r^3 there
+#define FLUID_P3M_REACH 5.0f
+
+struct fluid_p3m_job {
+	struct fluid_sim *sim;
+	struct fluid_p3m *p3m;
+};
+
+void fluid_p3m_free(struct fluid_p3m *p3m)
+{
+	if(p3m == NULL)
+		return;
+	free(p3m->cell);
+	free(p3m->order);
+	free(p3m->start);
+	vorton_soa_free(&p3m->near);
+	free(p3m);
+}
+
+static struct fluid_p3m* fluid_p3m_init(void)
+{
+	struct fluid_p3m *p3m = calloc(1, sizeof(struct fluid_p3m));
+	if(p3m == NULL)
+	{
+		log_error("calloc(fluid_p3m) %s", strerror(errno));
+		return NULL;
+	}
+	// one sample spare, so the last step before the reach has two
+	float reach2 = FLUID_P3M_REACH * FLUID_P3M_REACH;
+	p3m->table_scale = (FLUID_P3M_TABLE_SIZE - 2) / reach2;
+	for(int i=0; i<FLUID_P3M_TABLE_SIZE; i++)
+		p3m->table[i] = fluid_kernel_gaussian(i / p3m->table_scale);
+	return p3m;
+}
+
+// make sure there is room to bucket count vortons into nodes
+static int fluid_p3m_reserve(struct fluid_p3m *p3m, int count, size_t nodes)
+{
+	if(vorton_soa_reserve(&p3m->near, count))
+		return 1;
+	if(p3m->capacity < count)
+	{
+		free(p3m->cell);
+		free(p3m->order);
+		p3m->cell = malloc(count * sizeof(uint32_t));
+		p3m->order = malloc(count * sizeof(uint32_t));
+		if(!p3m->cell || !p3m->order)
+		{
+			log_error("malloc(fluid_p3m) %s", strerror(errno));
+			p3m->capacity = 0;
+			return 1;
+		}
+		p3m->capacity = count;
+	}
+	if(p3m->start_size < nodes + 2)
+	{
+		free(p3m->start);
+		p3m->start = malloc((nodes + 2) * sizeof(uint32_t));
+		if(p3m->start == NULL)
+		{
+			log_error("malloc(fluid_p3m) %s", strerror(errno));
+			p3m->start_size = 0;
+			return 1;
+		}
+		p3m->start_size = nodes + 2;
+	}
+	return 0;
+}
+
+// the node a point is in along one axis, clamped to the volume
+static inline int fluid_p3m_axis(struct fluid_p3m *p3m, float p, float origin, float inverse)
+{
+	int c = (int)((p - origin) * inverse);
+	return c < 0 ? 0 : (c >= p3m->cells ? p3m->cells - 1 : c);
+}
+
+// find the node of each vorton
+static void fluid_p3m_cell(void *data, int start, int end, int thread)
+{
+	struct fluid_p3m_job *job = data;
+	struct fluid_sim *sim = job->sim;
+	struct fluid_p3m *p3m = job->p3m;
+	struct vorton_soa *vortons = &sim->vortons;
+	struct fluid_grid *grid = sim->grid;
+	size_t cells = p3m->cells;
+
+	for(int i=start; i<end; i++)
+	{
+		vec3 position = (vec3){{vortons->px[i], vortons->py[i], vortons->pz[i]}};
+		if(!particle_inside_bound(position, grid->origin, grid->volume))
+		{
+			p3m->cell[i] = FLUID_P3M_NONE;
+			continue;
+		}
+		size_t x = fluid_p3m_axis(p3m, position.x, p3m->origin.x, p3m->inverse_cell.x);
+		size_t y = fluid_p3m_axis(p3m, position.y, p3m->origin.y, p3m->inverse_cell.y);
+		size_t z = fluid_p3m_axis(p3m, position.z, p3m->origin.z, p3m->inverse_cell.z);
+		p3m->cell[i] = x + cells * (y + cells * z);
+	}
+}
+
+// copy the vortons into node order
+static void fluid_p3m_gather(void *data, int start, int end, int thread)
+{
+	struct fluid_p3m_job *job = data;
+	struct vorton_soa *vortons = &job->sim->vortons;
+	struct vorton_soa *near = &job->p3m->near;
+	const uint32_t *order = job->p3m->order;
+
+	for(int n=start; n<end; n++)
+	{
+		uint32_t i = order[n];
+		near->px[n] = vortons->px[i];
+		near->py[n] = vortons->py[i];
+		near->pz[n] = vortons->pz[i];
+		near->wx[n] = vortons->wx[i];
+		near->wy[n] = vortons->wy[i];
+		near->wz[n] = vortons->wz[i];
+	}
+}
+
+// The deviation of the far part's Gaussian, sim->p3m_split grid cells.
+// The grid only has the point law, so where the sim's smoothing is wider
+// the Gaussian is widened until the near part reaches past the smoothing.
+static float fluid_p3m_split(struct fluid_sim *sim)
+{
+	vec3 volume = sim->octtree->volume;
+	float widest = nmax(volume.x, nmax(volume.y, volume.z));
+	float split = sim->p3m_split * widest / (float)sim->grid_cells;
+	return nmax(split, sqrtf(sim->smoothing->point2) / FLUID_P3M_REACH);
+}
+
+// Fill the grid with the far part, and bucket the vortons for the near
+// part. returns 0 on success
+int fluid_p3m_update(struct fluid_sim *sim)
+{
+	float split = fluid_p3m_split(sim);
+	if(!(split > 0.0f))
+	{
+		log_error("fluid_p3m_update() split of %g grid cells", sim->p3m_split);
+		return 1;
+	}
+	if(fluid_vic_update(sim, split))
+		return 1;
+	if(sim->p3m == NULL)
+	{
+		sim->p3m = fluid_p3m_init();
+		if(sim->p3m == NULL)
+			return 1;
+	}
+	struct fluid_p3m *p3m = sim->p3m;
+	struct fluid_grid *grid = sim->grid;
+	p3m->split = split;
+
+	// the finest nodes still as wide as the reach
+	float narrowest = nmin(grid->volume.x, nmin(grid->volume.y, grid->volume.z));
+	int depth = 0;
+	while(depth < sim->max_depth && narrowest / (float)(2 << depth) >= FLUID_P3M_REACH * split)
+		depth++;
+	p3m->depth = depth;
+	p3m->cells = 1 << depth;
+	p3m->origin = grid->origin;
+	p3m->inverse_cell = (vec3){{
+		p3m->cells / grid->volume.x,
+		p3m->cells / grid->volume.y,
+		p3m->cells / grid->volume.z }};
+
+	int count = sim->vortons.count;
+	size_t nodes = (size_t)p3m->cells * p3m->cells * p3m->cells;
+	if(fluid_p3m_reserve(p3m, count, nodes))
+		return 1;
+
+	struct fluid_p3m_job job;
+	job.sim = sim;
+	job.p3m = p3m;
+	thread_pool_run(sim->pool, count, FLUID_P3M_BLOCK, fluid_p3m_cell, &job);
+
+	// bucket the vortons by node, as fluid_vic_update() does by plane, and
+	// after filling, node n holds order[start[n]] up to order[start[n+1]]
+	uint32_t *start = p3m->start;
+	memset(start, 0, (nodes + 2) * sizeof(uint32_t));
+	for(int i=0; i<count; i++)
+		if(p3m->cell[i] != FLUID_P3M_NONE)
+			start[p3m->cell[i] + 2]++;
+	for(size_t n=0; n<nodes; n++)
+		start[n+2] += start[n+1];
+	for(int i=0; i<count; i++)
+		if(p3m->cell[i] != FLUID_P3M_NONE)
+			p3m->order[start[p3m->cell[i] + 1]++] = i;
+
+	p3m->near.count = start[nodes];
+	thread_pool_run(sim->pool, p3m->near.count, FLUID_P3M_BLOCK, fluid_p3m_gather, &job);
+	return 0;
+}
+
+// The velocity at a point, the far part sampled from the grid, and the
+// near part summed over the vortons within reach in the 27 nodes around
+// it, each row of 3 nodes along x being one run of vortons. The sim's
+// kernel is gathered for the direct kernel, and the Gaussian's law taken
+// away as it goes.
+vec3 fluid_p3m_velocity(struct fluid_sim *sim, vec3 position)
+{
+	struct fluid_p3m *p3m = sim->p3m;
+	vec3 velocity = fluid_grid_velocity(sim->grid, position);
+	if(!particle_inside_bound(position, sim->grid->origin, sim->grid->volume))
+		return velocity;
+
+	struct vorton_soa *near = &p3m->near;
+	int cells = p3m->cells;
+	int c[3] = {
+		fluid_p3m_axis(p3m, position.x, p3m->origin.x, p3m->inverse_cell.x),
+		fluid_p3m_axis(p3m, position.y, p3m->origin.y, p3m->inverse_cell.y),
+		fluid_p3m_axis(p3m, position.z, p3m->origin.z, p3m->inverse_cell.z) };
+	int x0 = c[0] > 0 ? c[0] - 1 : 0;
+	int x1 = c[0] < cells - 1 ? c[0] + 1 : cells - 1;
+	float inverse_split2 = 1.0f / (p3m->split * p3m->split);
+	float reach2 = FLUID_P3M_REACH * FLUID_P3M_REACH;
+
+	struct fluid_gather gather;
+	fluid_gather_init(&gather, sim->smoothing, NULL);
+	vec3 exact = (vec3){{0.0f, 0.0f, 0.0f}};
+	float fx = 0.0f, fy = 0.0f, fz = 0.0f;
+	for(int z=c[2]-1; z<=c[2]+1; z++)
+	for(int y=c[1]-1; y<=c[1]+1; y++)
+	{
+		if(y < 0 || z < 0 || y >= cells || z >= cells)
+			continue;
+		size_t row = (size_t)cells * (y + (size_t)cells * z);
+		uint32_t last = p3m->start[row + x1 + 1];
+		for(uint32_t i=p3m->start[row + x0]; i<last; i++)
+		{
+			float dx = position.x - near->px[i];
+			float dy = position.y - near->py[i];
+			float dz = position.z - near->pz[i];
+			float s = (dx*dx + dy*dy + dz*dz) * inverse_split2;
+			if(s >= reach2)
+				continue;
+			fluid_gather_add(&gather, near, i, position, &exact);
+			float t = s * p3m->table_scale;
+			int n = (int)t;
+			float law = p3m->table[n] + (p3m->table[n+1] - p3m->table[n]) * (t - (float)n);
+			float wx = near->wx[i], wy = near->wy[i], wz = near->wz[i];
+			fx += (wy * dz - wz * dy) * law;
+			fy += (wz * dx - wx * dz) * law;
+			fz += (wx * dy - wy * dx) * law;
+		}
+	}
+	fluid_gather_flush(&gather, position, &exact);
+
+	float far = sim->smoothing->scale * inverse_split2 / p3m->split;
+	velocity.x += exact.x - fx * far;
+	velocity.y += exact.y - fy * far;
+	velocity.z += exact.z - fz * far;
+	return velocity;
+}
@@ -0,0 +1,56 @@
+/*
+Copyright (c) 2020 Daniel Burke
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+#ifndef __DPB_FLUID_P3M_H__
+#define __DPB_FLUID_P3M_H__
+
+#include <stdint.h>
+#include "3dmaths.h"
+#include "fluid.h"
+
+// samples of the smoothed law the grid stands for
+#define FLUID_P3M_TABLE_SIZE 4096
+
+// Particle-particle particle-mesh, the vortons bucketed by the octtree
+// nodes at least the near field's reach wide, so every vorton within
+// reach of a point is in the 27 nodes around it
+struct fluid_p3m {
+	float split;		// deviation of the Gaussian the grid is smoothed by
+	int depth;		// of the nodes the vortons are bucketed by
+	int cells;		// nodes along each axis, 1 << depth
+	vec3 origin;
+	vec3 inverse_cell;	// nodes per unit length
+	int capacity;		// vortons
+	uint32_t *cell;		// per vorton, its node along x, then y, then z
+	uint32_t *order;	// vortons, bucketed by node
+	uint32_t *start;	// per node, where its vortons begin in order
+	size_t start_size;
+	struct vorton_soa near;	// the vortons, in node order
+	float table[FLUID_P3M_TABLE_SIZE];	// the Gaussian's law times split^3
+	float table_scale;	// table steps per unit of r^2 / split^2
+};
+
+void fluid_p3m_free(struct fluid_p3m *p3m);
+int fluid_p3m_update(struct fluid_sim *sim);
+vec3 fluid_p3m_velocity(struct fluid_sim *sim, vec3 position);
+
+#endif
@@ -0,0 +1,263 @@
+/*
+Copyright (c) 2020 Daniel Burke
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+// Incremental octtree maintenance.
+// Vortons move a little each frame, so most of them stay in the same leaf.
+// The octtree links are kept between frames, each vorton is added straight
+// to its leaf, and only the ones whose Morton key changed walk down the
+// tree. The aggregates are then summed from the leaves up. Nodes that empty
+// out are left in place, so once too many are stale the octtree is built
+// again from scratch.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "log.h"
+#include "fluid.h"
+#include "fluid_morton.h"
+#include "fluid_refit.h"
+
+void fluid_refit_free(struct fluid_refit *refit)
+{
+	if(refit == NULL)
+		return;
+	free(refit->leaf);
+	free(refit->key);
+	vorton_soa_free(&refit->sorted);
+	free(refit);
+}
+
+// make sure there is room for count vortons
+static struct fluid_refit* fluid_refit_reserve(struct fluid_refit *refit, int count)
+{
+	if(refit == NULL)
+	{
+		refit = malloc(sizeof(struct fluid_refit));
+		if(refit == NULL)
+		{
+			log_error("malloc(fluid_refit) %s", strerror(errno));
+			return NULL;
+		}
+		memset(refit, 0, sizeof(struct fluid_refit));
+	}
+	if(refit->capacity >= count)
+		return refit;
+
+	uint32_t *leaf = realloc(refit->leaf, count * sizeof(uint32_t));
+	if(leaf == NULL)
+		goto fail;
+	refit->leaf = leaf;
+	uint64_t *key = realloc(refit->key, count * sizeof(uint64_t));
+	if(key == NULL)
+		goto fail;
+	refit->key = key;
+	refit->capacity = count;
+	return refit;
+fail:
+	log_error("realloc(fluid_refit) %s", strerror(errno));
+	fluid_refit_free(refit);
+	return NULL;
+}
+
+static int vec3_same(vec3 a, vec3 b)
+{
+	return a.x == b.x && a.y == b.y && a.z == b.z;
+}
+
+// throw the octtree away and build it again, recording each vorton's leaf
+// returns 0 on success, or 1 with the octtree empty
+static int fluid_refit_build(struct fluid_sim *sim)
+{
+	struct fluid_refit *refit = sim->refit;
+	int count = sim->vortons.count;
+	uint64_t outside = 1ull << (3*sim->max_depth);
+
+	refit->valid = 0;
+	refit->leaf_start = UINT32_MAX;
+	octtree_empty(sim->octtree);
+	// fluid_morton_build() fills in the vortons inside the volume
+	for(int i=0; i<count; i++)
+	{
+		refit->leaf[i] = 0;
+		refit->key[i] = outside;
+	}
+	if(fluid_morton_build(sim))
+		return 1;
+
+	refit->valid = 1;
+	refit->count = count;
+	refit->depth = sim->max_depth;
+	refit->origin = sim->octtree->origin;
+	refit->volume = sim->octtree->volume;
+	refit->built_nodes = sim->octtree->node_count;
+	// an empty tree has no deepest level
+	if(refit->leaf_start > refit->built_nodes)
+		refit->leaf_start = refit->built_nodes;
+	refit->stale = 0;
+	refit->moved = count;
+	refit->rebuilds++;
+	return 0;
+}
+
+// find the leaf for key, adding any nodes missing on the way down
+// returns 0 if there was no room
+static uint32_t fluid_refit_leaf(struct fluid_sim *sim, uint64_t key)
+{
+	struct octtree *octtree = sim->octtree;
+	uint32_t here = 0;
+	for(int level=1; level<=sim->max_depth; level++)
+	{
+		int offset = (key >> (3*(sim->max_depth - level))) & 7;
+		uint32_t child = octtree_node(octtree, here)->node[offset];
+		if(child == 0)
+		{
+			if(fluid_grow_nodes(sim, octtree->node_count + 1))
+				return 0;
+			child = octtree_add_node(octtree);
+			octtree_node(octtree, here)->node[offset] = child;
+		}
+		here = child;
+	}
+	return here;
+}
+
+// sum each node from its children, returns how many nodes are empty
+// children are always numbered after their parent, by every build and by
+// fluid_refit_leaf(), so a sweep backwards finishes them first
+static uint32_t fluid_refit_sum(struct fluid_sim *sim)
+{
+	struct vorton_soa *nodes = &sim->nodes;
+	struct octtree *octtree = sim->octtree;
+	struct fluid_refit *refit = sim->refit;
+	uint32_t empty = 0;
+	for(uint32_t here = octtree->node_count; here-- > 0; )
+	{
+		if(here >= refit->leaf_start && here < refit->built_nodes)
+		{
+			empty += nodes->counts[here] == 0;
+			continue;
+		}
+		struct octtree_node *node = octtree_node(octtree, here);
+		for(int c=0; c<8; c++)
+		{
+			uint32_t child = node->node[c];
+			if(child == 0)
+				continue;
+			// keep the first 8 vortons beneath, as fluid_octtree_add_vorton() does
+			struct octtree_node *child_node = octtree_node(octtree, child);
+			for(int i=0; i<nodes->counts[child] && nodes->counts[here]+i < 8; i++)
+				node->leaf[nodes->counts[here]+i] = child_node->leaf[i];
+
+			nodes->px[here] += nodes->px[child];
+			nodes->py[here] += nodes->py[child];
+			nodes->pz[here] += nodes->pz[child];
+			nodes->wx[here] += nodes->wx[child];
+			nodes->wy[here] += nodes->wy[child];
+			nodes->wz[here] += nodes->wz[child];
+			nodes->magnitude[here] += nodes->magnitude[child];
+			nodes->counts[here] += nodes->counts[child];
+		}
+		empty += nodes->counts[here] == 0;
+	}
+	return empty;
+}
+
+// Fit the octtree to where the vortons are now, or build it again if it
+// has gone stale. The nodes must already be zero.
+// returns 0 on success, or 1 with the octtree empty
+int fluid_refit_update(struct fluid_sim *sim)
+{
+	struct octtree *octtree = sim->octtree;
+	struct vorton_soa *vortons = &sim->vortons;
+	struct vorton_soa *nodes = &sim->nodes;
+	int count = vortons->count;
+	uint64_t outside = 1ull << (3*sim->max_depth);
+
+	sim->refit = fluid_refit_reserve(sim->refit, vortons->capacity);
+	if(sim->refit == NULL)
+	{
+		octtree_empty(octtree);
+		return 1;
+	}
+	struct fluid_refit *refit = sim->refit;
+
+	// vortons added or removed, or a different grid, all need a new tree
+	if(!refit->valid || refit->count != count
+	|| refit->depth != sim->max_depth || sim->max_depth < 1
+	|| !vec3_same(refit->origin, octtree->origin)
+	|| !vec3_same(refit->volume, octtree->volume)
+	|| refit->stale > sim->refit_stale * octtree->node_count)
+		return fluid_refit_build(sim);
+
+	// the vortons are in key order from the last build, so this walks the
+	// leaves in turn
+	refit->moved = 0;
+	for(int i=0; i<count; i++)
+	{
+		vec3 position = (vec3){{vortons->px[i], vortons->py[i], vortons->pz[i]}};
+		uint64_t key = fluid_morton_key(octtree, sim->max_depth, position);
+		if(key != refit->key[i])
+		{
+			refit->moved++;
+			refit->key[i] = key;
+			refit->leaf[i] = 0;
+			if(key != outside)
+			{
+				refit->leaf[i] = fluid_refit_leaf(sim, key);
+				if(refit->leaf[i] == 0)
+				{
+					log_warning("Attempted to add too many nodes");
+					vorton_soa_zero(nodes, octtree->node_count);
+					octtree_empty(octtree);
+					refit->valid = 0;
+					return 1;
+				}
+			}
+		}
+
+		uint32_t n = refit->leaf[i];
+		if(n == 0)
+			continue;
+		float magnitude = vortons->wx[i]*vortons->wx[i]
+			+ vortons->wy[i]*vortons->wy[i]
+			+ vortons->wz[i]*vortons->wz[i];
+		// position is weighted proportionally to the magnitude of the vorton
+		nodes->px[n] += vortons->px[i] * magnitude;
+		nodes->py[n] += vortons->py[i] * magnitude;
+		nodes->pz[n] += vortons->pz[i] * magnitude;
+		nodes->wx[n] += vortons->wx[i];
+		nodes->wy[n] += vortons->wy[i];
+		nodes->wz[n] += vortons->wz[i];
+		nodes->magnitude[n] += magnitude;
+		if(nodes->counts[n] < 8)
+			octtree_node(octtree, n)->leaf[nodes->counts[n]] = i;
+		nodes->counts[n]++;
+	}
+
+	// empty nodes cost a visit, and new ones are out of build order
+	refit->stale = fluid_refit_sum(sim)
+		+ octtree->node_count - refit->built_nodes;
+	return 0;
+}
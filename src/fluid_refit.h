@@ -0,0 +1,51 @@
+/*
+Copyright (c) 2020 Daniel Burke
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+#ifndef __DPB_FLUID_REFIT_H__
+#define __DPB_FLUID_REFIT_H__
+
+#include <stdint.h>
+#include "3dmaths.h"
+#include "fluid.h"
+
+// keeps the octtree between frames, only moving vortons that change leaf
+struct fluid_refit {
+	int capacity;		// vortons
+	int count;		// vortons when the tree was last built
+	int valid;		// the leaves below match the octtree
+	int depth;		// of the octtree when it was built
+	vec3 origin, volume;	// of the octtree when it was built
+	uint32_t *leaf;		// per vorton, its leaf node, 0 if outside
+	uint64_t *key;		// per vorton, the Morton key of that leaf
+	uint32_t built_nodes;	// nodes in the last full build
+	uint32_t leaf_start;	// where its deepest level starts, those have no children
+	uint32_t stale;		// nodes that are empty, or added since
+	int moved;		// vortons that changed leaf in the last refit
+	struct vorton_soa sorted;	// room to put the vortons in key order
+	int rebuilds;		// full builds so far
+};
+
+void fluid_refit_free(struct fluid_refit *refit);
+int fluid_refit_update(struct fluid_sim *sim);
+
+#endif
@@ -0,0 +1,372 @@
+/*
+Copyright (c) 2020 Daniel Burke
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+// Direct summation of the velocity from every vorton, vectorised across
+// vortons. There is a sum for each smoothing kernel on each instruction
+// set, all from fluid_simd_kernel.h, and the widest the CPU supports is
+// picked at runtime.
+// The vector sums have no branches, 1/r comes from the hardware
+// reciprocal square root estimate with one Newton-Raphson step, which
+// takes it from 12 bits (14 for AVX-512) to nearly full precision, and
+// each law is a blend of its parts.
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FLUID_SIMD_X86
+#include <immintrin.h>
+#endif
+
+#include "log.h"
+#include "fluid.h"
+#include "fluid_kernel.h"
+#include "fluid_simd.h"
+
+typedef void (*fluid_direct_fn)(const struct fluid_smoothing *k, struct vorton_soa *soa,
+	vec3 position, float *out);
+typedef void (*fluid_gradient_fn)(const struct fluid_smoothing *k, struct vorton_soa *soa,
+	vec3 position, float *out, vec3 gradient[3]);
+
+static const fluid_direct_fn *fluid_direct_kernels;
+static const char *fluid_direct_kernel_name = "scalar";
+
+// plain C, the compiler may still vectorise it
+static inline float scalar_min(float a, float b) { return a < b ? a : b; }
+static inline float scalar_max(float a, float b) { return a > b ? a : b; }
+
+#define FLUID_SIMD_SUFFIX scalar
+#define FLUID_SIMD_TARGET
+#define VF float
+#define VM int
+#define VI int
+#define V_WIDTH 1
+#define V_SET1(a) (a)
+#define V_ZERO() 0.0f
+#define V_LOAD(p) (*(p))
+#define V_ADD(a, b) ((a) + (b))
+#define V_SUB(a, b) ((a) - (b))
+#define V_MUL(a, b) ((a) * (b))
+#define V_DIV(a, b) ((a) / (b))
+#define V_FMA(a, b, c) ((a) * (b) + (c))
+#define V_FNMA(a, b, c) ((c) - (a) * (b))
+#define V_MIN(a, b) scalar_min(a, b)
+#define V_MAX(a, b) scalar_max(a, b)
+#define V_LT(a, b) ((a) < (b))
+#define V_SELECT(m, a, b) ((m) ? (a) : (b))
+#define V_RSQRT(a) (1.0f / sqrtf(a))
+#define V_ROUND(a) ((int)lrintf(a))
+#define V_TRUNC(a) ((int)(a))
+#define V_TOFLOAT(a) ((float)(a))
+#define V_POW2(n) ldexpf(1.0f, n)
+#define V_GATHER(table, i) ((table)[i])
+#define V_REDUCE(a) (a)
+#include "fluid_simd_kernel.h"
+
+// The velocity and its gradient from every vorton, where gradient[a] is
+// the gradient of component a. The derivative of w x d along axis b is
+// w x e_b, and the law's is 2 d_b times its slope.
+static inline __attribute__((always_inline)) void gradient_body(enum fluid_kernel kernel,
+	const struct fluid_smoothing *k, struct vorton_soa *soa, vec3 position,
+	float *out, vec3 gradient[3])
+{
+	float u[3] = {0.0f, 0.0f, 0.0f};
+	float g[3][3] = {{0.0f}};
+	for(int i=0; i<soa->count; i++)
+	{
+		float dx = position.x - soa->px[i];
+		float dy = position.y - soa->py[i];
+		float dz = position.z - soa->pz[i];
+		float wx = soa->wx[i], wy = soa->wy[i], wz = soa->wz[i];
+		float law, slope;
+		law_scalar(kernel, k, dx*dx + dy*dy + dz*dz, &law, &slope);
+		float cx = wy * dz - wz * dy;
+		float cy = wz * dx - wx * dz;
+		float cz = wx * dy - wy * dx;
+		u[0] += cx * law;
+		u[1] += cy * law;
+		u[2] += cz * law;
+		slope *= 2.0f;
+		g[0][0] += (           slope*cx*dx);
+		g[0][1] += (-wz * law + slope*cx*dy);
+		g[0][2] += ( wy * law + slope*cx*dz);
+		g[1][0] += ( wz * law + slope*cy*dx);
+		g[1][1] += (           slope*cy*dy);
+		g[1][2] += (-wx * law + slope*cy*dz);
+		g[2][0] += (-wy * law + slope*cz*dx);
+		g[2][1] += ( wx * law + slope*cz*dy);
+		g[2][2] += (           slope*cz*dz);
+	}
+	for(int a=0; a<3; a++)
+	{
+		out[a] = u[a] * k->scale;
+		for(int b=0; b<3; b++)
+			gradient[a].f[b] += g[a][b] * k->scale;
+	}
+}
+
+#define FLUID_GRADIENT_KERNEL(name, kernel) \
+static void name(const struct fluid_smoothing *k, struct vorton_soa *soa, \
+	vec3 position, float *out, vec3 gradient[3]) \
+{ \
+	gradient_body(kernel, k, soa, position, out, gradient); \
+}
+
+FLUID_GRADIENT_KERNEL(gradient_core, FLUID_KERNEL_CORE)
+FLUID_GRADIENT_KERNEL(gradient_rosenhead, FLUID_KERNEL_ROSENHEAD)
+FLUID_GRADIENT_KERNEL(gradient_gaussian, FLUID_KERNEL_GAUSSIAN)
+FLUID_GRADIENT_KERNEL(gradient_algebraic, FLUID_KERNEL_ALGEBRAIC)
+FLUID_GRADIENT_KERNEL(gradient_table, FLUID_KERNEL_TABLE)
+#undef FLUID_GRADIENT_KERNEL
+
+static const fluid_gradient_fn gradient_kernels[FLUID_KERNEL_COUNT] = {
+	[FLUID_KERNEL_CORE] = gradient_core,
+	[FLUID_KERNEL_ROSENHEAD] = gradient_rosenhead,
+	[FLUID_KERNEL_GAUSSIAN] = gradient_gaussian,
+	[FLUID_KERNEL_ALGEBRAIC] = gradient_algebraic,
+	[FLUID_KERNEL_TABLE] = gradient_table,
+};
+
+#ifdef FLUID_SIMD_X86
+
+// 1/sqrt(a), the estimate refined by y = y (3 - a y^2) / 2
+__attribute__((target("sse2")))
+static inline __m128 rsqrt_sse2(__m128 a)
+{
+	__m128 y = _mm_rsqrt_ps(a);
+	return _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), y),
+		_mm_sub_ps(_mm_set1_ps(3.0f), _mm_mul_ps(a, _mm_mul_ps(y, y))));
+}
+
+// SSE2 has no gather, so go through memory
+__attribute__((target("sse2")))
+static inline __m128 gather_sse2(const float *table, __m128i i)
+{
+	int32_t index[4];
+	_mm_storeu_si128((__m128i*)index, i);
+	return _mm_set_ps(table[index[3]], table[index[2]], table[index[1]], table[index[0]]);
+}
+
+__attribute__((target("sse2")))
+static inline float reduce_sse2(__m128 a)
+{
+	float sum[4];
+	_mm_storeu_ps(sum, a);
+	return sum[0] + sum[1] + sum[2] + sum[3];
+}
+
+#define FLUID_SIMD_SUFFIX sse2
+#define FLUID_SIMD_TARGET __attribute__((target("sse2")))
+#define VF __m128
+#define VM __m128
+#define VI __m128i
+#define V_WIDTH 4
+#define V_SET1(a) _mm_set1_ps(a)
+#define V_ZERO() _mm_setzero_ps()
+#define V_LOAD(p) _mm_loadu_ps(p)
+#define V_ADD(a, b) _mm_add_ps(a, b)
+#define V_SUB(a, b) _mm_sub_ps(a, b)
+#define V_MUL(a, b) _mm_mul_ps(a, b)
+#define V_DIV(a, b) _mm_div_ps(a, b)
+#define V_FMA(a, b, c) _mm_add_ps(_mm_mul_ps(a, b), c)
+#define V_FNMA(a, b, c) _mm_sub_ps(c, _mm_mul_ps(a, b))
+#define V_MIN(a, b) _mm_min_ps(a, b)
+#define V_MAX(a, b) _mm_max_ps(a, b)
+#define V_LT(a, b) _mm_cmplt_ps(a, b)
+#define V_SELECT(m, a, b) _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b))
+#define V_RSQRT(a) rsqrt_sse2(a)
+#define V_ROUND(a) _mm_cvtps_epi32(a)
+#define V_TRUNC(a) _mm_cvttps_epi32(a)
+#define V_TOFLOAT(a) _mm_cvtepi32_ps(a)
+#define V_POW2(n) _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(n, _mm_set1_epi32(127)), 23))
+#define V_GATHER(table, i) gather_sse2(table, i)
+#define V_REDUCE(a) reduce_sse2(a)
+#include "fluid_simd_kernel.h"
+
+__attribute__((target("avx2,fma")))
+static inline __m256 rsqrt_avx2(__m256 a)
+{
+	__m256 y = _mm256_rsqrt_ps(a);
+	return _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(0.5f), y),
+		_mm256_fnmadd_ps(a, _mm256_mul_ps(y, y), _mm256_set1_ps(3.0f)));
+}
+
+__attribute__((target("avx2,fma")))
+static inline float reduce_avx2(__m256 a)
+{
+	float sum[8];
+	_mm256_storeu_ps(sum, a);
+	float total = 0.0f;
+	for(int k=0; k<8; k++)
+		total += sum[k];
+	return total;
+}
+
+#define FLUID_SIMD_SUFFIX avx2
+#define FLUID_SIMD_TARGET __attribute__((target("avx2,fma")))
+#define VF __m256
+#define VM __m256
+#define VI __m256i
+#define V_WIDTH 8
+#define V_SET1(a) _mm256_set1_ps(a)
+#define V_ZERO() _mm256_setzero_ps()
+#define V_LOAD(p) _mm256_loadu_ps(p)
+#define V_ADD(a, b) _mm256_add_ps(a, b)
+#define V_SUB(a, b) _mm256_sub_ps(a, b)
+#define V_MUL(a, b) _mm256_mul_ps(a, b)
+#define V_DIV(a, b) _mm256_div_ps(a, b)
+#define V_FMA(a, b, c) _mm256_fmadd_ps(a, b, c)
+#define V_FNMA(a, b, c) _mm256_fnmadd_ps(a, b, c)
+#define V_MIN(a, b) _mm256_min_ps(a, b)
+#define V_MAX(a, b) _mm256_max_ps(a, b)
+#define V_LT(a, b) _mm256_cmp_ps(a, b, _CMP_LT_OQ)
+#define V_SELECT(m, a, b) _mm256_blendv_ps(b, a, m)
+#define V_RSQRT(a) rsqrt_avx2(a)
+#define V_ROUND(a) _mm256_cvtps_epi32(a)
+#define V_TRUNC(a) _mm256_cvttps_epi32(a)
+#define V_TOFLOAT(a) _mm256_cvtepi32_ps(a)
+#define V_POW2(n) _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(n, _mm256_set1_epi32(127)), 23))
+#define V_GATHER(table, i) _mm256_i32gather_ps(table, i, 4)
+#define V_REDUCE(a) reduce_avx2(a)
+#include "fluid_simd_kernel.h"
+
+__attribute__((target("avx512f")))
+static inline __m512 rsqrt_avx512(__m512 a)
+{
+	__m512 y = _mm512_rsqrt14_ps(a);
+	return _mm512_mul_ps(_mm512_mul_ps(_mm512_set1_ps(0.5f), y),
+		_mm512_fnmadd_ps(a, _mm512_mul_ps(y, y), _mm512_set1_ps(3.0f)));
+}
+
+#define FLUID_SIMD_SUFFIX avx512
+#define FLUID_SIMD_TARGET __attribute__((target("avx512f")))
+#define VF __m512
+#define VM __mmask16
+#define VI __m512i
+#define V_WIDTH 16
+#define V_SET1(a) _mm512_set1_ps(a)
+#define V_ZERO() _mm512_setzero_ps()
+#define V_LOAD(p) _mm512_loadu_ps(p)
+#define V_ADD(a, b) _mm512_add_ps(a, b)
+#define V_SUB(a, b) _mm512_sub_ps(a, b)
+#define V_MUL(a, b) _mm512_mul_ps(a, b)
+#define V_DIV(a, b) _mm512_div_ps(a, b)
+#define V_FMA(a, b, c) _mm512_fmadd_ps(a, b, c)
+#define V_FNMA(a, b, c) _mm512_fnmadd_ps(a, b, c)
+#define V_MIN(a, b) _mm512_min_ps(a, b)
+#define V_MAX(a, b) _mm512_max_ps(a, b)
+#define V_LT(a, b) _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ)
+#define V_SELECT(m, a, b) _mm512_mask_blend_ps(m, b, a)
+#define V_RSQRT(a) rsqrt_avx512(a)
+#define V_ROUND(a) _mm512_cvtps_epi32(a)
+#define V_TRUNC(a) _mm512_cvttps_epi32(a)
+#define V_TOFLOAT(a) _mm512_cvtepi32_ps(a)
+#define V_POW2(n) _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_add_epi32(n, _mm512_set1_epi32(127)), 23))
+#define V_GATHER(table, i) _mm512_i32gather_ps(i, table, 4)
+#define V_REDUCE(a) _mm512_reduce_add_ps(a)
+#include "fluid_simd_kernel.h"
+
+#endif
+
+// pick the widest kernels this CPU can run
+void fluid_simd_init(void)
+{
+	fluid_direct_kernels = direct_kernels_scalar;
+#ifdef FLUID_SIMD_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx512f"))
+	{
+		fluid_direct_kernels = direct_kernels_avx512;
+		fluid_direct_kernel_name = "AVX-512";
+	}
+	else if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+	{
+		fluid_direct_kernels = direct_kernels_avx2;
+		fluid_direct_kernel_name = "AVX2";
+	}
+	else if(__builtin_cpu_supports("sse2"))
+	{
+		fluid_direct_kernels = direct_kernels_sse2;
+		fluid_direct_kernel_name = "SSE2";
+	}
+#endif
+}
+
+const char* fluid_simd_name(void)
+{
+	return fluid_direct_kernel_name;
+}
+
+// point a smoothing kernel at its sums, call after fluid_simd_init()
+void fluid_simd_kernel(struct fluid_smoothing *smoothing)
+{
+	if(fluid_direct_kernels == NULL)
+		fluid_simd_init();
+	smoothing->direct = fluid_direct_kernels[smoothing->kernel];
+	smoothing->scalar = direct_kernels_scalar[smoothing->kernel];
+	smoothing->gradient = gradient_kernels[smoothing->kernel];
+}
+
+// the velocity at a position, summed over every packed vorton
+vec3 fluid_direct_velocity(const struct fluid_smoothing *smoothing, struct vorton_soa *soa, vec3 position)
+{
+	vec3 result;
+	smoothing->direct(smoothing, soa, position, result.f);
+	return result;
+}
+
+// Sum what has been gathered into result, and the gradient if the gather
+// was started with one, then empty the gather. The rest of the last
+// vector is filled with zero vorticity at the origin.
+void fluid_gather_flush(struct fluid_gather *gather, vec3 position, vec3 *result)
+{
+	int count = gather->count;
+	if(count == 0)
+		return;
+	int padded = (count + FLUID_SOA_WIDTH - 1) & ~(FLUID_SOA_WIDTH - 1);
+	for(int n=count; n<padded; n++)
+	{
+		gather->px[n] = gather->py[n] = gather->pz[n] = 0.0f;
+		gather->wx[n] = gather->wy[n] = gather->wz[n] = 0.0f;
+	}
+
+	struct vorton_soa soa;
+	memset(&soa, 0, sizeof(soa));
+	soa.count = count;
+	soa.capacity = FLUID_GATHER_SIZE;
+	soa.px = gather->px;
+	soa.py = gather->py;
+	soa.pz = gather->pz;
+	soa.wx = gather->wx;
+	soa.wy = gather->wy;
+	soa.wz = gather->wz;
+	vec3 velocity;
+	const struct fluid_smoothing *smoothing = gather->smoothing;
+	if(gather->gradient)
+		smoothing->gradient(smoothing, &soa, position, velocity.f, gather->gradient);
+	else
+		smoothing->direct(smoothing, &soa, position, velocity.f);
+	*result = add(*result, velocity);
+	gather->count = 0;
+}
@@ -0,0 +1,79 @@
+/*
+Copyright (c) 2020 Daniel Burke
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+#ifndef __DPB_FLUID_SIMD_H__
+#define __DPB_FLUID_SIMD_H__
+
+#include "3dmaths.h"
+#include "fluid.h"
+
+// widest vector we have a kernel for, in floats
+#define FLUID_SOA_WIDTH 16
+// vortons a gather holds before it is summed, a whole number of vectors
+#define FLUID_GATHER_SIZE 64
+
+// Vortons met by one walk of the octtree, queued up so the direct kernel
+// can sum them a few vectors at a time instead of one at a time.
+struct fluid_gather {
+	int count;
+	const struct fluid_smoothing *smoothing;
+	vec3 *gradient;		// summed into as well, if not NULL
+	_Alignas(64) float px[FLUID_GATHER_SIZE];
+	_Alignas(64) float py[FLUID_GATHER_SIZE];
+	_Alignas(64) float pz[FLUID_GATHER_SIZE];
+	_Alignas(64) float wx[FLUID_GATHER_SIZE];
+	_Alignas(64) float wy[FLUID_GATHER_SIZE];
+	_Alignas(64) float wz[FLUID_GATHER_SIZE];
+};
+
+void fluid_simd_init(void);
+const char* fluid_simd_name(void);
+void fluid_simd_kernel(struct fluid_smoothing *smoothing);
+vec3 fluid_direct_velocity(const struct fluid_smoothing *smoothing, struct vorton_soa *soa, vec3 position);
+void fluid_gather_flush(struct fluid_gather *gather, vec3 position, vec3 *result);
+
+// start an empty gather, summed with a sim's kernel
+static inline void fluid_gather_init(struct fluid_gather *gather,
+	const struct fluid_smoothing *smoothing, vec3 *gradient)
+{
+	gather->count = 0;
+	gather->smoothing = smoothing;
+	gather->gradient = gradient;
+}
+
+// queue vorton i of soa, summing into result once the gather is full
+static inline void fluid_gather_add(struct fluid_gather *gather, struct vorton_soa *soa,
+	uint32_t i, vec3 position, vec3 *result)
+{
+	int n = gather->count++;
+	gather->px[n] = soa->px[i];
+	gather->py[n] = soa->py[i];
+	gather->pz[n] = soa->pz[i];
+	gather->wx[n] = soa->wx[i];
+	gather->wy[n] = soa->wy[i];
+	gather->wz[n] = soa->wz[i];
+	if(gather->count == FLUID_GATHER_SIZE)
+		fluid_gather_flush(gather, position, result);
+}
+
+#endif
@@ -0,0 +1,248 @@
+/*
+Copyright (c) 2020 Daniel Burke
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+// The vorton sum, written once for every instruction set. fluid_simd.c
+// includes this once per set, after defining FLUID_SIMD_SUFFIX, the
+// FLUID_SIMD_TARGET attribute, and V_ operations on VF, a vector of
+// V_WIDTH floats, VM, a mask of them, and VI, a vector of ints, which are
+// all undefined again at the end.
+// Every kernel gets its own copy of the sum with its law inlined, the
+// kernel is a constant in each copy so the switch on it disappears.
+
+#define FLUID_SIMD_CAT2(a, b) a##_##b
+#define FLUID_SIMD_CAT(a, b) FLUID_SIMD_CAT2(a, b)
+#define FLUID_SIMD_FN(name) FLUID_SIMD_CAT(name, FLUID_SIMD_SUFFIX)
+#define FLUID_SIMD_INLINE FLUID_SIMD_TARGET static inline __attribute__((always_inline))
+
+// e^x for x <= 0, Cephes' polynomial for e^r, where x = n ln 2 + r
+FLUID_SIMD_INLINE VF FLUID_SIMD_FN(exp)(VF x)
+{
+	x = V_MAX(x, V_SET1(-87.0f));
+	VI n = V_ROUND(V_MUL(x, V_SET1(1.44269504089f)));
+	VF nf = V_TOFLOAT(n);
+	x = V_FNMA(nf, V_SET1(0.693359375f), x);
+	x = V_FNMA(nf, V_SET1(-2.12194440e-4f), x);
+	VF p = V_SET1(1.9875691500e-4f);
+	p = V_FMA(p, x, V_SET1(1.3981999507e-3f));
+	p = V_FMA(p, x, V_SET1(8.3334519073e-3f));
+	p = V_FMA(p, x, V_SET1(4.1665795894e-2f));
+	p = V_FMA(p, x, V_SET1(1.6666665459e-1f));
+	p = V_FMA(p, x, V_SET1(5.0000001201e-1f));
+	p = V_FMA(p, V_MUL(x, x), V_ADD(x, V_SET1(1.0f)));
+	return V_MUL(p, V_POW2(n));
+}
+
+// The law at squared distance d2, and if slope is wanted its derivative
+// by d2. kernel is always a constant.
+FLUID_SIMD_INLINE void FLUID_SIMD_FN(law)(enum fluid_kernel kernel,
+	const struct fluid_smoothing *k, VF d2, VF *law, VF *slope)
+{
+	switch(kernel)
+	{
+	case FLUID_KERNEL_CORE:
+	{
+		// 1/(r R^2) inside the radius, 1/r^3 outside
+		d2 = V_ADD(d2, V_SET1(FLUID_KERNEL_EPSILON));
+		VF y = V_RSQRT(d2);
+		VF y2 = V_MUL(y, y);
+		VM near = V_LT(d2, V_SET1(k->rad2));
+		*law = V_MUL(y, V_SELECT(near, V_SET1(k->inv_rad2), y2));
+		if(slope)
+			*slope = V_MUL(V_MUL(*law, y2), V_SELECT(near, V_SET1(-0.5f), V_SET1(-1.5f)));
+		break;
+	}
+	case FLUID_KERNEL_ROSENHEAD:
+	{
+		// 1/(r^2 + R^2)^1.5
+		VF y = V_RSQRT(V_ADD(d2, V_SET1(k->rad2)));
+		VF y2 = V_MUL(y, y);
+		*law = V_MUL(y, y2);
+		if(slope)
+			*slope = V_MUL(V_MUL(*law, y2), V_SET1(-1.5f));
+		break;
+	}
+	case FLUID_KERNEL_ALGEBRAIC:
+	{
+		// (r^2 + 5/2 R^2) / (r^2 + R^2)^2.5
+		VF y = V_RSQRT(V_ADD(d2, V_SET1(k->rad2)));
+		VF y2 = V_MUL(y, y);
+		VF y5 = V_MUL(y, V_MUL(y2, y2));
+		VF b = V_ADD(d2, V_SET1(2.5f * k->rad2));
+		*law = V_MUL(b, y5);
+		if(slope)
+			*slope = V_MUL(y5, V_FNMA(V_MUL(V_SET1(2.5f), b), y2, V_SET1(1.0f)));
+		break;
+	}
+	case FLUID_KERNEL_GAUSSIAN:
+	{
+		// K(p)/r^3, with K(p) = erf(p/sqrt 2) - sqrt(2/pi) p e^(-p^2/2)
+		// and p = r/R. Near the vorton K/p^3 is its power series in
+		// s = p^2, further out erf is Abramowitz and Stegun's 7.1.26.
+		static const float series[15] = {
+			2.659615203e-01, -7.978845608e-02, 1.424793859e-02,
+			-1.846955002e-03, 1.888931252e-04, -1.598326444e-05,
+			1.154346876e-06, -7.275295438e-08, 4.068421791e-09,
+			-2.044973916e-10, 9.335750487e-12, -3.904041113e-13,
+			1.506188701e-14, -5.393513915e-16, 1.801980456e-17,
+		};
+		VF s = V_MUL(d2, V_SET1(k->inv_rad2));
+		VF g = V_SET1(series[14]);
+		for(int n=13; n>=0; n--)
+			g = V_FMA(g, s, V_SET1(series[n]));
+
+		VF y = V_RSQRT(V_MAX(d2, V_SET1(1e-30f)));
+		VF y2 = V_MUL(y, y);
+		VF p = V_MUL(V_MUL(d2, y), V_SET1(k->inv_radius));
+		VF e = FLUID_SIMD_FN(exp)(V_MUL(s, V_SET1(-0.5f)));
+		VF t = V_DIV(V_SET1(1.0f), V_FMA(p, V_SET1(0.3275911f * 0.70710678118f), V_SET1(1.0f)));
+		VF erfc = V_SET1(1.061405429f);
+		erfc = V_FMA(erfc, t, V_SET1(-1.453152027f));
+		erfc = V_FMA(erfc, t, V_SET1(1.421413741f));
+		erfc = V_FMA(erfc, t, V_SET1(-0.284496736f));
+		erfc = V_FMA(erfc, t, V_SET1(0.254829592f));
+		erfc = V_MUL(erfc, t);
+		VF pe = V_MUL(V_MUL(p, e), V_SET1(0.79788456080f));
+		VF K = V_FNMA(e, erfc, V_SUB(V_SET1(1.0f), pe));
+
+		VM near = V_LT(s, V_SET1(4.0f));
+		*law = V_SELECT(near, V_MUL(g, V_SET1(k->inv_rad3)), V_MUL(K, V_MUL(y, y2)));
+		if(slope)
+		{
+			VF gs = V_SET1(14.0f * series[14]);
+			for(int n=13; n>=1; n--)
+				gs = V_FMA(gs, s, V_SET1(n * series[n]));
+			VF far = V_FMA(V_MUL(pe, V_SET1(0.5f * k->inv_rad2)), V_MUL(y, y2),
+				V_MUL(V_MUL(*law, y2), V_SET1(-1.5f)));
+			*slope = V_SELECT(near, V_MUL(gs, V_SET1(k->inv_rad5)), far);
+		}
+		break;
+	}
+	case FLUID_KERNEL_TABLE:
+	{
+		// linear between samples, 1/r^3 past the end of the table
+		VF s = V_MUL(d2, V_SET1(k->inv_rad2));
+		VF u = V_MIN(V_MUL(s, V_SET1(k->table_scale)), V_SET1(k->table_size - 1));
+		VI i = V_TRUNC(V_MIN(u, V_SET1(k->table_size - 2)));
+		VF f = V_SUB(u, V_TOFLOAT(i));
+		VF t0 = V_GATHER(k->table, i);
+		VF t1 = V_GATHER(k->table + 1, i);
+		VF y = V_RSQRT(V_MAX(d2, V_SET1(1e-30f)));
+		VF y2 = V_MUL(y, y);
+		VM near = V_LT(s, V_SET1(k->reach2));
+		*law = V_SELECT(near, V_MUL(V_FMA(f, V_SUB(t1, t0), t0), V_SET1(k->inv_rad3)),
+			V_MUL(y, y2));
+		if(slope)
+			*slope = V_SELECT(near, V_MUL(V_SUB(t1, t0), V_SET1(k->table_scale * k->inv_rad5)),
+				V_MUL(V_MUL(*law, y2), V_SET1(-1.5f)));
+		break;
+	}
+	}
+}
+
+// the velocity at a position from every vorton in soa, the arrays are
+// padded with zero vorticity, so run off the end
+FLUID_SIMD_INLINE void FLUID_SIMD_FN(direct)(enum fluid_kernel kernel,
+	const struct fluid_smoothing *k, struct vorton_soa *soa, vec3 position, float *out)
+{
+	VF x = V_SET1(position.x);
+	VF y = V_SET1(position.y);
+	VF z = V_SET1(position.z);
+	VF ux = V_ZERO();
+	VF uy = V_ZERO();
+	VF uz = V_ZERO();
+
+	for(int i=0; i<soa->count; i+=V_WIDTH)
+	{
+		VF dx = V_SUB(x, V_LOAD(soa->px + i));
+		VF dy = V_SUB(y, V_LOAD(soa->py + i));
+		VF dz = V_SUB(z, V_LOAD(soa->pz + i));
+		VF law;
+		FLUID_SIMD_FN(law)(kernel, k, V_FMA(dx, dx, V_FMA(dy, dy, V_MUL(dz, dz))), &law, NULL);
+		dx = V_MUL(dx, law);
+		dy = V_MUL(dy, law);
+		dz = V_MUL(dz, law);
+		VF wx = V_LOAD(soa->wx + i);
+		VF wy = V_LOAD(soa->wy + i);
+		VF wz = V_LOAD(soa->wz + i);
+		ux = V_ADD(ux, V_FNMA(wz, dy, V_MUL(wy, dz)));
+		uy = V_ADD(uy, V_FNMA(wx, dz, V_MUL(wz, dx)));
+		uz = V_ADD(uz, V_FNMA(wy, dx, V_MUL(wx, dy)));
+	}
+
+	out[0] = V_REDUCE(ux) * k->scale;
+	out[1] = V_REDUCE(uy) * k->scale;
+	out[2] = V_REDUCE(uz) * k->scale;
+}
+
+#define FLUID_SIMD_KERNEL(name, kernel) \
+FLUID_SIMD_TARGET static void FLUID_SIMD_FN(name)(const struct fluid_smoothing *k, \
+	struct vorton_soa *soa, vec3 position, float *out) \
+{ \
+	FLUID_SIMD_FN(direct)(kernel, k, soa, position, out); \
+}
+
+FLUID_SIMD_KERNEL(direct_core, FLUID_KERNEL_CORE)
+FLUID_SIMD_KERNEL(direct_rosenhead, FLUID_KERNEL_ROSENHEAD)
+FLUID_SIMD_KERNEL(direct_gaussian, FLUID_KERNEL_GAUSSIAN)
+FLUID_SIMD_KERNEL(direct_algebraic, FLUID_KERNEL_ALGEBRAIC)
+FLUID_SIMD_KERNEL(direct_table, FLUID_KERNEL_TABLE)
+
+static const fluid_direct_fn FLUID_SIMD_FN(direct_kernels)[FLUID_KERNEL_COUNT] = {
+	[FLUID_KERNEL_CORE] = FLUID_SIMD_FN(direct_core),
+	[FLUID_KERNEL_ROSENHEAD] = FLUID_SIMD_FN(direct_rosenhead),
+	[FLUID_KERNEL_GAUSSIAN] = FLUID_SIMD_FN(direct_gaussian),
+	[FLUID_KERNEL_ALGEBRAIC] = FLUID_SIMD_FN(direct_algebraic),
+	[FLUID_KERNEL_TABLE] = FLUID_SIMD_FN(direct_table),
+};
+
+#undef FLUID_SIMD_KERNEL
+#undef FLUID_SIMD_INLINE
+#undef FLUID_SIMD_FN
+#undef FLUID_SIMD_CAT
+#undef FLUID_SIMD_CAT2
+#undef FLUID_SIMD_SUFFIX
+#undef FLUID_SIMD_TARGET
+#undef VF
+#undef VM
+#undef VI
+#undef V_WIDTH
+#undef V_SET1
+#undef V_ZERO
+#undef V_LOAD
+#undef V_ADD
+#undef V_SUB
+#undef V_MUL
+#undef V_DIV
+#undef V_FMA
+#undef V_FNMA
+#undef V_MIN
+#undef V_MAX
+#undef V_LT
+#undef V_SELECT
+#undef V_RSQRT
+#undef V_ROUND
+#undef V_TRUNC
+#undef V_TOFLOAT
+#undef V_POW2
+#undef V_GATHER
+#undef V_REDUCE
@@ -0,0 +1,187 @@
+/*
+Copyright (c) 2020 Daniel Burke
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+// Vortex stretching and tilting, dw/dt = (w . grad) u.
+// The velocity gradient at each vorton comes analytically from the same
+// octtree traversal that finds its velocity, so there is no finite
+// difference stencil and one pass gives both. The velocity is kept in the
+// vortons for advection, found again by sim->velocity_mode when that is not
+// the treecode, so every stage of the integrator sees the same field.
+// Every vorton reads the others, so the results are held aside and written
+// back once all of them are known.
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "log.h"
+#include "fluid.h"
+#include "fluid_stretch.h"
+#include "fluid_batch.h"
+#include "thread_pool.h"
+
+// vortons are shared out in chunks of this many
+#define FLUID_STRETCH_CHUNK 64
+
+struct fluid_stretch_job {
+	struct fluid_sim *sim;
+	struct fluid_stretch *stretch;
+	float deltatime;
+	vec3 *query, *result;	// the velocity by sim->velocity_mode, or NULL
+};
+
+void fluid_stretch_free(struct fluid_stretch *stretch)
+{
+	if(stretch == NULL)
+		return;
+	free(stretch->dwx);
+	free(stretch->dwy);
+	free(stretch->dwz);
+	free(stretch->vx);
+	free(stretch->vy);
+	free(stretch->vz);
+	free(stretch);
+}
+
+// make sure there is room for count vortons
+static struct fluid_stretch* fluid_stretch_reserve(struct fluid_stretch *stretch, int count)
+{
+	if(stretch && stretch->capacity >= count)
+		return stretch;
+	fluid_stretch_free(stretch);
+
+	stretch = malloc(sizeof(struct fluid_stretch));
+	if(stretch == NULL)
+	{
+		log_error("malloc(fluid_stretch) %s", strerror(errno));
+		return NULL;
+	}
+	memset(stretch, 0, sizeof(struct fluid_stretch));
+	stretch->capacity = count;
+	stretch->dwx = malloc(count * sizeof(float));
+	stretch->dwy = malloc(count * sizeof(float));
+	stretch->dwz = malloc(count * sizeof(float));
+	stretch->vx = malloc(count * sizeof(float));
+	stretch->vy = malloc(count * sizeof(float));
+	stretch->vz = malloc(count * sizeof(float));
+	if(!stretch->dwx || !stretch->dwy || !stretch->dwz
+	|| !stretch->vx || !stretch->vy || !stretch->vz)
+	{
+		log_error("malloc(fluid_stretch) %s", strerror(errno));
+		fluid_stretch_free(stretch);
+		return NULL;
+	}
+	return stretch;
+}
+
+// find the velocity and its gradient at each vorton, and from the gradient
+// how much the vorton stretches and tilts
+static void fluid_stretch_gradient(void *data, int start, int end, int thread)
+{
+	struct fluid_stretch_job *job = data;
+	struct fluid_stretch *stretch = job->stretch;
+	struct vorton_soa *vortons = &job->sim->vortons;
+
+	for(int i=start; i<end; i++)
+	{
+		vec3 position = {{vortons->px[i], vortons->py[i], vortons->pz[i]}};
+		vec3 gradient[3];
+		vec3 velocity = fluid_tree_velocity_gradient(job->sim, position, gradient);
+		stretch->vx[i] = velocity.x;
+		stretch->vy[i] = velocity.y;
+		stretch->vz[i] = velocity.z;
+		if(job->query)
+			job->query[i] = position;
+
+		float wx = vortons->wx[i];
+		float wy = vortons->wy[i];
+		float wz = vortons->wz[i];
+		stretch->dwx[i] = (gradient[0].x*wx + gradient[0].y*wy + gradient[0].z*wz) * job->deltatime;
+		stretch->dwy[i] = (gradient[1].x*wx + gradient[1].y*wy + gradient[1].z*wz) * job->deltatime;
+		stretch->dwz[i] = (gradient[2].x*wx + gradient[2].y*wy + gradient[2].z*wz) * job->deltatime;
+	}
+}
+
+// add the change and keep the velocity, once every vorton has its own
+static void fluid_stretch_apply(void *data, int start, int end, int thread)
+{
+	struct fluid_stretch_job *job = data;
+	struct fluid_stretch *stretch = job->stretch;
+	struct vorton_soa *vortons = &job->sim->vortons;
+
+	for(int i=start; i<end; i++)
+	{
+		if(job->result)
+		{
+			vortons->vx[i] = job->result[i].x;
+			vortons->vy[i] = job->result[i].y;
+			vortons->vz[i] = job->result[i].z;
+		}
+		else
+		{
+			vortons->vx[i] = stretch->vx[i];
+			vortons->vy[i] = stretch->vy[i];
+			vortons->vz[i] = stretch->vz[i];
+		}
+		vortons->wx[i] += stretch->dwx[i];
+		vortons->wy[i] += stretch->dwy[i];
+		vortons->wz[i] += stretch->dwz[i];
+	}
+}
+
+// Stretch and tilt every vorton by the velocity gradient where it is, the
+// octtree must be up to date. returns 0 on success, or 1 if the velocity
+// kept is the treecode's in another mode
+int fluid_stretch_tilt(struct fluid_sim *sim, float deltatime)
+{
+	int count = sim->vortons.count;
+	if(count == 0)
+		return 0;
+
+	sim->stretch = fluid_stretch_reserve(sim->stretch, sim->vortons.capacity);
+	if(sim->stretch == NULL)
+		return 1;
+
+	struct fluid_stretch_job job;
+	job.sim = sim;
+	job.stretch = sim->stretch;
+	job.deltatime = deltatime;
+	job.query = job.result = NULL;
+	// the gradient is always the treecode's
+	int failed = 0;
+	if(sim->velocity_mode != FLUID_VELOCITY_TREE)
+	{
+		failed = fluid_batch_room(sim, count);
+		if(!failed)
+		{
+			job.query = sim->batch->query;
+			job.result = sim->batch->result;
+		}
+	}
+
+	thread_pool_run(sim->pool, count, FLUID_STRETCH_CHUNK, fluid_stretch_gradient, &job);
+	if(job.query)
+		fluid_velocity_batch(sim, job.query, count, job.result);
+	thread_pool_run(sim->pool, count, FLUID_STRETCH_CHUNK, fluid_stretch_apply, &job);
+	return failed;
+}
@@ -0,0 +1,39 @@
+/*
+Copyright (c) 2020 Daniel Burke
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+#ifndef __DPB_FLUID_STRETCH_H__
+#define __DPB_FLUID_STRETCH_H__
+
+struct fluid_sim;
+
+// per vorton results, held until every vorton has them
+struct fluid_stretch {
+	int capacity;		// vortons
+	float *dwx, *dwy, *dwz;	// the change in vorticity
+	float *vx, *vy, *vz;	// velocity
+};
+
+void fluid_stretch_free(struct fluid_stretch *stretch);
+int fluid_stretch_tilt(struct fluid_sim *sim, float deltatime);
+
+#endif
@@ -0,0 +1,633 @@
+/*
+Copyright (c) 2020 Daniel Burke
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+// Vortex-in-cell, velocity from a grid instead of between vortons.
+// Each vorton's vorticity is spread over the 8 points of its cell on the
+// velocity grid. The stream function is the vorticity convolved with
+// 1/(4 pi r), so the Poisson equation is solved in the open, with nothing
+// wrapping round, by doing the convolution with FFTs over a grid twice as
+// wide and zero beyond the volume. Velocity is the curl of the stream
+// function, by differences between grid points, and is sampled from the
+// grid as FLUID_VELOCITY_GRID does. The cost grows with the grid, not
+// with the number of vortons, beyond spreading them.
+// The smoothing is about one grid cell, the sim's kernel is not used.
+// With FLUID_BOUNDARY_WALLS the faces of the volume are walls instead,
+// each component of the stream function is solved for by multigrid, held
+// at zero on the faces along it and flat across the faces normal to it,
+// so the velocity across every face is zero.
+// For FLUID_VELOCITY_P3M the vorticity is smoothed by a Gaussian wider
+// than a cell before the convolution, so the grid only has the far field,
+// which it can resolve, and fluid_p3m.c adds the rest between vortons.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+
+#include "log.h"
+#include "fluid.h"
+#include "fluid_grid.h"
+#include "fluid_kernel.h"
+#include "fluid_multigrid.h"
+#include "fluid_vic.h"
+#include "thread_pool.h"
+
+// marks a vorton outside the volume
+#define FLUID_VIC_NONE UINT32_MAX
+// vortons are bucketed in blocks of this many, and lines transformed
+#define FLUID_VIC_BLOCK 4096
+#define FLUID_VIC_LINES 32
+// neighbouring lines transformed side by side, so each point read along
+// a line brings in a whole cache line, and the butterflies vectorise
+#define FLUID_VIC_WIDTH 8
+// points of the curl in chunks of this many
+#define FLUID_VIC_CHUNK 256
+// the mean of 1/r over a unit cube from its centre, for the self term
+#define FLUID_VIC_SELF 2.3800772f
+// for the smoothed 1/r of a split
+#define FLUID_VIC_ROOT_HALF 0.70710678f
+#define FLUID_VIC_ROOT_2_OVER_PI 0.79788456f
+
+struct fluid_vic_job {
+	struct fluid_sim *sim;
+	struct fluid_vic *vic;
+	int parity;		// of the planes to spread, so no two share a point
+	// where the vorticity is spread and the stream function is read,
+	// point 0,0,0 of each component, with points element floats apart
+	float *field[3];
+	size_t element, dy, dz;
+	float factor;		// for the vorticity as it is spread
+	// one pass of transforms
+	float *data[2];
+	int arrays;
+	int axis;
+	int inverse;
+	int convolve;		// multiply by green and transform back
+	int across;		// lines along the first axis not the pass
+};
+
+void fluid_vic_free(struct fluid_vic *vic)
+{
+	if(vic == NULL)
+		return;
+	free(vic->a);
+	free(vic->b);
+	free(vic->green);
+	free(vic->twiddle);
+	free(vic->reverse);
+	free(vic->line);
+	free(vic->plane);
+	free(vic->order);
+	free(vic->start);
+	for(int c=0; c<3; c++)
+		fluid_multigrid_free(vic->mg[c]);
+	free(vic);
+}
+
+static struct fluid_vic* fluid_vic_init(int cells, int threads, enum fluid_boundary boundary)
+{
+	if(cells < 2 || (cells & (cells - 1)))
+	{
+		log_error("fluid_vic_init() %d cells is not a power of two", cells);
+		return NULL;
+	}
+	struct fluid_vic *vic = calloc(1, sizeof(struct fluid_vic));
+	if(vic == NULL)
+	{
+		log_error("calloc(fluid_vic) %s", strerror(errno));
+		return NULL;
+	}
+	vic->cells = cells;
+	vic->size = cells * 2;
+	vic->threads = threads;
+	vic->boundary = boundary;
+	vic->start = malloc((cells + 2) * sizeof(uint32_t));
+	if(vic->start == NULL)
+	{
+		log_error("malloc(fluid_vic) %s", strerror(errno));
+		fluid_vic_free(vic);
+		return NULL;
+	}
+
+	if(boundary == FLUID_BOUNDARY_WALLS)
+	{
+		// a wall is a stream surface, so the components along it are zero
+		// there, and the one normal to it does not change across it
+		for(int c=0; c<3; c++)
+		{
+			enum fluid_face face[6];
+			for(int f=0; f<6; f++)
+				face[f] = (f / 2 == c) ? FLUID_FACE_NEUMANN : FLUID_FACE_DIRICHLET;
+			vic->mg[c] = fluid_multigrid_init(cells, face);
+			if(vic->mg[c] == NULL)
+			{
+				fluid_vic_free(vic);
+				return NULL;
+			}
+		}
+		return vic;
+	}
+
+	int size = vic->size;
+	size_t points = (size_t)size * size * size;
+	vic->a = malloc(points * 2 * sizeof(float));
+	vic->b = malloc(points * 2 * sizeof(float));
+	vic->green = malloc(points * sizeof(float));
+	vic->twiddle = malloc(size * sizeof(float));
+	vic->reverse = malloc(size * sizeof(uint32_t));
+	vic->line = malloc((size_t)threads * size * 2 * FLUID_VIC_WIDTH * sizeof(float));
+	if(!vic->a || !vic->b || !vic->green || !vic->twiddle || !vic->reverse
+	|| !vic->line)
+	{
+		log_error("malloc(fluid_vic) %s", strerror(errno));
+		fluid_vic_free(vic);
+		return NULL;
+	}
+
+	int bits = 0;
+	while((1 << bits) < size)
+		bits++;
+	for(int i=0; i<size; i++)
+	{
+		uint32_t r = 0;
+		for(int b=0; b<bits; b++)
+			r |= ((i >> b) & 1) << (bits - 1 - b);
+		vic->reverse[i] = r;
+	}
+	const double two_pi = 6.28318530717958648;
+	for(int k=0; k<size/2; k++)
+	{
+		double angle = two_pi * k / size;
+		vic->twiddle[2*k] = (float)cos(angle);
+		vic->twiddle[2*k+1] = (float)-sin(angle);
+	}
+	return vic;
+}
+
+// make sure there is room to bucket count vortons
+static int fluid_vic_reserve(struct fluid_vic *vic, int count)
+{
+	if(vic->capacity >= count)
+		return 0;
+	free(vic->plane);
+	free(vic->order);
+	vic->plane = malloc(count * sizeof(uint32_t));
+	vic->order = malloc(count * sizeof(uint32_t));
+	if(!vic->plane || !vic->order)
+	{
+		log_error("malloc(fluid_vic) %s", strerror(errno));
+		free(vic->plane);
+		free(vic->order);
+		vic->plane = vic->order = NULL;
+		vic->capacity = 0;
+		return 1;
+	}
+	vic->capacity = count;
+	return 0;
+}
+
+// Radix 2 FFT of FLUID_VIC_WIDTH lines of n complex values in place,
+// unscaled either way. Point i of line b is re[i*width + b] and im.
+static void fluid_vic_fft(float *re, float *im, int n, const uint32_t *reverse,
+	const float *twiddle, int inverse)
+{
+	const int width = FLUID_VIC_WIDTH;
+	for(int i=0; i<n; i++)
+	{
+		uint32_t j = reverse[i];
+		if(j <= (uint32_t)i)
+			continue;
+		for(int b=0; b<width; b++)
+		{
+			float r = re[i*width + b], m = im[i*width + b];
+			re[i*width + b] = re[j*width + b];
+			im[i*width + b] = im[j*width + b];
+			re[j*width + b] = r;
+			im[j*width + b] = m;
+		}
+	}
+	float sign = inverse ? -1.0f : 1.0f;
+	for(int len=2; len<=n; len*=2)
+	{
+		int half = len / 2;
+		int step = n / len;
+		for(int i=0; i<n; i+=len)
+		for(int k=0; k<half; k++)
+		{
+			float wr = twiddle[2*k*step];
+			float wi = twiddle[2*k*step+1] * sign;
+			float *restrict ur = re + (i+k)*width;
+			float *restrict ui = im + (i+k)*width;
+			float *restrict vr = re + (i+k+half)*width;
+			float *restrict vi = im + (i+k+half)*width;
+			for(int b=0; b<width; b++)
+			{
+				float tr = vr[b]*wr - vi[b]*wi;
+				float ti = vr[b]*wi + vi[b]*wr;
+				vr[b] = ur[b] - tr;
+				vi[b] = ui[b] - ti;
+				ur[b] += tr;
+				ui[b] += ti;
+			}
+		}
+	}
+}
+
+// Transform some lines along one axis, the rest of the grid is left
+// alone. Neighbouring lines go together while they share the other axis
+static void fluid_vic_lines(void *data, int start, int end, int thread)
+{
+	struct fluid_vic_job *job = data;
+	struct fluid_vic *vic = job->vic;
+	const int width = FLUID_VIC_WIDTH;
+	int size = vic->size;
+	float *re = vic->line + (size_t)thread * size * 2 * width;
+	float *im = re + size * width;
+	size_t stride = 1, across = size, along = (size_t)size * size;
+	if(job->axis == 1)
+	{
+		stride = size;
+		across = 1;
+	}
+	else if(job->axis == 2)
+	{
+		stride = (size_t)size * size;
+		across = 1;
+		along = size;
+	}
+
+	int l = start;
+	while(l < end)
+	{
+		int lanes = nmin(width, nmin(end - l, job->across - l % job->across));
+		size_t base = (l % job->across) * across + (l / job->across) * along;
+		for(int a=0; a<job->arrays; a++)
+		{
+			float *x = job->data[a];
+			for(int i=0; i<size; i++)
+			{
+				const float *from = x + 2*(base + i*stride);
+				int b = 0;
+				for(; b<lanes; b++)
+				{
+					re[i*width + b] = from[2*b*across];
+					im[i*width + b] = from[2*b*across + 1];
+				}
+				for(; b<width; b++)
+					re[i*width + b] = im[i*width + b] = 0.0f;
+			}
+			fluid_vic_fft(re, im, size, vic->reverse, vic->twiddle, job->inverse);
+			if(job->convolve)
+			{
+				for(int i=0; i<size; i++)
+				for(int b=0; b<lanes; b++)
+				{
+					float g = vic->green[base + b*across + i*stride];
+					re[i*width + b] *= g;
+					im[i*width + b] *= g;
+				}
+				fluid_vic_fft(re, im, size, vic->reverse, vic->twiddle, 1);
+			}
+			for(int i=0; i<size; i++)
+			{
+				float *to = x + 2*(base + i*stride);
+				for(int b=0; b<lanes; b++)
+				{
+					to[2*b*across] = re[i*width + b];
+					to[2*b*across + 1] = im[i*width + b];
+				}
+			}
+		}
+		l += lanes;
+	}
+}
+
+// one pass of transforms over across * lines lines along axis
+static void fluid_vic_pass(struct fluid_sim *sim, struct fluid_vic_job *job,
+	int axis, int across, int lines, int inverse, int convolve)
+{
+	job->axis = axis;
+	job->across = across;
+	job->inverse = inverse;
+	job->convolve = convolve;
+	thread_pool_run(sim->pool, across * lines, FLUID_VIC_LINES, fluid_vic_lines, job);
+}
+
+// The transform of 1/r between points step apart, over the doubled grid
+// where an offset past half way is negative. The point itself takes the
+// mean over its cell. With a split it is 1/r smoothed by a Gaussian of
+// that deviation instead, erf(r / (split root 2)) / r, and the curl is
+// fourth order. It is scaled to undo both transforms.
+static void fluid_vic_green(struct fluid_sim *sim, struct fluid_vic *vic, vec3 step, float split)
+{
+	int size = vic->size;
+	int cells = vic->cells;
+	float *g = vic->a;
+	for(int z=0; z<size; z++)
+	for(int y=0; y<size; y++)
+	for(int x=0; x<size; x++)
+	{
+		float dx = (x <= cells ? x : x - size) * step.x;
+		float dy = (y <= cells ? y : y - size) * step.y;
+		float dz = (z <= cells ? z : z - size) * step.z;
+		size_t i = x + (size_t)size * (y + (size_t)size * z);
+		float r2 = dx*dx + dy*dy + dz*dz;
+		if(split > 0.0f)
+			g[2*i] = r2 > 0.0f ? erff(sqrtf(r2) * FLUID_VIC_ROOT_HALF / split) / sqrtf(r2)
+				: FLUID_VIC_ROOT_2_OVER_PI / split;
+		else
+			g[2*i] = r2 > 0.0f ? 1.0f / sqrtf(r2)
+				: FLUID_VIC_SELF / cbrtf(step.x * step.y * step.z);
+		g[2*i+1] = 0.0f;
+	}
+
+	struct fluid_vic_job job;
+	memset(&job, 0, sizeof(job));
+	job.vic = vic;
+	job.data[0] = g;
+	job.arrays = 1;
+	fluid_vic_pass(sim, &job, 0, size, size, 0, 0);
+	fluid_vic_pass(sim, &job, 1, size, size, 0, 0);
+	fluid_vic_pass(sim, &job, 2, size, size, 0, 0);
+
+	float scale = 1.0f / ((float)size * size * size);
+	size_t points = (size_t)size * size * size;
+	for(size_t i=0; i<points; i++)
+		vic->green[i] = g[2*i] * scale;
+	if(split > 0.0f)
+	{
+		// Undo the spreading over each cell, and the same again for the
+		// trilinear sampling, sinc^2 along each axis for each. The
+		// Gaussian leaves next to nothing where they are small.
+		float *undo = vic->line;	// free between passes
+		for(int m=0; m<size; m++)
+		{
+			double x = 3.14159265358979324 * (m <= cells ? m : m - size) / size;
+			double sinc = m ? sin(x) / x : 1.0;
+			undo[m] = (float)(1.0 / (sinc * sinc * sinc * sinc));
+		}
+		for(int z=0; z<size; z++)
+		for(int y=0; y<size; y++)
+		for(int x=0; x<size; x++)
+			vic->green[x + (size_t)size * (y + (size_t)size * z)] *= undo[x] * undo[y] * undo[z];
+	}
+	vic->step = step;
+	vic->split = split;
+}
+
+// find the plane of each vorton
+static void fluid_vic_plane(void *data, int start, int end, int thread)
+{
+	struct fluid_vic_job *job = data;
+	struct fluid_sim *sim = job->sim;
+	struct fluid_grid *grid = sim->grid;
+	struct vorton_soa *vortons = &sim->vortons;
+	uint32_t *plane = job->vic->plane;
+
+	for(int i=start; i<end; i++)
+	{
+		vec3 position = (vec3){{vortons->px[i], vortons->py[i], vortons->pz[i]}};
+		if(!particle_inside_bound(position, grid->origin, grid->volume))
+		{
+			plane[i] = FLUID_VIC_NONE;
+			continue;
+		}
+		int cz = (int)((position.z - grid->origin.z) * grid->inverse_step.z);
+		plane[i] = nmin(cz, grid->cells - 1);
+	}
+}
+
+// Spread the vortons of some planes of cells over their corners, a plane
+// writes to its own points and the next, so planes of one parity at a
+// time can be spread in parallel
+static void fluid_vic_spread(void *data, int start, int end, int thread)
+{
+	struct fluid_vic_job *job = data;
+	struct fluid_sim *sim = job->sim;
+	struct fluid_vic *vic = job->vic;
+	struct fluid_grid *grid = sim->grid;
+	struct vorton_soa *vortons = &sim->vortons;
+	size_t element = job->element;
+	size_t dy = job->dy, dz = job->dz;
+	float *fx = job->field[0], *fy = job->field[1], *fz = job->field[2];
+
+	for(int p=start; p<end; p++)
+	{
+		int plane = 2*p + job->parity;
+		for(uint32_t o=vic->start[plane]; o<vic->start[plane+1]; o++)
+		{
+			uint32_t i = vic->order[o];
+			float g[3] = {
+				(vortons->px[i] - grid->origin.x) * grid->inverse_step.x,
+				(vortons->py[i] - grid->origin.y) * grid->inverse_step.y,
+				(vortons->pz[i] - grid->origin.z) * grid->inverse_step.z };
+			int c[3];
+			float f[3];
+			for(int d=0; d<3; d++)
+			{
+				c[d] = nmin((int)g[d], grid->cells - 1);
+				f[d] = g[d] - (float)c[d];
+			}
+			float wx = vortons->wx[i] * job->factor;
+			float wy = vortons->wy[i] * job->factor;
+			float wz = vortons->wz[i] * job->factor;
+			size_t cell = c[0] + c[1] * dy + c[2] * dz;
+			for(int k=0; k<8; k++)
+			{
+				float weight = ((k & 1) ? f[0] : 1.0f - f[0])
+					* ((k & 2) ? f[1] : 1.0f - f[1])
+					* ((k & 4) ? f[2] : 1.0f - f[2]);
+				size_t n = cell + (k & 1) + ((k >> 1) & 1) * dy + ((k >> 2) & 1) * dz;
+				fx[element*n] += wx * weight;
+				fy[element*n] += wy * weight;
+				fz[element*n] += wz * weight;
+			}
+		}
+	}
+}
+
+// one derivative along an axis at point c of cells + 1, from values
+// stride points apart, over two strides, one sided at the ends, and to
+// fourth order where there is room if asked
+static inline float fluid_vic_derivative(const float *f, size_t element, size_t at,
+	size_t stride, int c, int cells, int order4)
+{
+	if(c == 0)
+		return -3.0f * f[element*at] + 4.0f * f[element*(at + stride)]
+			- f[element*(at + 2*stride)];
+	if(c == cells)
+		return 3.0f * f[element*at] - 4.0f * f[element*(at - stride)]
+			+ f[element*(at - 2*stride)];
+	if(order4 && c >= 2 && c <= cells - 2)
+		return (8.0f * (f[element*(at + stride)] - f[element*(at - stride)])
+			- (f[element*(at + 2*stride)] - f[element*(at - 2*stride)])) * (1.0f / 6.0f);
+	return f[element*(at + stride)] - f[element*(at - stride)];
+}
+
+// velocity at some grid points, the curl of the stream function
+static void fluid_vic_curl(void *data, int start, int end, int thread)
+{
+	struct fluid_vic_job *job = data;
+	struct fluid_sim *sim = job->sim;
+	struct fluid_vic *vic = job->vic;
+	struct fluid_grid *grid = sim->grid;
+	int points = grid->points;
+	int cells = vic->cells;
+	size_t element = job->element;
+	size_t dy = job->dy, dz = job->dz;
+	int order4 = vic->split > 0.0f;
+	// the derivatives are over two steps
+	float scale = sim->smoothing->scale * 0.5f;
+	float sx = grid->inverse_step.x * scale;
+	float sy = grid->inverse_step.y * scale;
+	float sz = grid->inverse_step.z * scale;
+	// the stream function's x, y and z
+	const float *psx = job->field[0], *psy = job->field[1], *psz = job->field[2];
+
+	for(int i=start; i<end; i++)
+	{
+		int x = i % points;
+		int y = (i / points) % points;
+		int z = i / (points * points);
+		size_t at = x + y * dy + z * dz;
+		grid->vx[i] = sy * fluid_vic_derivative(psz, element, at, dy, y, cells, order4)
+			- sz * fluid_vic_derivative(psy, element, at, dz, z, cells, order4);
+		grid->vy[i] = sz * fluid_vic_derivative(psx, element, at, dz, z, cells, order4)
+			- sx * fluid_vic_derivative(psz, element, at, 1, x, cells, order4);
+		grid->vz[i] = sx * fluid_vic_derivative(psy, element, at, 1, x, cells, order4)
+			- sy * fluid_vic_derivative(psx, element, at, dy, y, cells, order4);
+	}
+}
+
+// Fill the velocity grid from the vortons by vortex-in-cell, resizing it
+// if sim->grid_cells has changed. A split above 0 leaves out what is
+// within a few splits of each vorton, see fluid_p3m.c, and is always open.
+// returns 0 on success
+int fluid_vic_update(struct fluid_sim *sim, float split)
+{
+	if(fluid_grid_fit(sim))
+		return 1;
+	struct fluid_grid *grid = sim->grid;
+	int threads = thread_pool_size(sim->pool);
+	enum fluid_boundary boundary = split > 0.0f ? FLUID_BOUNDARY_OPEN : sim->boundary;
+	if(sim->vic == NULL || sim->vic->cells != grid->cells || sim->vic->threads != threads
+	|| sim->vic->boundary != boundary)
+	{
+		fluid_vic_free(sim->vic);
+		sim->vic = fluid_vic_init(grid->cells, threads, boundary);
+		if(sim->vic == NULL)
+			return 1;
+	}
+	struct fluid_vic *vic = sim->vic;
+	int count = sim->vortons.count;
+	if(fluid_vic_reserve(vic, count))
+		return 1;
+
+	int cells = vic->cells;
+	int size = vic->size;
+	vec3 step = (vec3){{1.0f / grid->inverse_step.x, 1.0f / grid->inverse_step.y, 1.0f / grid->inverse_step.z}};
+
+	struct fluid_vic_job job;
+	memset(&job, 0, sizeof(job));
+	job.sim = sim;
+	job.vic = vic;
+
+	// bucket the vortons by plane, as fluid_diffuse() does by leaf, and
+	// after filling, plane n holds order[start[n]] up to order[start[n+1]]
+	thread_pool_run(sim->pool, count, FLUID_VIC_BLOCK, fluid_vic_plane, &job);
+	uint32_t *start = vic->start;
+	memset(start, 0, (cells + 2) * sizeof(uint32_t));
+	for(int i=0; i<count; i++)
+		if(vic->plane[i] != FLUID_VIC_NONE)
+			start[vic->plane[i] + 2]++;
+	for(int n=0; n<cells; n++)
+		start[n+2] += start[n+1];
+	for(int i=0; i<count; i++)
+		if(vic->plane[i] != FLUID_VIC_NONE)
+			vic->order[start[vic->plane[i] + 1]++] = i;
+
+	if(vic->boundary == FLUID_BOUNDARY_WALLS)
+	{
+		// each component straight onto the finest level, as the right
+		// hand side of -laplacian(psi) = 4 pi w, a vorton's vorticity
+		// being spread over one cell's volume
+		struct fluid_multigrid_level *fine = &vic->mg[0]->level[0];
+		size_t points = (size_t)(cells + 3) * (cells + 3) * (cells + 3);
+		for(int c=0; c<3; c++)
+		{
+			memset(vic->mg[c]->level[0].f, 0, points * sizeof(float));
+			job.field[c] = vic->mg[c]->level[0].f + fine->origin;
+		}
+		job.element = 1;
+		job.dy = fine->dy;
+		job.dz = fine->dz;
+		const float four_pi = 12.5663706f;
+		job.factor = four_pi * grid->inverse_step.x * grid->inverse_step.y * grid->inverse_step.z;
+		for(job.parity=0; job.parity<2; job.parity++)
+			thread_pool_run(sim->pool, cells / 2, 1, fluid_vic_spread, &job);
+
+		for(int c=0; c<3; c++)
+		{
+			fluid_multigrid_solve(vic->mg[c], sim->pool, step, sim->multigrid_cycles);
+			job.field[c] = vic->mg[c]->level[0].u + fine->origin;
+		}
+		thread_pool_run(sim->pool, grid->points * grid->points * grid->points,
+			FLUID_VIC_CHUNK, fluid_vic_curl, &job);
+		return 0;
+	}
+
+	if(step.x != vic->step.x || step.y != vic->step.y || step.z != vic->step.z
+	|| split != vic->split)
+		fluid_vic_green(sim, vic, step, split);
+	job.data[0] = vic->a;
+	job.data[1] = vic->b;
+	job.arrays = 2;
+	job.field[0] = vic->a;
+	job.field[1] = vic->a + 1;
+	job.field[2] = vic->b;
+	job.element = 2;
+	job.dy = size;
+	job.dz = (size_t)size * size;
+	job.factor = 1.0f;
+
+	size_t points = (size_t)size * size * size;
+	memset(vic->a, 0, points * 2 * sizeof(float));
+	memset(vic->b, 0, points * 2 * sizeof(float));
+	for(job.parity=0; job.parity<2; job.parity++)
+		thread_pool_run(sim->pool, cells / 2, 1, fluid_vic_spread, &job);
+
+	// Only the first cells + 1 along each axis are not zero on the way
+	// in, or wanted on the way out, so the lines that are all padding
+	// are left alone. Along z each line is convolved and brought back.
+	int span = cells + 1;
+	fluid_vic_pass(sim, &job, 0, span, span, 0, 0);
+	fluid_vic_pass(sim, &job, 1, size, span, 0, 0);
+	fluid_vic_pass(sim, &job, 2, size, size, 0, 1);
+	fluid_vic_pass(sim, &job, 1, size, span, 1, 0);
+	fluid_vic_pass(sim, &job, 0, span, span, 1, 0);
+
+	thread_pool_run(sim->pool, grid->points * grid->points * grid->points,
+		FLUID_VIC_CHUNK, fluid_vic_curl, &job);
+	return 0;
+}
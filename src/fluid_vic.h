@@ -0,0 +1,58 @@
+/*
+Copyright (c) 2020 Daniel Burke
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+#ifndef __DPB_FLUID_VIC_H__
+#define __DPB_FLUID_VIC_H__
+
+#include <stdint.h>
+#include "3dmaths.h"
+#include "fluid.h"
+
+
+// Vortex-in-cell, workspace for the stream function of the vorticity on
+// the velocity grid, found by FFT over a grid twice as wide, or with
+// walls by multigrid
+struct fluid_vic {
+	int cells;		// of the velocity grid along each axis, a power of two
+	enum fluid_boundary boundary;
+	struct fluid_multigrid *mg[3];	// per component, for FLUID_BOUNDARY_WALLS
+	int size;		// of the transforms along each axis, twice cells
+	vec3 step;		// the spacing green was made for
+	float split;		// and the smoothing, see fluid_vic_update()
+	// the rest are only for FLUID_BOUNDARY_OPEN
+	float *a, *b;		// size^3 complex, x + iy and z of the vorticity,
+				// and then of the stream function
+	float *green;		// size^3, the transform of 1/r, real as 1/r is even
+	float *twiddle;		// size/2 complex
+	uint32_t *reverse;	// size, each index with its bits reversed
+	int threads;
+	float *line;		// per thread, size complex for each of FLUID_VIC_WIDTH lines
+	int capacity;		// vortons
+	uint32_t *plane;	// per vorton, the cell it is in along z
+	uint32_t *order;	// vortons, bucketed by plane
+	uint32_t *start;	// per plane, where its vortons begin in order
+};
+
+void fluid_vic_free(struct fluid_vic *vic);
+int fluid_vic_update(struct fluid_sim *sim, float split);
+
+#endif
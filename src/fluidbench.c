@@ -0,0 +1,129 @@
+/*
+Copyright (c) 2020 Daniel Burke
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+// Times fluid_velocity_batch() in each of its octtree walks, on a tree
+// much larger than cache, against asking fluid_tree_velocity() about each
+// position in the order given.
+// usage: fluidbench [vortons] [queries] [depth] [theta]
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <math.h>
+
+#include "fluid.h"
+#include "fluid_batch.h"
+
+static float bench_random(void)
+{
+	return (float)rand() / (float)RAND_MAX;
+}
+
+static double bench_time(void)
+{
+	struct timespec now;
+	timespec_get(&now, TIME_UTC);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+int main(int argc, char *argv[])
+{
+	int vortons = argc > 1 ? atoi(argv[1]) : 1000000;
+	int queries = argc > 2 ? atoi(argv[2]) : 200000;
+	int depth = argc > 3 ? atoi(argv[3]) : 7;
+
+	struct fluid_sim *sim = fluid_init(1, 1, 1, depth);
+	if(sim == NULL)
+		return 1;
+	if(argc > 4)
+		sim->theta = atof(argv[4]);
+	srand(1);
+	for(int i=0; i<vortons; i++)
+	{
+		vec3 p = {{bench_random(), bench_random(), bench_random()}};
+		vec3 w = {{bench_random() - 0.5f, bench_random() - 0.5f, bench_random() - 0.5f}};
+		fluid_add_vorton(sim, p, w);
+	}
+	fluid_tree_update(sim);
+
+	vec3 *positions = malloc(queries * sizeof(vec3));
+	vec3 *single = malloc(queries * sizeof(vec3));
+	vec3 *out = malloc(queries * sizeof(vec3));
+	if(!positions || !single || !out)
+		return 1;
+	for(int i=0; i<queries; i++)
+		positions[i] = (vec3){{bench_random(), bench_random(), bench_random()}};
+
+	size_t bytes = (size_t)sim->octtree->node_count * (sizeof(struct octtree_node) + 11 * sizeof(float))
+		+ (size_t)vortons * 11 * sizeof(float);
+	printf("%d vortons, %u nodes, %.1f MB of tree, %d queries, theta %g\n",
+		vortons, sim->octtree->node_count, bytes / 1e6, queries, sim->theta);
+
+	// the baseline, one walk at a time in the order given
+	double base = 1e30;
+	for(int r=0; r<3; r++)
+	{
+		double start = bench_time();
+		for(int i=0; i<queries; i++)
+			single[i] = fluid_tree_velocity(sim, positions[i]);
+		double taken = bench_time() - start;
+		if(taken < base)
+			base = taken;
+	}
+	printf("%-10s %8.4f s %10.0f queries/s\n", "one by one", base, queries / base);
+
+	const char *names[] = {"single", "packet", "local", "cached"};
+	enum fluid_batch_mode modes[] = {FLUID_BATCH_SINGLE, FLUID_BATCH_PACKET,
+		FLUID_BATCH_LOCAL, FLUID_BATCH_CACHED};
+	for(int m=0; m<4; m++)
+	{
+		sim->batch_mode = modes[m];
+		// once to warm up, and for cached to make its lists, then the
+		// best of three
+		fluid_velocity_batch(sim, positions, queries, out);
+		double best = 1e30;
+		for(int r=0; r<3; r++)
+		{
+			double start = bench_time();
+			fluid_velocity_batch(sim, positions, queries, out);
+			double taken = bench_time() - start;
+			if(taken < best)
+				best = taken;
+		}
+
+		double diff = 0.0, size = 0.0;
+		for(int i=0; i<queries; i++)
+		{
+			diff += sqrtf(mag(sub(out[i], single[i])));
+			size += sqrtf(mag(single[i]));
+		}
+		printf("%-10s %8.4f s %10.0f queries/s  x%.2f  difference %g\n",
+			names[m], best, queries / best, base / best, diff / size);
+	}
+
+	free(positions);
+	free(single);
+	free(out);
+	fluid_end(sim);
+	return 0;
+}
@@ -30,6 +30,7 @@ freely, subject to the following restrictions:
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
 
 #include "shader.h"
 #include "log.h"
@@ -41,6 +42,7 @@ static void fluidtest_build_lines(struct fluid_sim * sim);
 
 struct fluid_sim * sim;
 struct particle *particles;
+struct particle *particles_drawn;	// between the last two steps
 int n_part;
 
 struct GLSLSHADER *particle_shader;
@@ -53,12 +55,17 @@ GLuint b_fluid_line_vecs;
 vec3 *line_vecs;
 
 
-void fluidtest_init(void)
+int fluidtest_init(void)
 {
 	float s;
 
 	n_part = 30*30*30;
 	particles = malloc(sizeof(struct particle)*n_part + 30*30);
+	if(particles == NULL)
+	{
+		log_error("malloc(particles) %s", strerror(errno));
+		return 1;
+	}
 
 	float scale = 1.0 / 30.;
 	int i=0;
@@ -79,21 +86,32 @@ void fluidtest_init(void)
 	s = 1.0f;
 
 	sim = fluid_init(s,s,s, 2);
+	if(sim == NULL)
+	{
+		log_error("fluid_init() failed");
+		return 1;
+	}
 
-	struct vorton* vorton = &sim->vortons[sim->octtree->node_pool_size];
-	vorton->p = (vec3){{0.2, 0.2, 0.2}};
-	vorton->w = (vec3){{1.0, 0.0, 0.0}};
-	sim->vorton_count++;
-	vorton = &sim->vortons[sim->octtree->node_pool_size+1];
-	vorton->p = (vec3){{0.8, 0.8, 0.8}};
-	vorton->w = (vec3){{1.0, 0.0, 0.0}};
-	sim->vorton_count++;
+	fluid_add_vorton(sim, (vec3){{0.2, 0.2, 0.2}}, (vec3){{1.0, 0.0, 0.0}});
+	fluid_add_vorton(sim, (vec3){{0.8, 0.8, 0.8}}, (vec3){{1.0, 0.0, 0.0}});
+	if(fluid_tracers(sim, particles, n_part))
+	{
+		log_error("fluid_tracers() failed");
+		return 1;
+	}
+	particles_drawn = malloc(sizeof(struct particle)*n_part);
+	if(particles_drawn == NULL)
+	{
+		log_error("malloc(particles_drawn) %s", strerror(errno));
+		return 1;
+	}
+	memcpy(particles_drawn, particles, sizeof(struct particle)*n_part);
 
 	glGenVertexArrays(1, &va_fluid);
 	glBindVertexArray(va_fluid);
 	glGenBuffers(1, &b_fluid);
 	glBindBuffer(GL_ARRAY_BUFFER, b_fluid);
-	glBufferData(GL_ARRAY_BUFFER, n_part * sizeof(struct particle), particles, GL_DYNAMIC_DRAW);
+	glBufferData(GL_ARRAY_BUFFER, n_part * sizeof(struct particle), particles_drawn, GL_DYNAMIC_DRAW);
 	glEnableVertexAttribArray(0);
 	glEnableVertexAttribArray(3);
 	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 16, (void*)0);
@@ -117,6 +135,11 @@ void fluidtest_init(void)
 	int cells = 1 << (sim->max_depth);
 	int line_vecs_size = (cells+1)*(cells+1)*6 * sizeof(vec3);
 	line_vecs = malloc(line_vecs_size);
+	if(line_vecs == NULL)
+	{
+		log_error("malloc(line_vecs) %s", strerror(errno));
+		return 1;
+	}
 	fluidtest_build_lines(sim);
 	glGenVertexArrays(1, &va_fluid_line_vecs);
 	glBindVertexArray(va_fluid_line_vecs);
@@ -127,15 +150,14 @@ void fluidtest_init(void)
 	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 12, (void*)0);
 	glBindVertexArray(0);
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
-
+	return 0;
 }
 
-void fluidtest_tick(void)
+void fluidtest_tick(float frametime)
 {
-	// advec3 the fluid
-	fluid_tree_update(sim);
-	fluid_tick(sim);
-	fluid_advect_tracers(sim, particles, n_part);
+	// advec3 the fluid, and the tracers with it
+	fluid_tick(sim, frametime);
+	fluid_tracers_interpolate(sim, particles_drawn);
 	// for(int i=0; i< n_part; i++)
 	// {
 	// 	fluid_bound(sim, &particles[i]);
@@ -222,7 +244,7 @@ void fluidtest_draw(mat4x4 modelview, mat4x4 projection)
 	glUniformMatrix4fv(particle_shader->uniforms[1], 1, GL_TRUE, projection.f);
 	glBindVertexArray(va_fluid);
 	glBindBuffer(GL_ARRAY_BUFFER, b_fluid);
-	glBufferData(GL_ARRAY_BUFFER, n_part * sizeof(struct particle), particles, GL_DYNAMIC_DRAW);
+	glBufferData(GL_ARRAY_BUFFER, n_part * sizeof(struct particle), particles_drawn, GL_DYNAMIC_DRAW);
 	glDrawArrays( GL_POINTS, 0, 30*30*30);
 
 
@@ -22,6 +22,6 @@ freely, subject to the following restrictions:
 */
 #include "3dmaths.h"
 
-void fluidtest_init(void);
-void fluidtest_tick(void);
+int fluidtest_init(void);
+void fluidtest_tick(float frametime);
 void fluidtest_draw(mat4x4 modelview, mat4x4 projection);
@@ -71,7 +71,8 @@ int main_init(int argc, char *argv[])
 	log_info("glGetIntVer : %d.%d", gl_major_version, gl_minor_version);
 //	glEnable(GL_FRAMEBUFFER_SRGB);
 
-	fluidtest_init();
+	if(fluidtest_init())
+		return 1;
 
 	mesh_shader = shader_load(
 		"data/shaders/mesh.vert",
@@ -161,7 +162,10 @@ void render(mat4x4 view, mat4x4 projection)
 void main_loop(void)
 {
 	spacemouse_tick();
-	fluidtest_tick();
+	// the fluid keeps its own clock, it only needs to know how long a frame was
+	float last_time = time;
+	time = (float)(sys_time() - time_start)/(float)sys_ticksecond;
+	fluidtest_tick(time - last_time);
 
 	// do normal render loop stuff
 	// if(step > 2*M_PI)
@@ -204,6 +208,5 @@ void main_loop(void)
 
 	fps_movement(&position, &angle, 0.007);
 
-	time = (float)(sys_time() - time_start)/(float)sys_ticksecond;
 	gfx_swap();
 }
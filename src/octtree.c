@@ -39,33 +39,91 @@ struct octtree* octtree_init(uint32_t size)
 		log_error("malloc(octtree) %s", strerror(errno));
 		return NULL;
 	}
+	memset(ret, 0, sizeof(struct octtree));
 	ret->origin = (vec3){{0.0, 0.0, 0.0}};
 	ret->volume = (vec3){{1.0, 1.0, 1.0}};
-	ret->node_pool_size = size;
-	ret->node_pool = malloc(size * sizeof(struct octtree_node));
-	if(ret->node_pool == NULL)
+	if(octtree_reserve(ret, size))
 	{
-		log_error("malloc(node_pool) %s", strerror(errno));
-		free(ret);
+		octtree_free(ret);
 		return NULL;
 	}
-	memset(ret->node_pool, 0, size * sizeof(struct octtree_node));
 	ret->node_count = 1; // there is always a root node
 	return ret;
 }
 
 void octtree_free(struct octtree* octtree)
 {
+	for(uint32_t i=0; i<octtree->chunk_count; i++)
+		free(octtree->node_pool[i]);
 	free(octtree->node_pool);
 	free(octtree);
 }
 
+// Only the nodes in use are cleared, everything past node_count is
+// already zero, from calloc() or from the last time it was emptied
 void octtree_empty(struct octtree* octtree)
 {
-	memset(octtree->node_pool, 0, octtree->node_pool_size * sizeof(struct octtree_node));
+	uint32_t remaining = octtree->node_count;
+	for(uint32_t i=0; remaining > 0; i++)
+	{
+		uint32_t count = remaining < OCTTREE_CHUNK ? remaining : OCTTREE_CHUNK;
+		memset(octtree->node_pool[i], 0, count * sizeof(struct octtree_node));
+		remaining -= count;
+	}
 	octtree->node_count = 1;
 }
 
+// Make sure there is room for size nodes, existing nodes stay where they are
+// returns 0 on success
+int octtree_reserve(struct octtree* octtree, uint32_t size)
+{
+	if(size > OCTTREE_MAX_NODES)
+	{
+		log_error("octtree_reserve() %u nodes is more than %u", size, OCTTREE_MAX_NODES);
+		return 1;
+	}
+	uint32_t chunks = (size + OCTTREE_CHUNK - 1) >> OCTTREE_CHUNK_BITS;
+	if(chunks == 0)
+		chunks = 1;
+	if(chunks <= octtree->chunk_count)
+		return 0;
+
+	struct octtree_node **node_pool = realloc(octtree->node_pool, chunks * sizeof(struct octtree_node*));
+	if(node_pool == NULL)
+	{
+		log_error("realloc(node_pool) %s", strerror(errno));
+		return 1;
+	}
+	octtree->node_pool = node_pool;
+	while(octtree->chunk_count < chunks)
+	{
+		struct octtree_node *chunk = calloc(OCTTREE_CHUNK, sizeof(struct octtree_node));
+		if(chunk == NULL)
+		{
+			log_error("calloc(node_pool chunk) %s", strerror(errno));
+			return 1;
+		}
+		node_pool[octtree->chunk_count++] = chunk;
+		octtree->node_pool_size = octtree->chunk_count << OCTTREE_CHUNK_BITS;
+	}
+	return 0;
+}
+
+// Take the next free node, growing the pool if it is full
+// returns 0 if there was no room, as the root can never be a new node
+uint32_t octtree_add_node(struct octtree* octtree)
+{
+	if(octtree->node_count >= octtree->node_pool_size)
+	{
+		if(octtree_reserve(octtree, octtree->node_count + 1))
+		{
+			log_warning("Attempted to add too many nodes");
+			return 0;
+		}
+	}
+	return octtree->node_count++;
+}
+
 
 
 int octtree_child_position(vec3 position, vec3 half_volume)
@@ -81,7 +139,7 @@ vec3 octtree_child_relative(vec3 position, vec3 half_volume)
 {
 	vec3 ret = position;
 	if(position.x > half_volume.x)ret.x = ret.x-half_volume.x;
-	if(position.y > half_volume.y)ret.y = ret.z-half_volume.y;
+	if(position.y > half_volume.y)ret.y = ret.y-half_volume.y;
 	if(position.z > half_volume.z)ret.z = ret.z-half_volume.z;
 	return ret;
 }
@@ -108,17 +166,14 @@ int octtree_find(struct octtree* octtree, vec3 position, int depth)
 		int offset = octtree_child_position(rel_position, node_volume);
 		rel_position = octtree_child_relative(rel_position, node_volume);
 		// no node here, add one
-		if(octtree->node_pool[current_node].node[offset] == 0)
+		if(octtree_node(octtree, current_node)->node[offset] == 0)
 		{
-			if(octtree->node_count >= octtree->node_pool_size)
-			{
-				log_warning("Attempted to add too many nodes");
+			uint32_t node = octtree_add_node(octtree);
+			if(node == 0)
 				return 0;
-			}
-			octtree->node_pool[current_node].node[offset] = octtree->node_count;
-			octtree->node_count++;
+			octtree_node(octtree, current_node)->node[offset] = node;
 		}
-		current_node = octtree->node_pool[current_node].node[offset];
+		current_node = octtree_node(octtree, current_node)->node[offset];
 		if(i >= depth)
 		{
 			return current_node;
@@ -32,10 +32,17 @@ struct octtree_node {
 	uint32_t leaf[8];
 };
 
+// nodes are allocated in chunks, so growing the pool never moves a node
+#define OCTTREE_CHUNK_BITS 12
+#define OCTTREE_CHUNK (1u << OCTTREE_CHUNK_BITS)
+// the most nodes a pool holds, so its size rounded up to chunks still fits
+#define OCTTREE_MAX_NODES (UINT32_MAX - OCTTREE_CHUNK)
+
 struct octtree {
-	uint32_t node_pool_size;
+	uint32_t node_pool_size;	// a whole number of chunks
 	uint32_t node_count;
-	struct octtree_node *node_pool;
+	uint32_t chunk_count;
+	struct octtree_node **node_pool;	// chunks of OCTTREE_CHUNK nodes
 	vec3 origin;
 	vec3 volume;
 };
@@ -43,8 +50,16 @@ struct octtree {
 struct octtree* octtree_init(uint32_t size);
 void octtree_free(struct octtree* octtree);
 void octtree_empty(struct octtree* octtree);
+int octtree_reserve(struct octtree* octtree, uint32_t size);
+uint32_t octtree_add_node(struct octtree* octtree);
 int octtree_find(struct octtree* octtree, vec3 position, int depth);
 int octtree_child_position(vec3 position, vec3 half_volume) __attribute__((const));
 vec3 octtree_child_relative(vec3 position, vec3 half_volume) __attribute__((const));
 
+// find a node from its index
+static inline struct octtree_node* octtree_node(struct octtree* octtree, uint32_t index)
+{
+	return &octtree->node_pool[index >> OCTTREE_CHUNK_BITS][index & (OCTTREE_CHUNK - 1)];
+}
+
 #endif
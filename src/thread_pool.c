@@ -0,0 +1,218 @@
+/*
+Copyright (c) 2020 Daniel Burke
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+// A fixed pool of worker threads, that split a range of items into chunks.
+// Workers take the next chunk as they finish the last, so uneven work still
+// balances. The calling thread works too, as thread 0.
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "log.h"
+#include "thread_pool.h"
+
+struct thread_pool_worker {
+	struct thread_pool *pool;
+	int index;
+	pthread_t thread;
+};
+
+struct thread_pool {
+	int size;
+	struct thread_pool_worker *workers;
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	unsigned generation;	// bumped for every job
+	int busy;		// workers still on this job
+	int quit;
+
+	// the current job
+	thread_pool_fn fn;
+	void *data;
+	int count;
+	int chunk;
+	atomic_int next;
+};
+
+static int thread_pool_cores(void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+#else
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	return cores > 0 ? (int)cores : 1;
+#endif
+}
+
+// take chunks until there are none left
+static void thread_pool_work(struct thread_pool *pool, int thread)
+{
+	while(1)
+	{
+		int start = atomic_fetch_add(&pool->next, pool->chunk);
+		if(start >= pool->count)
+			return;
+		int end = start + pool->chunk;
+		if(end > pool->count)
+			end = pool->count;
+		pool->fn(pool->data, start, end, thread);
+	}
+}
+
+static void* thread_pool_main(void *arg)
+{
+	struct thread_pool_worker *worker = arg;
+	struct thread_pool *pool = worker->pool;
+	unsigned generation = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	while(1)
+	{
+		while(!pool->quit && pool->generation == generation)
+			pthread_cond_wait(&pool->start, &pool->lock);
+		if(pool->quit)
+			break;
+		generation = pool->generation;
+		pthread_mutex_unlock(&pool->lock);
+
+		thread_pool_work(pool, worker->index);
+
+		pthread_mutex_lock(&pool->lock);
+		pool->busy--;
+		if(pool->busy == 0)
+			pthread_cond_signal(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+// Start a pool of threads, 0 uses one per core
+struct thread_pool* thread_pool_init(int threads)
+{
+	struct thread_pool *pool;
+
+	if(threads < 1)
+		threads = thread_pool_cores();
+
+	pool = malloc(sizeof(struct thread_pool));
+	if(pool == NULL)
+	{
+		log_error("malloc(thread_pool) %s", strerror(errno));
+		return NULL;
+	}
+	memset(pool, 0, sizeof(struct thread_pool));
+	pool->workers = malloc(threads * sizeof(struct thread_pool_worker));
+	if(pool->workers == NULL)
+	{
+		log_error("malloc(thread_pool->workers) %s", strerror(errno));
+		free(pool);
+		return NULL;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	atomic_init(&pool->next, 0);
+
+	// the caller is thread 0, so start one less
+	pool->size = 1;
+	for(int i=1; i<threads; i++)
+	{
+		struct thread_pool_worker *worker = &pool->workers[i];
+		worker->pool = pool;
+		worker->index = i;
+		if(pthread_create(&worker->thread, NULL, thread_pool_main, worker))
+		{
+			log_warning("pthread_create() failed, using %d threads", pool->size);
+			break;
+		}
+		pool->size++;
+	}
+	return pool;
+}
+
+void thread_pool_free(struct thread_pool *pool)
+{
+	if(pool == NULL)
+		return;
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+	for(int i=1; i<pool->size; i++)
+		pthread_join(pool->workers[i].thread, NULL);
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->start);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->workers);
+	free(pool);
+}
+
+int thread_pool_size(struct thread_pool *pool)
+{
+	return pool ? pool->size : 1;
+}
+
+// Call fn over [0, count) in chunks, returning once every chunk is done
+// Without a pool, it all runs on the calling thread.
+void thread_pool_run(struct thread_pool *pool, int count, int chunk, thread_pool_fn fn, void *data)
+{
+	if(count <= 0)
+		return;
+	if(chunk < 1)
+		chunk = 1;
+	if(pool == NULL || pool->size == 1 || count <= chunk)
+	{
+		for(int start=0; start<count; start+=chunk)
+			fn(data, start, start+chunk < count ? start+chunk : count, 0);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->fn = fn;
+	pool->data = data;
+	pool->count = count;
+	pool->chunk = chunk;
+	atomic_store(&pool->next, 0);
+	pool->busy = pool->size - 1;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+
+	thread_pool_work(pool, 0);
+
+	pthread_mutex_lock(&pool->lock);
+	while(pool->busy)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
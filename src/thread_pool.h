@@ -0,0 +1,37 @@
+/*
+Copyright (c) 2020 Daniel Burke
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+#ifndef __DPB_THREAD_POOL_H__
+#define __DPB_THREAD_POOL_H__
+
+// called on a worker for the items [start, end), thread is 0 to size-1
+typedef void (*thread_pool_fn)(void *data, int start, int end, int thread);
+
+struct thread_pool;
+
+struct thread_pool* thread_pool_init(int threads);
+void thread_pool_free(struct thread_pool *pool);
+int thread_pool_size(struct thread_pool *pool);
+void thread_pool_run(struct thread_pool *pool, int count, int chunk, thread_pool_fn fn, void *data);
+
+#endif